@@ -0,0 +1,1665 @@
+//性能测试程序，用法: ./bench <测试名> [参数...]
+#include "board.hpp"
+#include "db.hpp"
+#include "five.hpp"
+#include "logger.hpp"
+#include "match_engine.hpp"
+#include "matcher.hpp"
+#include "metrics.hpp"
+#include "online.hpp"
+#include "proto.hpp"
+#include "room.hpp"
+#include "session.hpp"
+#include "static_cache.hpp"
+#include "timer_wheel.hpp"
+#include "user_cache.hpp"
+#include "user_file.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+//统计当前线程的内存分配次数，json测试用它计算每条消息的分配次数
+static thread_local uint64_t alloc_count = 0;
+
+void *operator new(size_t size) {
+    alloc_count++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+static double elapsed_sec(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+//发送一个短连接HTTP请求并读完响应，成功返回true
+static bool http_get(uint16_t port, const std::string &uri) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+    std::string req = "GET " + uri + " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+    if (send(fd, req.c_str(), req.size(), 0) != (ssize_t) req.size()) {
+        close(fd);
+        return false;
+    }
+    char buf[4096];
+    bool got = false;
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        got = true;
+    }
+    close(fd);
+    return got;
+}
+
+//io线程池测试：不同工作线程数下的HTTP吞吐
+//处理函数序列化一个/info大小的响应，并休眠work_us微秒模拟一次数据库往返
+static void bench_io_pool(int argc, char *argv[]) {
+    int work_us = argc > 0 ? atoi(argv[0]) : 200;
+    int clients = argc > 1 ? atoi(argv[1]) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 3.0;
+    printf("io_pool: work_us=%d clients=%d seconds=%.1f\n", work_us, clients, seconds);
+    size_t thread_nums[] = {1, 2, 4, 8, 16};
+    uint16_t port = 18080;
+    for (size_t thread_num: thread_nums) {
+        server_t srv;
+        srv.set_access_channels(websocketpp::log::alevel::none);
+        srv.set_error_channels(websocketpp::log::elevel::none);
+        srv.init_asio();
+        srv.set_reuse_addr(true);
+        srv.set_http_handler([&srv, work_us](websocketpp::connection_hdl hdl) {
+            server_t::connection_ptr conn = srv.get_con_from_hdl(hdl);
+            Json::Value user;
+            user["id"] = (Json::UInt64) 1;
+            user["username"] = "bench";
+            user["score"] = (Json::Int64) 1000;
+            user["total_count"] = 10;
+            user["win_count"] = 5;
+            std::string body;
+            json_util::serialize(user, body);
+            usleep(work_us);
+            conn->set_body(body);
+            conn->append_header("Content-Type", "application/json");
+            conn->set_status(websocketpp::http::status_code::ok);
+        });
+        srv.listen(port);
+        srv.start_accept();
+        std::thread runner([&srv, thread_num]() { io_util::run(srv, thread_num); });
+
+        std::atomic<uint64_t> done(0);
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> cli;
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < clients; i++) {
+            cli.emplace_back([&, port]() {
+                while (!stop.load()) {
+                    if (http_get(port, "/info")) {
+                        done++;
+                    }
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (auto &th: cli) {
+            th.join();
+        }
+        double sec = elapsed_sec(start);
+        srv.stop_listening();
+        srv.stop();
+        runner.join();
+        printf("threads=%-3zu requests=%-8lu qps=%.0f\n", thread_num, (unsigned long) done.load(), done.load() / sec);
+        port++;
+    }
+}
+
+//原room中基于二维vector的五子连珠判断，作为对照
+static bool legacy_five(const std::vector<std::vector<int>> &board, int row, int col, int row_off, int col_off, int color) {
+    int count = 1;
+    int search_row = row + row_off;
+    int search_col = col + col_off;
+    while (search_row >= 0 && search_row < BOARD_ROW &&
+           search_col >= 0 && search_col < BOARD_COL &&
+           board[search_row][search_col] == color) {
+        count++;
+        search_row += row_off;
+        search_col += col_off;
+    }
+    search_row = row - row_off;
+    search_col = col - col_off;
+    while (search_row >= 0 && search_row < BOARD_ROW &&
+           search_col >= 0 && search_col < BOARD_COL &&
+           board[search_row][search_col] == color) {
+        count++;
+        search_row -= row_off;
+        search_col -= col_off;
+    }
+    return (count >= 5);
+}
+
+static bool legacy_check_win(const std::vector<std::vector<int>> &board, int row, int col, int color) {
+    return legacy_five(board, row, col, 0, 1, color) ||
+           legacy_five(board, row, col, 1, 0, color) ||
+           legacy_five(board, row, col, -1, 1, color) ||
+           legacy_five(board, row, col, -1, -1, color);
+}
+
+struct bench_move {
+    int row;
+    int col;
+    int color;
+};
+
+//随机生成count个局面，每个局面随机落下stones个棋子，最后一手作为待判断的落子
+static void random_positions(int count, int stones, std::vector<std::vector<std::vector<int>>> &legacy,
+                             std::vector<bitboard> &boards, std::vector<bench_move> &moves) {
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> cell(0, BOARD_ROW * BOARD_COL - 1);
+    for (int i = 0; i < count; i++) {
+        std::vector<std::vector<int>> vb(BOARD_ROW, std::vector<int>(BOARD_COL, 0));
+        bitboard bb;
+        bench_move last = {0, 0, CHESS_WHITE};
+        for (int s = 0; s < stones; s++) {
+            int pos = cell(rng);
+            int r = pos / BOARD_COL, c = pos % BOARD_COL;
+            if (vb[r][c] != 0) {
+                continue;
+            }
+            int color = s % 2 == 0 ? CHESS_WHITE : CHESS_BLACK;
+            vb[r][c] = color;
+            bb.put(r, c, color);
+            last.row = r;
+            last.col = c;
+            last.color = color;
+        }
+        legacy.push_back(vb);
+        boards.push_back(bb);
+        moves.push_back(last);
+    }
+}
+
+//棋盘判胜测试：二维vector逐格计数 vs 位棋盘移位与运算
+static void bench_check_win(int argc, char *argv[]) {
+    int positions = argc > 0 ? atoi(argv[0]) : 4096;
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    std::vector<std::vector<std::vector<int>>> legacy;
+    std::vector<bitboard> boards;
+    std::vector<bench_move> moves;
+    random_positions(positions, 120, legacy, boards, moves);
+
+    size_t vec_bytes = sizeof(std::vector<std::vector<int>>) + BOARD_ROW * (sizeof(std::vector<int>) + BOARD_COL * sizeof(int));
+    printf("check_win: positions=%d rounds=%d\n", positions, rounds);
+    printf("footprint: vector<vector<int>>=%zu bytes in %d allocations, bitboard=%zu bytes inline\n",
+           vec_bytes, BOARD_ROW + 1, sizeof(bitboard));
+
+    int mismatch = 0;
+    for (int i = 0; i < positions; i++) {
+        const bench_move &m = moves[i];
+        if (legacy_check_win(legacy[i], m.row, m.col, m.color) != boards[i].check_five(m.row, m.col, m.color)) {
+            mismatch++;
+        }
+    }
+
+    uint64_t wins = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < positions; i++) {
+            const bench_move &m = moves[i];
+            wins += legacy_check_win(legacy[i], m.row, m.col, m.color);
+        }
+    }
+    double legacy_ns = elapsed_sec(start) * 1e9 / ((double) rounds * positions);
+
+    start = bench_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < positions; i++) {
+            const bench_move &m = moves[i];
+            wins += boards[i].check_five(m.row, m.col, m.color);
+        }
+    }
+    double bit_ns = elapsed_sec(start) * 1e9 / ((double) rounds * positions);
+    printf("legacy check_win: %.1f ns/op\n", legacy_ns);
+    printf("bitboard check_five: %.1f ns/op\n", bit_ns);
+    printf("mismatch=%d (wins=%lu)\n", mismatch, (unsigned long) wins);
+}
+
+//仿照Google Benchmark的输出：自动增加迭代次数直到总耗时超过0.2秒，fn(n)执行n次被测操作
+static void run_case(const std::string &name, const std::function<void(uint64_t)> &fn) {
+    uint64_t iters = 1;
+    double sec = 0;
+    while (true) {
+        bench_clock::time_point start = bench_clock::now();
+        fn(iters);
+        sec = elapsed_sec(start);
+        if (sec >= 0.2 || iters >= ((uint64_t) 1 << 40)) {
+            break;
+        }
+        iters *= sec < 0.02 ? 10 : 2;
+    }
+    printf("%-32s %10.2f ns %14lu\n", name.c_str(), sec * 1e9 / iters, (unsigned long) iters);
+}
+
+//五子连珠检测器：逐格计数 vs 标量/SSE2/AVX2位运算，单个判断与批量判断
+static void bench_five(int argc, char *argv[]) {
+    int positions = argc > 0 ? atoi(argv[0]) : 4096;
+    std::vector<std::vector<std::vector<int>>> legacy;
+    std::vector<bitboard> boards;
+    std::vector<bench_move> moves;
+    random_positions(positions, 120, legacy, boards, moves);
+    std::vector<five_lines> lines(positions);
+    for (int i = 0; i < positions; i++) {
+        boards[i].pack_lines(moves[i].row, moves[i].col, moves[i].color, lines[i]);
+    }
+    std::vector<uint8_t> result(positions);
+    volatile uint64_t sink = 0;
+
+    printf("five: positions=%d best_isa=%s\n", positions, five_detector::isa_name(five_detector::best_isa()));
+    printf("%-32s %13s %14s\n", "Benchmark", "Time", "Iterations");
+    run_case("BM_legacy_check_win", [&](uint64_t n) {
+        uint64_t wins = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            const bench_move &m = moves[i % positions];
+            wins += legacy_check_win(legacy[i % positions], m.row, m.col, m.color);
+        }
+        sink = wins;
+    });
+    run_case("BM_bitboard_check_five", [&](uint64_t n) {
+        uint64_t wins = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            const bench_move &m = moves[i % positions];
+            wins += boards[i % positions].check_five(m.row, m.col, m.color);
+        }
+        sink = wins;
+    });
+    five_detector::five_isa isas[] = {five_detector::FIVE_SCALAR, five_detector::FIVE_SSE2, five_detector::FIVE_AVX2};
+    for (five_detector::five_isa isa: isas) {
+        if (isa > five_detector::best_isa()) {
+            continue;
+        }
+        run_case(std::string("BM_five_check/") + five_detector::isa_name(isa), [&](uint64_t n) {
+            uint64_t wins = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                wins += five_detector::check(lines[i % positions], isa);
+            }
+            sink = wins;
+        });
+        //批量判断按每个局面计时
+        run_case(std::string("BM_five_batch/") + five_detector::isa_name(isa), [&](uint64_t n) {
+            uint64_t done = 0;
+            while (done < n) {
+                size_t cnt = std::min<uint64_t>(positions, n - done);
+                five_detector::check_batch(lines.data(), cnt, result.data(), isa);
+                done += cnt;
+            }
+            sink = result[0];
+        });
+    }
+    (void) sink;
+}
+
+//原online_manager的结构：两个unordered_map共用一把锁，作为对照
+class legacy_online_manager {
+private:
+    std::mutex _mutex;
+    std::unordered_map<uint64_t, server_t::connection_ptr> _game_hall;
+    std::unordered_map<uint64_t, server_t::connection_ptr> _game_room;
+
+public:
+    void enter_game_room(uint64_t uid, server_t::connection_ptr &conn) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _game_room.insert(std::make_pair(uid, conn));
+    }
+    bool exit_game_room(uint64_t uid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _game_room.erase(uid) != 0;
+    }
+    bool is_in_game_room(uint64_t uid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _game_room.find(uid) != _game_room.end();
+    }
+    server_t::connection_ptr get_conn_from_room(uint64_t uid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _game_room.find(uid);
+        if (it == _game_room.end()) {
+            return server_t::connection_ptr();
+        }
+        return it->second;
+    }
+};
+
+//模拟走棋路径的访问模式：每次操作判断双方是否在房间并获取连接，每20次操作有一次进出房间
+template<class manager>
+static double online_ops(manager &om, int thread_num, int ops, int users) {
+    server_t::connection_ptr conn;
+    for (int uid = 0; uid < users; uid++) {
+        om.enter_game_room(uid, conn);
+    }
+    std::vector<std::thread> ths;
+    bench_clock::time_point start = bench_clock::now();
+    for (int t = 0; t < thread_num; t++) {
+        ths.emplace_back([&om, t, ops, users]() {
+            std::mt19937 rng(t);
+            server_t::connection_ptr c;
+            uint64_t hit = 0;
+            for (int i = 0; i < ops; i++) {
+                uint64_t uid = rng() % users;
+                if (i % 20 == 0) {
+                    om.exit_game_room(uid);
+                    om.enter_game_room(uid, c);
+                    continue;
+                }
+                hit += om.is_in_game_room(uid);
+                hit += om.get_conn_from_room(uid).get() == nullptr;
+            }
+            (void) hit;
+        });
+    }
+    for (auto &th: ths) {
+        th.join();
+    }
+    return elapsed_sec(start);
+}
+
+//在线用户管理的锁竞争测试：单锁 vs 分片锁，1~32个线程
+static void bench_online(int argc, char *argv[]) {
+    int ops = argc > 0 ? atoi(argv[0]) : 200000;
+    int users = argc > 1 ? atoi(argv[1]) : 100000;
+    printf("online: ops/thread=%d users=%d shards=%d\n", ops, users, ONLINE_SHARD_NUM);
+    int thread_nums[] = {1, 2, 4, 8, 16, 32};
+    for (int thread_num: thread_nums) {
+        legacy_online_manager legacy;
+        online_manager sharded;
+        double total = (double) thread_num * ops;
+        double legacy_sec = online_ops(legacy, thread_num, ops, users);
+        double sharded_sec = online_ops(sharded, thread_num, ops, users);
+        printf("threads=%-3d legacy=%.2f Mops/s sharded=%.2f Mops/s\n", thread_num,
+               total / legacy_sec / 1e6, total / sharded_sec / 1e6);
+    }
+}
+
+//数据库查询测试，需要可访问的MySQL：./bench db host user password dbname [次数] [uid]
+//对比原来sprintf拼接sql + 文本结果转换的方式与预处理语句 + 绑定结果的方式
+static void bench_db(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("usage: db host user password dbname [count] [uid]\n");
+        return;
+    }
+    int count = argc > 4 ? atoi(argv[4]) : 20000;
+    uint64_t uid = argc > 5 ? strtoull(argv[5], nullptr, 10) : 1;
+    MYSQL *mysql = mysql_util::mysql_create(argv[0], argv[1], argv[2], argv[3], 3306);
+    if (mysql == nullptr) {
+        return;
+    }
+    bench_clock::time_point start = bench_clock::now();
+    uint64_t score = 0;
+    for (int i = 0; i < count; i++) {
+        char sql[4096] = {0};
+        sprintf(sql, "select username, score, total_count, win_count from user where id=%lu;", (unsigned long) uid);
+        if (mysql_util::mysql_exec(mysql, sql) == false) {
+            break;
+        }
+        MYSQL_RES *res = mysql_store_result(mysql);
+        if (res == nullptr) {
+            break;
+        }
+        MYSQL_ROW row = mysql_fetch_row(res);
+        if (row != nullptr) {
+            score += std::stol(row[1]) + std::stoi(row[2]) + std::stoi(row[3]);
+        }
+        mysql_free_result(res);
+    }
+    double legacy_sec = elapsed_sec(start);
+    mysql_util::mysql_destroy(mysql);
+
+    user_table ut(argv[0], argv[1], argv[2], argv[3], 3306, 1);
+    start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        user_info info;
+        if (ut.select_by_id(uid, info) == false) {
+            break;
+        }
+        score += info.score + info.total_count + info.win_count;
+    }
+    double stmt_sec = elapsed_sec(start);
+    printf("db select_by_id: count=%d sprintf=%.0f qps prepared=%.0f qps (checksum %lu)\n",
+           count, count / legacy_sec, count / stmt_sec, (unsigned long) score);
+}
+
+//用户信息缓存测试，需要可访问的MySQL：./bench cache host user password dbname [次数] [用户数]
+//模拟大厅与匹配的查询：在[1, 用户数]中随机查询，对比直接查库与经过缓存的吞吐和命中率
+static void bench_cache(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("usage: cache host user password dbname [count] [users]\n");
+        return;
+    }
+    int count = argc > 4 ? atoi(argv[4]) : 100000;
+    int users = argc > 5 ? atoi(argv[5]) : 1000;
+    user_table ut(argv[0], argv[1], argv[2], argv[3], 3306, 1);
+    score_writer sw(&ut, "./bench_score.journal");
+    user_cache uc(&sw);
+    std::mt19937_64 rng(7);
+    std::vector<uint64_t> uids(count);
+    for (auto &uid: uids) {
+        uid = rng() % users + 1;
+    }
+    uint64_t score = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        user_info info;
+        if (ut.select_by_id(uids[i], info)) {
+            score += info.score;
+        }
+    }
+    double db_sec = elapsed_sec(start);
+    start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        user_info info;
+        if (uc.select_by_id(uids[i], info)) {
+            score -= info.score;
+        }
+    }
+    double cache_sec = elapsed_sec(start);
+    user_cache_stats stats = uc.get_stats();
+    printf("cache select_by_id: count=%d users=%d db=%.0f qps cache=%.0f qps hit=%lu miss=%lu (checksum %lu)\n",
+           count, users, count / db_sec, count / cache_sec, (unsigned long) stats.hit,
+           (unsigned long) stats.miss, (unsigned long) score);
+}
+
+//按等待时间分段统计匹配质量
+struct match_stats {
+    static const int bucket_num = 6;
+    uint64_t count[bucket_num];
+    double gap_sum[bucket_num];
+    int64_t gap_max[bucket_num];
+
+    match_stats() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    static int bucket(int64_t wait_ms) {
+        static const int64_t limits[bucket_num - 1] = {1000, 5000, 15000, 30000, 60000};
+        int i = 0;
+        while (i < bucket_num - 1 && wait_ms >= limits[i]) {
+            i++;
+        }
+        return i;
+    }
+
+    void add(int64_t wait_ms, int64_t gap) {
+        int b = bucket(wait_ms);
+        count[b]++;
+        gap_sum[b] += gap;
+        gap_max[b] = std::max(gap_max[b], gap);
+    }
+
+    void print(const char *name, size_t waiting) const {
+        static const char *labels[bucket_num] = {"<1s", "1-5s", "5-15s", "15-30s", "30-60s", ">=60s"};
+        uint64_t total = 0;
+        for (int i = 0; i < bucket_num; i++) {
+            total += count[i];
+        }
+        printf("%s: matched=%lu still_waiting=%zu\n", name, (unsigned long) total, waiting);
+        for (int i = 0; i < bucket_num; i++) {
+            printf("  wait %-7s players=%-8lu (%5.1f%%) avg_gap=%-7.1f max_gap=%ld\n", labels[i],
+                   (unsigned long) count[i], total ? 100.0 * count[i] / total : 0.0,
+                   count[i] ? gap_sum[i] / count[i] : 0.0, (long) gap_max[i]);
+        }
+    }
+};
+
+//匹配模拟器：./bench match [每秒到达人数] [模拟秒数]
+//天梯分服从N(1500, 400)，按100ms一个时间片驱动，对比原来三个固定分档的FIFO队列与按分差窗口匹配的引擎
+//最后测试几十万人同时排队时入队、取消、取出一对的耗时
+static void bench_match(int argc, char *argv[]) {
+    int rate = argc > 0 ? atoi(argv[0]) : 50;
+    int seconds = argc > 1 ? atoi(argv[1]) : 1800;
+    const int64_t tick_ms = 100;
+    std::mt19937_64 rng(11);
+    std::normal_distribution<double> score_dist(1500, 400);
+    std::poisson_distribution<int> arrive_dist(rate * tick_ms / 1000.0);
+
+    std::list<match_player> legacy[3];
+    match_engine engine;
+    match_stats legacy_stats, engine_stats;
+    uint64_t uid = 0;
+    for (int64_t now = 0; now < seconds * 1000LL; now += tick_ms) {
+        int arrive = arrive_dist(rng);
+        for (int i = 0; i < arrive; i++) {
+            match_player p = {++uid, std::max<int64_t>(0, (int64_t) score_dist(rng)), now};
+            legacy[p.score < 2000 ? 0 : (p.score < 3000 ? 1 : 2)].push_back(p);
+            engine.push(p);
+        }
+        for (auto &q: legacy) {
+            while (q.size() >= 2) {
+                match_player a = q.front();
+                q.pop_front();
+                match_player b = q.front();
+                q.pop_front();
+                legacy_stats.add(now - a.enqueue_ms, std::abs(a.score - b.score));
+                legacy_stats.add(now - b.enqueue_ms, std::abs(a.score - b.score));
+            }
+        }
+        match_pair pair;
+        while (engine.pop_pair(now, pair)) {
+            engine_stats.add(now - pair.a.enqueue_ms, pair.b.score - pair.a.score);
+            engine_stats.add(now - pair.b.enqueue_ms, pair.b.score - pair.a.score);
+        }
+    }
+    printf("match simulator: rate=%d/s seconds=%d players=%lu\n", rate, seconds, (unsigned long) uid);
+    legacy_stats.print("legacy 3 buckets", legacy[0].size() + legacy[1].size() + legacy[2].size());
+    engine_stats.print("rating window", engine.size());
+
+    const int queued = 200000;
+    std::vector<match_player> players(queued);
+    for (int i = 0; i < queued; i++) {
+        players[i] = {(uint64_t) i + 1, (int64_t) score_dist(rng), 0};
+    }
+    match_engine big;
+    bench_clock::time_point start = bench_clock::now();
+    for (auto &p: players) {
+        big.push(p);
+    }
+    double push_sec = elapsed_sec(start);
+    start = bench_clock::now();
+    for (int i = 0; i < queued; i += 2) {
+        big.remove(players[i].uid);
+    }
+    double remove_sec = elapsed_sec(start);
+    start = bench_clock::now();
+    match_pair pair;
+    int popped = 0;
+    while (big.pop_pair(INT64_MAX / 2, pair)) {
+        popped++;
+    }
+    double pop_sec = elapsed_sec(start);
+    printf("engine with %d queued: push=%.0f ns remove=%.0f ns pop_pair=%.0f ns (pairs %d)\n", queued,
+           push_sec * 1e9 / queued, remove_sec * 1e9 / (queued / 2), pop_sec * 1e9 / (popped ? popped : 1), popped);
+}
+
+//原来的匹配队列：std::list加一把锁，取消时遍历整个链表
+class legacy_match_queue {
+private:
+    std::list<uint64_t> _list;
+    std::mutex _mutex;
+
+public:
+    void push(uint64_t uid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _list.push_back(uid);
+    }
+    void remove(uint64_t uid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _list.remove(uid);
+    }
+    bool pop_pair(uint64_t &a, uint64_t &b) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_list.size() < 2) {
+            return false;
+        }
+        a = _list.front();
+        _list.pop_front();
+        b = _list.front();
+        _list.pop_front();
+        return true;
+    }
+};
+
+//高峰期的访问模式：生产者线程不停地加入匹配，其中一半随后取消，一个消费者线程同时两两取出
+template<class queue, class push_fn, class remove_fn, class consume_fn>
+static double queue_ops(queue &q, int thread_num, int ops, push_fn push, remove_fn remove, consume_fn consume) {
+    std::atomic<bool> done(false);
+    std::thread consumer([&]() {
+        while (done == false) {
+            consume(q);
+        }
+    });
+    std::vector<std::thread> ths;
+    bench_clock::time_point start = bench_clock::now();
+    for (int t = 0; t < thread_num; t++) {
+        ths.emplace_back([&, t]() {
+            uint64_t base = (uint64_t)(t + 1) << 32;
+            for (int i = 0; i < ops; i++) {
+                push(q, base + i);
+                if (i % 2 == 0) {
+                    remove(q, base + i);
+                }
+            }
+        });
+    }
+    for (auto &th: ths) {
+        th.join();
+    }
+    double sec = elapsed_sec(start);
+    done = true;
+    consumer.join();
+    return sec;
+}
+
+//匹配队列竞争测试：./bench match_queue [每线程操作数] [预先排队人数]
+static void bench_match_queue(int argc, char *argv[]) {
+    int ops = argc > 0 ? atoi(argv[0]) : 20000;
+    int queued = argc > 1 ? atoi(argv[1]) : 20000;
+    printf("match_queue: ops/thread=%d queued=%d (half of the pushes are cancelled)\n", ops, queued);
+    int thread_nums[] = {1, 2, 4, 8, 16};
+    for (int thread_num: thread_nums) {
+        legacy_match_queue legacy;
+        match_queue<uint64_t> indexed(queued + thread_num * ops);
+        //预先排队的玩家模拟高峰期的队列长度，原来的取消操作每次都要遍历它们
+        for (int i = 0; i < queued; i++) {
+            legacy.push(i);
+            indexed.push(i, i);
+        }
+        double legacy_sec = queue_ops(legacy, thread_num, ops,
+                [](legacy_match_queue &q, uint64_t uid) { q.push(uid); },
+                [](legacy_match_queue &q, uint64_t uid) { q.remove(uid); },
+                [](legacy_match_queue &q) {
+                    uint64_t a, b;
+                    if (q.pop_pair(a, b) == false) {
+                        std::this_thread::yield();
+                    }
+                });
+        std::vector<std::pair<uint64_t, uint64_t>> pairs;
+        double indexed_sec = queue_ops(indexed, thread_num, ops,
+                [](match_queue<uint64_t> &q, uint64_t uid) { q.push(uid, uid); },
+                [](match_queue<uint64_t> &q, uint64_t uid) { q.remove(uid); },
+                [&pairs](match_queue<uint64_t> &q) {
+                    pairs.clear();
+                    if (q.pop_pairs(pairs, 64) == 0) {
+                        q.wait(2, std::chrono::milliseconds(1));
+                    }
+                });
+        double total = 1.5 * thread_num * ops;
+        printf("threads=%-3d legacy=%.3f Mops/s indexed=%.3f Mops/s\n", thread_num,
+               total / legacy_sec / 1e6, total / indexed_sec / 1e6);
+    }
+}
+
+//匹配吞吐测试：./bench match_tick [人数] [周期毫秒]
+//所有玩家都在大厅中并且分数相近，一次性加入匹配，统计全部匹配完成的时间
+//对比逐对建房、逐对序列化的事件驱动方式与按周期批量处理的方式，连接没有握手，send直接返回
+static void bench_match_tick(int argc, char *argv[]) {
+    int players = argc > 0 ? atoi(argv[0]) : 100000;
+    int tick_ms = argc > 1 ? atoi(argv[1]) : 100;
+    server_t srv;
+    srv.set_access_channels(websocketpp::log::alevel::none);
+    srv.set_error_channels(websocketpp::log::elevel::none);
+    srv.init_asio();
+    online_manager om;
+    for (int uid = 1; uid <= players; uid++) {
+        server_t::connection_ptr conn = srv.get_connection();
+        om.enter_game_hall(uid, conn);
+    }
+    printf("match_tick: players=%d tick_ms=%d\n", players, tick_ms);
+    int64_t ticks[] = {0, tick_ms};
+    for (int64_t tick: ticks) {
+        //分数都相同，加入后立即可以匹配；玩家不会掉线，对局结果不会提交，不需要数据库
+        user_cache uc(nullptr);
+        websocketpp::lib::asio::io_service io;
+        room_manager rm(&uc, &om, &io);
+        matcher mm(&rm, &uc, &om, tick);
+        bench_clock::time_point start = bench_clock::now();
+        for (int uid = 1; uid <= players; uid++) {
+            mm.add(uid, 1500);
+        }
+        uint64_t expect = players / 2;
+        while (mm.get_stats().matched < expect) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        double sec = elapsed_sec(start);
+        matcher_stats stats = mm.get_stats();
+        printf("%-14s matches=%lu batches=%lu %.0f matches/s\n", tick ? "tick" : "per-pair",
+               (unsigned long) stats.matched, (unsigned long) stats.batches, stats.matched / sec);
+    }
+}
+
+//进程当前的常驻内存(字节)
+static size_t rss_bytes() {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) {
+        return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return (size_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+//会话过期测试：./bench session_timer [会话数] [刷新次数]
+//原来每个会话一个asio定时器，每次刷新取消旧定时器(回调带着operation_aborted执行一次)再创建新的
+//现在所有会话放在一个时间轮中，刷新只是换一个槽；先测时间轮，避免复用asio定时器释放的内存
+static void bench_session_timer(int argc, char *argv[]) {
+    int sessions = argc > 0 ? atoi(argv[0]) : 1000000;
+    int refreshes = argc > 1 ? atoi(argv[1]) : 2000000;
+    std::mt19937 rng(5);
+    std::vector<uint32_t> order(refreshes);
+    for (auto &i: order) {
+        i = rng() % sessions;
+    }
+    printf("session_timer: sessions=%d refreshes=%d timeout=%dms\n", sessions, refreshes, SESSION_TIMEOUT);
+    {
+        size_t rss = rss_bytes();
+        int64_t now = 0;
+        bench_clock::time_point start = bench_clock::now();
+        timer_wheel<uint64_t> wheel(SESSION_WHEEL_TICK_MS, SESSION_WHEEL_SLOTS, now);
+        std::vector<uint32_t> handles(sessions);
+        for (int i = 0; i < sessions; i++) {
+            handles[i] = wheel.add(i, now, SESSION_TIMEOUT);
+        }
+        double add_sec = elapsed_sec(start);
+        size_t mem = rss_bytes() - rss;
+        //刷新分散在5秒内，会话会被移到不同的槽
+        start = bench_clock::now();
+        for (int i = 0; i < refreshes; i++) {
+            wheel.refresh(handles[order[i]], (int64_t) i * 5000 / refreshes, SESSION_TIMEOUT);
+        }
+        double refresh_sec = elapsed_sec(start);
+        std::vector<uint64_t> expired;
+        expired.reserve(sessions);
+        start = bench_clock::now();
+        wheel.advance(SESSION_TIMEOUT + 5000, expired);
+        double expire_sec = elapsed_sec(start);
+        printf("timer wheel: add=%.0f ns refresh=%.0f ns expire=%.0f ns/session (%zu) memory=%.1f MB (%.0f B/session)\n",
+               add_sec * 1e9 / sessions, refresh_sec * 1e9 / refreshes, expire_sec * 1e9 / (expired.size() ? expired.size() : 1),
+               expired.size(), mem / 1048576.0, (double) mem / sessions);
+    }
+    {
+        typedef websocketpp::lib::asio::steady_timer steady_timer;
+        websocketpp::lib::asio::io_service io;
+        uint64_t fired = 0;
+        auto handler = [&fired](const websocketpp::lib::error_code &ec) {
+            fired += !ec;
+        };
+        size_t rss = rss_bytes();
+        bench_clock::time_point start = bench_clock::now();
+        std::vector<std::shared_ptr<steady_timer>> timers(sessions);
+        for (int i = 0; i < sessions; i++) {
+            timers[i] = std::make_shared<steady_timer>(io, std::chrono::milliseconds(SESSION_TIMEOUT));
+            timers[i]->async_wait(handler);
+        }
+        double add_sec = elapsed_sec(start);
+        size_t mem = rss_bytes() - rss;
+        start = bench_clock::now();
+        for (uint32_t i: order) {
+            timers[i]->cancel();
+            timers[i] = std::make_shared<steady_timer>(io, std::chrono::milliseconds(SESSION_TIMEOUT));
+            timers[i]->async_wait(handler);
+        }
+        io.poll();
+        double refresh_sec = elapsed_sec(start);
+        printf("asio timers: add=%.0f ns refresh=%.0f ns memory=%.1f MB (%.0f B/session)\n",
+               add_sec * 1e9 / sessions, refresh_sec * 1e9 / refreshes, mem / 1048576.0, (double) mem / sessions);
+        for (auto &t: timers) {
+            t->cancel();
+        }
+        io.poll();
+    }
+}
+
+//原session_manager的结构：一把锁保护unordered_map<ssid, shared_ptr>，cookie按"; "分割后再按"="分割，ssid用stol转换
+//原来刷新过期时间还要重建一个asio定时器，这里不计这部分开销
+class legacy_session_manager {
+private:
+    uint64_t _next_ssid;
+    std::mutex _mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<session>> _session;
+
+public:
+    legacy_session_manager() : _next_ssid(1) {}
+
+    uint64_t create_sesson(uint64_t uid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t ssid = _next_ssid++;
+        session_id id = {0, ssid};
+        _session.insert(std::make_pair(ssid, std::make_shared<session>(id, uid, LOGIN)));
+        return ssid;
+    }
+
+    void remove_session(uint64_t ssid) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _session.erase(ssid);
+    }
+
+    std::shared_ptr<session> get_session_by_cookie(const std::string &cookie) {
+        std::vector<std::string> cookie_arr;
+        string_util::split(cookie, "; ", cookie_arr);
+        for (auto &str: cookie_arr) {
+            std::vector<std::string> tmp_arr;
+            string_util::split(str, "=", tmp_arr);
+            if (tmp_arr.size() != 2 || tmp_arr[0] != "SSID") {
+                continue;
+            }
+            uint64_t ssid = (uint64_t) std::stol(tmp_arr[1]);
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _session.find(ssid);
+            if (it == _session.end()) {
+                return std::shared_ptr<session>();
+            }
+            return it->second;
+        }
+        return std::shared_ptr<session>();
+    }
+};
+
+//模拟HTTP请求的访问模式：每个请求带着cookie查找会话，每50个请求有一次登录(创建会话)和一次会话删除
+template<class create_fn, class lookup_fn, class remove_fn>
+static double session_ops(int thread_num, int ops, const std::vector<std::string> &cookies,
+                          create_fn create, lookup_fn lookup, remove_fn remove) {
+    std::vector<std::thread> ths;
+    bench_clock::time_point start = bench_clock::now();
+    for (int t = 0; t < thread_num; t++) {
+        ths.emplace_back([&, t]() {
+            std::mt19937 rng(t);
+            uint64_t hit = 0;
+            for (int i = 0; i < ops; i++) {
+                if (i % 50 == 0) {
+                    remove(create(t));
+                    continue;
+                }
+                hit += lookup(cookies[rng() % cookies.size()]);
+            }
+            (void) hit;
+        });
+    }
+    for (auto &th: ths) {
+        th.join();
+    }
+    return elapsed_sec(start);
+}
+
+//会话查找的锁竞争测试：./bench session [每线程请求数] [会话数]
+//对比原来的单锁哈希表 + 分割cookie与分片开放寻址表 + 直接解析cookie(查找和刷新过期时间一次加锁)
+static void bench_session(int argc, char *argv[]) {
+    int ops = argc > 0 ? atoi(argv[0]) : 200000;
+    int sessions = argc > 1 ? atoi(argv[1]) : 100000;
+    printf("session: ops/thread=%d sessions=%d shards=%d\n", ops, sessions, SESSION_SHARD_NUM);
+    int thread_nums[] = {1, 2, 4, 8, 16};
+    for (int thread_num: thread_nums) {
+        double total = (double) thread_num * ops;
+        double legacy_sec, sharded_sec;
+        {
+            legacy_session_manager legacy;
+            std::vector<std::string> cookies(sessions);
+            for (auto &c: cookies) {
+                c = "SSID=" + std::to_string(legacy.create_sesson(1)) + "; path=/";
+            }
+            legacy_sec = session_ops(thread_num, ops, cookies,
+                                     [&legacy](int uid) { return legacy.create_sesson(uid); },
+                                     [&legacy](const std::string &c) { return legacy.get_session_by_cookie(c).get() != nullptr; },
+                                     [&legacy](uint64_t ssid) { legacy.remove_session(ssid); });
+        }
+        {
+            session_manager sm;
+            std::vector<std::string> cookies(sessions);
+            for (auto &c: cookies) {
+                session ss = sm.create_sesson(1, LOGIN);
+                sm.set_session_expire_time(ss.get_ssid(), SESSION_TIMEOUT);
+                c = "SSID=" + ss.get_ssid().to_string() + "; path=/";
+            }
+            sharded_sec = session_ops(thread_num, ops, cookies,
+                                      [&sm](int uid) { return sm.create_sesson(uid, LOGIN).get_ssid(); },
+                                      [&sm](const std::string &c) {
+                                          session ss;
+                                          return sm.get_session_by_cookie(c, SESSION_TIMEOUT, ss);
+                                      },
+                                      [&sm](const session_id &ssid) { sm.remove_session(ssid); });
+        }
+        printf("threads=%-3d legacy=%.2f Mops/s sharded=%.2f Mops/s\n", thread_num,
+               total / legacy_sec / 1e6, total / sharded_sec / 1e6);
+    }
+}
+
+//会话快照测试：./bench session_snapshot [会话数] [快照文件]
+//保存一份快照，再用它构造新的session_manager，统计保存和启动恢复的耗时
+static void bench_session_snapshot(int argc, char *argv[]) {
+    int sessions = argc > 0 ? atoi(argv[0]) : 1000000;
+    std::string path = argc > 1 ? argv[1] : "./bench.snapshot";
+    printf("session_snapshot: sessions=%d record=%zu B\n", sessions, sizeof(session_record));
+    session_id probe;
+    {
+        session_manager sm(path);
+        for (int i = 0; i < sessions; i++) {
+            session ss = sm.create_sesson(i, LOGIN);
+            sm.set_session_expire_time(ss.get_ssid(), i % 10 == 0 ? SESSION_FOREVER : SESSION_TIMEOUT);
+            probe = ss.get_ssid();
+        }
+        bench_clock::time_point start = bench_clock::now();
+        sm.save();
+        printf("save: %.0f ms\n", elapsed_sec(start) * 1e3);
+        //析构时还会再保存一次
+    }
+    {
+        bench_clock::time_point start = bench_clock::now();
+        session_manager sm(path);
+        double load_sec = elapsed_sec(start);
+        session ss;
+        bool found = sm.get_sesson(probe, ss);
+        printf("load: %.0f ms, restored=%zu, probe found=%d\n", load_sec * 1e3, sm.size(), found);
+    }
+    unlink(path.c_str());
+}
+
+//观战扇出测试：./bench spectate [观战人数] [io线程数]
+//一个房间按room_stress_test的规则下满棋盘，对比没有观战者和有观战者时玩家请求全部处理完的时间，以及观战消息全部发出的时间
+//连接没有握手，send直接返回，测的是扇出本身的开销以及它是否拖慢玩家的strand
+static void bench_spectate(int argc, char *argv[]) {
+    int spectators = argc > 0 ? atoi(argv[0]) : 10000;
+    int thread_num = argc > 1 ? atoi(argv[1]) : 4;
+    server_t srv;
+    srv.set_access_channels(websocketpp::log::alevel::none);
+    srv.set_error_channels(websocketpp::log::elevel::none);
+    srv.init_asio();
+    printf("spectate: spectators=%d threads=%d moves=%d\n", spectators, thread_num, BOARD_ROW * BOARD_COL);
+    int counts[] = {0, spectators};
+    for (int count: counts) {
+        online_manager om;
+        websocketpp::lib::asio::io_service io;
+        room_ptr rp(new room(1, nullptr, &om, &io));
+        rp->add_white_user(1);
+        rp->add_black_user(2);
+        server_t::connection_ptr wconn = srv.get_connection(), bconn = srv.get_connection();
+        om.enter_game_room(1, wconn);
+        om.enter_game_room(2, bconn);
+        for (int i = 0; i < count; i++) {
+            server_t::connection_ptr conn = srv.get_connection();
+            rp->post([rp, i, conn]() { rp->add_spectator(100 + i, conn); });
+        }
+        io.run();
+        io.reset();
+        std::atomic<int64_t> players_done(0);
+        bench_clock::time_point start = bench_clock::now();
+        for (int cell = 0; cell < BOARD_ROW * BOARD_COL; cell++) {
+            int row = cell / BOARD_COL, col = cell % BOARD_COL;
+            Json::Value req;
+            req["optype"] = "put_chess";
+            req["room_id"] = 1;
+            req["uid"] = (row + 2 * col) % 4 < 2 ? 1 : 2;
+            req["row"] = row;
+            req["col"] = col;
+            rp->post_request(req);
+        }
+        rp->post([&players_done, start]() {
+            players_done = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count();
+        });
+        std::vector<std::thread> workers;
+        for (int t = 0; t < thread_num; t++) {
+            workers.emplace_back([&io]() { io.run(); });
+        }
+        for (auto &th: workers) {
+            th.join();
+        }
+        double all_sec = elapsed_sec(start);
+        printf("spectators=%-6d players done=%.1f ms, all sent=%.1f ms (%.0f ns/send)\n", count,
+               players_done / 1e3, all_sec * 1e3, count ? all_sec * 1e9 / ((double) count * BOARD_ROW * BOARD_COL) : 0.0);
+    }
+}
+
+//websocket帧头的长度：服务端发出的帧不加掩码，客户端发出的帧有4字节掩码
+static size_t ws_frame_size(size_t payload, bool masked) {
+    size_t header = payload < 126 ? 2 : (payload < 65536 ? 4 : 10);
+    return header + (masked ? 4 : 0) + payload;
+}
+
+//协议测试：JSON与二进制协议的每条消息CPU耗时和线上字节数
+//请求：客户端发来的put_chess/chat，解析成房间使用的请求；响应：房间广播的put_chess，从JSON响应编码
+static void bench_proto(int argc, char *argv[]) {
+    (void) argc;
+    (void) argv;
+    Json::Value req;
+    req["optype"] = "put_chess";
+    req["room_id"] = (Json::UInt64) 123456;
+    req["uid"] = (Json::UInt64) 654321;
+    req["row"] = 7;
+    req["col"] = 8;
+    std::string req_json;
+    json_util::serialize(req, req_json);
+    Json::Value rsp = req;
+    rsp["result"] = "true";
+    rsp["winner"] = (Json::UInt64) 0;
+    std::string rsp_json;
+    json_util::serialize(rsp, rsp_json);
+    proto_msg pm;
+    pm.type = PROTO_PUT_CHESS;
+    pm.row = 7;
+    pm.col = 8;
+    pm.room_id = 123456;
+    std::string req_bin;
+    proto_util::encode(pm, req_bin);
+    req_bin.resize(PROTO_PUT_CHESS_REQ_SIZE);
+    std::string rsp_bin;
+    proto_msg rsp_pm;
+    proto_util::from_json(rsp, rsp_pm);
+    proto_util::encode(rsp_pm, rsp_bin);
+
+    Json::Value chat = req;
+    chat["optype"] = "chat";
+    chat["message"] = "你好，下一局再来";
+    chat.removeMember("row");
+    chat.removeMember("col");
+    std::string chat_json;
+    json_util::serialize(chat, chat_json);
+    proto_msg chat_pm;
+    proto_util::from_json(chat, chat_pm);
+    std::string chat_bin;
+    proto_util::encode(chat_pm, chat_bin);
+
+    printf("proto: bytes on the wire (payload / websocket frame)\n");
+    printf("  put_chess request   json=%zu/%zu binary=%zu/%zu\n", req_json.size(), ws_frame_size(req_json.size(), true),
+           req_bin.size(), ws_frame_size(req_bin.size(), true));
+    printf("  put_chess response  json=%zu/%zu binary=%zu/%zu\n", rsp_json.size(), ws_frame_size(rsp_json.size(), false),
+           rsp_bin.size(), ws_frame_size(rsp_bin.size(), false));
+    printf("  chat                json=%zu/%zu binary=%zu/%zu\n", chat_json.size(), ws_frame_size(chat_json.size(), false),
+           chat_bin.size(), ws_frame_size(chat_bin.size(), false));
+
+    volatile uint64_t sink = 0;
+    printf("%-32s %13s %14s\n", "Benchmark", "Time", "Iterations");
+    run_case("BM_json_parse_put_chess", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            Json::Value v;
+            json_util::unserialize(req_json, v);
+            sum += v["row"].asInt();
+        }
+        sink = sum;
+    });
+    run_case("BM_binary_decode_put_chess", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            proto_msg m;
+            proto_util::decode(req_bin.data(), req_bin.size(), m);
+            sum += m.row;
+        }
+        sink = sum;
+    });
+    run_case("BM_json_serialize_put_chess", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            std::string body;
+            json_util::serialize(rsp, body);
+            sum += body.size();
+        }
+        sink = sum;
+    });
+    run_case("BM_binary_from_json_put_chess", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            proto_msg m;
+            std::string body;
+            proto_util::from_json(rsp, m);
+            proto_util::encode(m, body);
+            sum += body.size();
+        }
+        sink = sum;
+    });
+    run_case("BM_binary_encode_put_chess", [&](uint64_t n) {
+        uint64_t sum = 0;
+        std::string body;
+        for (uint64_t i = 0; i < n; i++) {
+            proto_util::encode(rsp_pm, body);
+            sum += body.size();
+        }
+        sink = sum;
+    });
+    run_case("BM_json_parse_chat", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            Json::Value v;
+            json_util::unserialize(chat_json, v);
+            sum += v["message"].asString().size();
+        }
+        sink = sum;
+    });
+    run_case("BM_binary_decode_chat", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            proto_msg m;
+            proto_util::decode(chat_bin.data(), chat_bin.size(), m);
+            sum += m.text_len;
+        }
+        sink = sum;
+    });
+    (void) sink;
+}
+
+//原来的json_util：每次调用都创建builder、writer/reader和stringstream，默认带缩进
+static bool legacy_serialize(const Json::Value &root, std::string &str) {
+    Json::StreamWriterBuilder swb;
+    std::unique_ptr<Json::StreamWriter> sw(swb.newStreamWriter());
+    std::stringstream ss;
+    int ret = sw->write(root, &ss);
+    if (ret != 0) {
+        return false;
+    }
+    str = ss.str();
+    return true;
+}
+
+static bool legacy_unserialize(const std::string &str, Json::Value &root) {
+    Json::CharReaderBuilder crb;
+    std::unique_ptr<Json::CharReader> cr(crb.newCharReader());
+    std::string err;
+    return cr->parse(str.c_str(), str.c_str() + str.size(), &root, &err);
+}
+
+//执行fn一千次，返回平均每次的内存分配次数
+static double allocs_per_op(const std::function<void(uint64_t)> &fn) {
+    fn(1);
+    uint64_t before = alloc_count;
+    fn(1000);
+    return (alloc_count - before) / 1000.0;
+}
+
+//JSON编解码测试：一条put_chess响应的序列化和一条put_chess请求的解析，对比耗时、每次的内存分配次数和输出字节数
+static void bench_json(int argc, char *argv[]) {
+    (void) argc;
+    (void) argv;
+    Json::Value rsp;
+    rsp["optype"] = "put_chess";
+    rsp["room_id"] = (Json::UInt64) 123456;
+    rsp["uid"] = (Json::UInt64) 654321;
+    rsp["row"] = 7;
+    rsp["col"] = 8;
+    rsp["result"] = "true";
+    rsp["winner"] = (Json::UInt64) 0;
+    std::string legacy_body, body, stream_body;
+    legacy_serialize(rsp, legacy_body);
+    json_util::serialize(rsp, body);
+    printf("json: put_chess response legacy=%zu B compact=%zu B\n", legacy_body.size(), body.size());
+
+    volatile uint64_t sink = 0;
+    std::vector<std::pair<std::string, std::function<void(uint64_t)>>> cases;
+    cases.push_back(std::make_pair("BM_legacy_serialize", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            std::string out;
+            legacy_serialize(rsp, out);
+            sum += out.size();
+        }
+        sink = sum;
+    }));
+    cases.push_back(std::make_pair("BM_cached_serialize", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            json_util::serialize(rsp, body);
+            sum += body.size();
+        }
+        sink = sum;
+    }));
+    cases.push_back(std::make_pair("BM_json_writer", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            json_writer(stream_body)
+                    .add("optype", "put_chess")
+                    .add("room_id", (uint64_t) 123456)
+                    .add("uid", (uint64_t) 654321)
+                    .add("row", 7)
+                    .add("col", 8)
+                    .add("result", "true")
+                    .add("winner", (uint64_t) 0)
+                    .end();
+            sum += stream_body.size();
+        }
+        sink = sum;
+    }));
+    cases.push_back(std::make_pair("BM_legacy_unserialize", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            Json::Value v;
+            legacy_unserialize(legacy_body, v);
+            sum += v["row"].asInt();
+        }
+        sink = sum;
+    }));
+    cases.push_back(std::make_pair("BM_cached_unserialize", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            Json::Value v;
+            json_util::unserialize(body, v);
+            sum += v["row"].asInt();
+        }
+        sink = sum;
+    }));
+    printf("%-32s %13s %14s\n", "Benchmark", "Time", "Iterations");
+    for (auto &c: cases) {
+        run_case(c.first, c.second);
+    }
+    printf("%-32s %13s\n", "Benchmark", "Allocs/op");
+    for (auto &c: cases) {
+        printf("%-32s %13.1f\n", c.first.c_str(), allocs_per_op(c.second));
+    }
+    printf("json_writer: %s\n", stream_body.c_str());
+    (void) sink;
+}
+
+//静态资源测试：./bench static [wwwroot] [文件]
+//每个文件原始/gzip/brotli的大小，每次请求读磁盘 vs 查内存缓存，以及改写文件后inotify多久让缓存更新
+static void bench_static(int argc, char *argv[]) {
+    std::string root = argc > 0 ? argv[0] : "./wwwroot/";
+    std::string name = argc > 1 ? argv[1] : "/login.html";
+    static_cache cache(root);
+    printf("static: root=%s files=%zu\n", root.c_str(), cache.size());
+    printf("%-24s %10s %10s %10s\n", "File", "identity", "gzip", "br");
+    DIR *dp = opendir(root.c_str());
+    struct dirent *ent;
+    while (dp != nullptr && (ent = readdir(dp)) != nullptr) {
+        static_file_ptr file = cache.find(std::string("/") + ent->d_name);
+        if (file) {
+            printf("%-24s %10zu %10zu %10zu\n", ent->d_name, file->body[ENCODING_IDENTITY].size(),
+                   file->body[ENCODING_GZIP].size(), file->body[ENCODING_BR].size());
+        }
+    }
+    if (dp != nullptr) {
+        closedir(dp);
+    }
+
+    volatile uint64_t sink = 0;
+    std::string realpath = root + name;
+    printf("%-32s %13s %14s\n", "Benchmark", "Time", "Iterations");
+    run_case("BM_file_read", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            std::string body;
+            file_util::read(realpath, body);
+            sum += body.size();
+        }
+        sink = sum;
+    });
+    int accept = static_util::accept_encoding("gzip, deflate, br");
+    run_case("BM_cache_find", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            static_file_ptr file = cache.find(name);
+            std::string body = file->body[file->select(accept)];
+            sum += body.size();
+        }
+        sink = sum;
+    });
+    (void) sink;
+
+    //在临时目录中改写文件，等待缓存中的ETag变化
+    char dir[] = "/tmp/bench_static.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        return;
+    }
+    std::string path = std::string(dir) + "/a.html";
+    FILE *fp = fopen(path.c_str(), "w");
+    fputs("<html>v1</html>", fp);
+    fclose(fp);
+    {
+        static_cache tmp_cache(dir);
+        std::string before = tmp_cache.find("/a.html")->etag[ENCODING_IDENTITY];
+        bench_clock::time_point start = bench_clock::now();
+        fp = fopen(path.c_str(), "w");
+        fputs("<html>v2</html>", fp);
+        fclose(fp);
+        bool reloaded = false;
+        while (elapsed_sec(start) < 1) {
+            static_file_ptr file = tmp_cache.find("/a.html");
+            if (file && file->etag[ENCODING_IDENTITY] != before) {
+                reloaded = true;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        printf("inotify reload: %s in %.2f ms\n", reloaded ? "ok" : "timeout", elapsed_sec(start) * 1e3);
+        unlink(path.c_str());
+        start = bench_clock::now();
+        while (elapsed_sec(start) < 1 && tmp_cache.find("/a.html")) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        printf("inotify remove: %s\n", tmp_cache.find("/a.html") ? "timeout" : "ok");
+    }
+    rmdir(dir);
+}
+
+//原来的LOG宏：在调用线程上取时间、localtime、同步fprintf
+#define LEGACY_LOG(fp, format, ...)                                                                             \
+    do {                                                                                                        \
+        time_t t = time(NULL);                                                                                  \
+        struct tm *ltm = localtime(&t);                                                                         \
+        char tmp[32] = {0};                                                                                     \
+        strftime(tmp, 31, "%H:%M:%S", ltm);                                                                     \
+        fprintf(fp, "[%p %s %s:%d] " format "\n", (void *) pthread_self(), tmp, __FILE__, __LINE__, ##__VA_ARGS__); \
+    } while (0)
+
+//日志测试：./bench log [条数]
+//落子路径上典型的一条日志，输出到/dev/null；异步日志每256条同步取一次，分别统计调用线程的耗时和包括取出写出在内的总耗时
+static void bench_log(int argc, char *argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 1000000;
+    const int batch = 256;
+    FILE *null = fopen("/dev/null", "w");
+    if (null == nullptr) {
+        return;
+    }
+    logger::set_output(null);
+    printf("log: lines=%d\n", count);
+    uint64_t rid = 12345;
+    int row = 7, col = 8;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        LEGACY_LOG(null, "room:%lu put_chess row:%d col:%d", (unsigned long) rid, row, col);
+    }
+    double legacy = elapsed_sec(start) / count * 1e9;
+
+    double produce = 0;
+    start = bench_clock::now();
+    for (int i = 0; i < count; i += batch) {
+        bench_clock::time_point batch_start = bench_clock::now();
+        for (int j = 0; j < batch; j++) {
+            DBG_LOG("room:%lu put_chess row:%d col:%d", (unsigned long) rid, row, col);
+        }
+        produce += elapsed_sec(batch_start);
+        logger::flush();
+    }
+    double total = elapsed_sec(start) / count * 1e9;
+    produce = produce / count * 1e9;
+
+    logger::set_level(ERR);
+    start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        DBG_LOG("room:%lu put_chess row:%d col:%d", (unsigned long) rid, row, col);
+    }
+    double disabled = elapsed_sec(start) / count * 1e9;
+    logger::set_level(LOG_LEVEL);
+
+    start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        LOG_SAMPLE(DBG, 100, "room:%lu put_chess row:%d col:%d", (unsigned long) rid, row, col);
+        if (i % (batch * 100) == 0) {
+            logger::flush();
+        }
+    }
+    double sampled = elapsed_sec(start) / count * 1e9;
+
+    start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        LOG_RATE(DBG, 100, "room:%lu put_chess row:%d col:%d", (unsigned long) rid, row, col);
+    }
+    double limited = elapsed_sec(start) / count * 1e9;
+    logger::flush();
+    logger::set_output(stdout);
+    fclose(null);
+
+    printf("legacy fprintf:        %7.1f ns/line\n", legacy);
+    printf("async caller:          %7.1f ns/line\n", produce);
+    printf("async caller + drain:  %7.1f ns/line\n", total);
+    printf("level disabled:        %7.1f ns/line\n", disabled);
+    printf("sampled 1/100:         %7.1f ns/line\n", sampled);
+    printf("rate limited 100/s:    %7.1f ns/line\n", limited);
+}
+
+//在room_num个房间中按room_stress_test的规则下满棋盘，返回每个请求的平均耗时(ns)，请求在投递前已经构造好
+static double room_request_ns(server_t &srv, int room_num) {
+    online_manager om;
+    websocketpp::lib::asio::io_service io;
+    std::vector<room_ptr> rooms;
+    for (int i = 0; i < room_num; i++) {
+        uint64_t white = 2 * i + 1, black = 2 * i + 2;
+        room_ptr rp(new room(i + 1, nullptr, &om, &io));
+        rp->add_white_user(white);
+        rp->add_black_user(black);
+        server_t::connection_ptr wconn = srv.get_connection(), bconn = srv.get_connection();
+        om.enter_game_room(white, wconn);
+        om.enter_game_room(black, bconn);
+        rooms.push_back(rp);
+    }
+    for (int cell = 0; cell < BOARD_ROW * BOARD_COL; cell++) {
+        int row = cell / BOARD_COL, col = cell % BOARD_COL;
+        for (auto &rp: rooms) {
+            Json::Value req;
+            req["optype"] = "put_chess";
+            req["room_id"] = (Json::UInt64) rp->get_room_id();
+            req["uid"] = (Json::UInt64) ((row + 2 * col) % 4 < 2 ? rp->get_white_id() : rp->get_black_id());
+            req["row"] = row;
+            req["col"] = col;
+            rp->post_request(req);
+        }
+    }
+    //房间创建的日志先写完，不和被测代码抢CPU
+    logger::flush();
+    bench_clock::time_point start = bench_clock::now();
+    io.run();
+    return elapsed_sec(start) * 1e9 / ((double) room_num * BOARD_ROW * BOARD_COL);
+}
+
+//监控指标测试：./bench metrics [房间数] [轮数]
+//埋点本身的开销(计数器、直方图、计时器)，以及落子请求在打开和关闭计时时的耗时差别，两种情况交替运行取最小值
+//虚拟机上两次运行的差别可能有几个百分点，比埋点本身大，所以另外按"每个请求的埋点开销/请求耗时"估算
+static void bench_metrics(int argc, char *argv[]) {
+    int room_num = argc > 0 ? atoi(argv[0]) : 200;
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    metrics_registry &reg = metrics_registry::instance();
+    metrics_counter &counter = reg.counter("bench_counter_total", "bench");
+    metrics_histogram &hist = reg.histogram("bench_seconds", "bench");
+    volatile uint64_t sink = 0;
+    printf("%-32s %13s %14s\n", "Benchmark", "Time", "Iterations");
+    run_case("BM_counter_inc", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            counter.inc();
+        }
+    });
+    run_case("BM_histogram_record", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            hist.record(i & 0xffff);
+        }
+    });
+    run_case("BM_metrics_timer", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            metrics_timer timer(hist);
+        }
+    });
+    run_case("BM_now_ns", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            sum += metrics_util::now_ns();
+        }
+        sink = sum;
+    });
+    run_case("BM_ticks", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            sum += metrics_util::ticks();
+        }
+        sink = sum;
+    });
+    (void) sink;
+
+    server_t srv;
+    srv.set_access_channels(websocketpp::log::alevel::none);
+    srv.set_error_channels(websocketpp::log::elevel::none);
+    srv.init_asio();
+    double on = 1e30, off = 1e30;
+    room_request_ns(srv, room_num);//预热
+    for (int r = 0; r < rounds; r++) {
+        metrics_registry::set_enabled(false);
+        off = std::min(off, room_request_ns(srv, room_num));
+        metrics_registry::set_enabled(true);
+        on = std::min(on, room_request_ns(srv, room_num));
+    }
+    //落子请求上的埋点：一次计时加一次计数
+    const int probe = 1000000;
+    bench_clock::time_point probe_start = bench_clock::now();
+    for (int i = 0; i < probe; i++) {
+        metrics_timer timer(hist);
+        counter.inc();
+    }
+    double probe_ns = elapsed_sec(probe_start) * 1e9 / probe;
+    printf("tsc=%d ns/tick=%.4f\n", metrics_util::use_tsc(), metrics_util::ns_per_tick());
+    printf("room put_chess: metrics off %.0f ns/req, on %.0f ns/req, measured diff %.2f%%\n", off, on, (on - off) * 100 / off);
+    printf("room put_chess: instrumentation %.1f ns/req, estimated overhead %.2f%%\n", probe_ns, probe_ns * 100 / off);
+
+    //第一次导出要把各个回调和直方图分片的内存都摸一遍，计时取第二次
+    std::string body;
+    reg.render(body);
+    body.clear();
+    logger::flush();
+    bench_clock::time_point start = bench_clock::now();
+    reg.render(body);
+    printf("render /metrics: %zu B in %.0f us\n", body.size(), elapsed_sec(start) * 1e6);
+}
+
+//threads个线程共执行n次op(i)，打印吞吐和延迟分布
+static void store_case(const char *name, int threads, int n, const std::function<bool(int)> &op) {
+    metrics_histogram hist;
+    std::atomic<int> failed(0);
+    std::vector<std::thread> workers;
+    bench_clock::time_point start = bench_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            for (int i = t; i < n; i += threads) {
+                int64_t begin = metrics_util::now_ns();
+                if (op(i) == false) {
+                    failed++;
+                }
+                hist.record(metrics_util::now_ns() - begin);
+            }
+        });
+    }
+    for (auto &th: workers) {
+        th.join();
+    }
+    double sec = elapsed_sec(start);
+    metrics_snapshot snap;
+    hist.snapshot(snap);
+    printf("  %-14s %9.0f ops/s  p50=%-9.1f p99=%-9.1f p999=%-9.1f us  failed=%d\n", name, n / sec,
+           snap.percentile(0.5) / 1e3, snap.percentile(0.99) / 1e3, snap.percentile(0.999) / 1e3, failed.load());
+}
+
+//对一个用户存储依次执行注册、登录、按id查询、win/lose和批量写分，用户名带上前缀避免与已有数据冲突
+static void store_cases(user_store &store, const std::string &prefix, int users, int threads) {
+    std::vector<uint64_t> ids(users);
+    store_case("insert", threads, users, [&](int i) {
+        Json::Value user;
+        user["username"] = prefix + std::to_string(i);
+        user["password"] = "bench";
+        return store.insert(user);
+    });
+    store_case("login", threads, users, [&](int i) {
+        Json::Value user;
+        user["username"] = prefix + std::to_string(i);
+        user["password"] = "bench";
+        bool ok = store.login(user);
+        ids[i] = user["id"].asUInt64();
+        return ok;
+    });
+    store_case("select_by_id", threads, users, [&](int i) {
+        user_info info;
+        return store.select_by_id(ids[i], info);
+    });
+    store_case("win/lose", threads, users, [&](int i) {
+        return i % 2 == 0 ? store.win(ids[i]) : store.lose(ids[i]);
+    });
+    //score_writer的批量写入：每批64个用户，批次之间串行
+    //写入的序号是编造的，会推进score_journal中记录的已落库序号，服务器重放日志时会把真实的结果当作已落库跳过
+    //所以只在还没有任何写分记录的存储(新建的用户文件或者专门的测试库)上执行
+    uint64_t seq = 0;
+    if (store.get_score_seq(seq) == false || seq != 0) {
+        printf("  %-14s skipped: score_journal already has a row, use a scratch database\n", "apply_scores/64");
+        return;
+    }
+    store_case("apply_scores/64", 1, users / 64, [&](int i) {
+        std::vector<score_delta> deltas(64);
+        for (int j = 0; j < 64; j++) {
+            deltas[j].uid = ids[(i * 64 + j) % users];
+            deltas[j].score = SCORE_STEP;
+            deltas[j].total_count = 1;
+            deltas[j].win_count = 1;
+        }
+        return store.apply_scores(deltas, seq + i + 1);
+    });
+}
+
+//用户存储测试：./bench store [用户数] [线程数] [host user password dbname]
+//嵌入式用户文件与MySQL(给出连接参数时)在同样的负载下对比吞吐和延迟，写操作都等到落盘才返回
+//MySQL应当是专门的测试库：批量写分只在库中还没有score_journal记录时执行，执行后这个库不能再给服务器使用
+static void bench_store(int argc, char *argv[]) {
+    int users = argc > 0 ? atoi(argv[0]) : 10000;
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    std::string prefix = "st" + std::to_string(time(nullptr)) + "_";
+    printf("store: users=%d threads=%d\n", users, threads);
+    {
+        const char *path = "./bench_users.db";
+        unlink(path);
+        user_file uf(path);
+        printf("user_file %s:\n", path);
+        store_cases(uf, prefix, users, threads);
+        printf("  %lu syncs, %lu bytes\n", (unsigned long) uf.get_sync_count(), (unsigned long) uf.get_bytes());
+    }
+    if (argc > 5) {
+        user_table ut(argv[2], argv[3], argv[4], argv[5], 3306, threads);
+        printf("mysql %s:\n", argv[2]);
+        store_cases(ut, prefix, users, threads);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::map<std::string, std::function<void(int, char **)>> benches = {
+            {"io_pool", bench_io_pool},
+            {"check_win", bench_check_win},
+            {"five", bench_five},
+            {"online", bench_online},
+            {"db", bench_db},
+            {"cache", bench_cache},
+            {"match", bench_match},
+            {"match_queue", bench_match_queue},
+            {"match_tick", bench_match_tick},
+            {"session_timer", bench_session_timer},
+            {"session", bench_session},
+            {"session_snapshot", bench_session_snapshot},
+            {"spectate", bench_spectate},
+            {"proto", bench_proto},
+            {"json", bench_json},
+            {"static", bench_static},
+            {"log", bench_log},
+            {"metrics", bench_metrics},
+            {"store", bench_store},
+    };
+    if (argc < 2 || benches.count(argv[1]) == 0) {
+        printf("usage: %s <bench> [args...]\n", argv[0]);
+        for (auto &it: benches) {
+            printf("  %s\n", it.first.c_str());
+        }
+        return 1;
+    }
+    benches[argv[1]](argc - 2, argv + 2);
+    return 0;
+}
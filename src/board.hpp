@@ -0,0 +1,139 @@
+#pragma once
+#include "five.hpp"
+#include <cstdint>
+#include <cstring>
+
+#define BOARD_ROW 15
+#define BOARD_COL 15
+#define CHESS_WHITE 1
+#define CHESS_BLACK 2
+
+//棋盘按行展开，每行占16位(15列+1位恒为0的填充列)，一共15*16=240位，放在4个uint64_t中
+//填充列保证横向/斜向移位时不会从一行的末尾串到下一行的开头
+#define BOARD_STRIDE 16
+#define BOARD_WORDS 4
+
+//256位的位集合
+struct bits256 {
+    uint64_t w[BOARD_WORDS];
+
+    bool test(int pos) const {
+        return (w[pos >> 6] >> (pos & 63)) & 1;
+    }
+
+    void set(int pos) {
+        w[pos >> 6] |= (uint64_t) 1 << (pos & 63);
+    }
+};
+
+class bitboard {
+private:
+    bits256 _white;//白棋占据的位置
+    bits256 _black;//黑棋占据的位置
+
+    //每个格子在四个方向上的判胜窗口：该格子所在的行、列、正斜线、反斜线中距离它不超过4格的格子
+    //窗口只有9格，其中的任何5连都必然经过该格子，进程内只计算一次
+    struct window_masks {
+        bits256 win[BOARD_ROW * BOARD_COL][4];
+
+        window_masks() {
+            static const int dirs[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+            memset(this, 0, sizeof(*this));
+            for (int r = 0; r < BOARD_ROW; r++) {
+                for (int c = 0; c < BOARD_COL; c++) {
+                    for (int d = 0; d < 4; d++) {
+                        for (int k = -4; k <= 4; k++) {
+                            int sr = r + k * dirs[d][0], sc = c + k * dirs[d][1];
+                            if (in_range(sr, sc)) {
+                                win[r * BOARD_COL + c][d].set(index(sr, sc));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    static const window_masks &masks() {
+        static const window_masks m;
+        return m;
+    }
+
+    static int index(int row, int col) {
+        return row * BOARD_STRIDE + col;
+    }
+
+public:
+    bitboard() {
+        clear();
+    }
+
+    void clear() {
+        memset(&_white, 0, sizeof(_white));
+        memset(&_black, 0, sizeof(_black));
+    }
+
+    static bool in_range(int row, int col) {
+        return row >= 0 && row < BOARD_ROW && col >= 0 && col < BOARD_COL;
+    }
+
+    //返回指定位置的棋子颜色，0表示空位
+    int get(int row, int col) const {
+        int pos = index(row, col);
+        if (_white.test(pos)) {
+            return CHESS_WHITE;
+        }
+        if (_black.test(pos)) {
+            return CHESS_BLACK;
+        }
+        return 0;
+    }
+
+    void put(int row, int col, int color) {
+        int pos = index(row, col);
+        if (color == CHESS_WHITE) {
+            _white.set(pos);
+        } else {
+            _black.set(pos);
+        }
+    }
+
+    //把落子一方的位平面与(row, col)四个方向的判胜窗口相与，写入打包缓冲区
+    void pack_lines(int row, int col, int color, five_lines &out) const {
+        const bits256 &plane = color == CHESS_WHITE ? _white : _black;
+        const bits256 *win = masks().win[row * BOARD_COL + col];
+        for (int i = 0; i < BOARD_WORDS; i++) {
+            for (int d = 0; d < 4; d++) {
+                out.w[i][d] = plane.w[i] & win[d].w[i];
+            }
+        }
+    }
+
+    //在(row, col)落下color的棋子后，判断是否形成五子连珠(横行，纵列，正斜，反斜)
+    bool check_five(int row, int col, int color) const {
+        five_lines lines;
+        pack_lines(row, col, color, lines);
+        return five_detector::check(lines);
+    }
+
+    //逐格计数的标量实现，row_off和col_off是需要检查的方向，作为位运算版本的对照
+    bool five(int row, int col, int row_off, int col_off, int color) const {
+        int count = 1;
+        int search_row = row + row_off;
+        int search_col = col + col_off;
+        while (in_range(search_row, search_col) && get(search_row, search_col) == color) {
+            count++;
+            search_row += row_off;
+            search_col += col_off;
+        }
+
+        search_row = row - row_off;
+        search_col = col - col_off;
+        while (in_range(search_row, search_col) && get(search_row, search_col) == color) {
+            count++;
+            search_row -= row_off;
+            search_col -= col_off;
+        }
+        return (count >= 5);
+    }
+};
@@ -1,46 +1,135 @@
 #pragma once
+#include "db_pool.hpp"
+#include "metrics.hpp"
+#include "user_store.hpp"
 #include "util.hpp"
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <mutex>
-#define INSERT_USER "insert user values(null,'%s',password('%s'),1000,0,0);"
-#define LOGIN_USER "select id,score,total_count,win_count from user where username='%s' and password=password('%s');"
-#define USER_BY_NAME "select id,score,total_count,win_count from user where username='%s';"
-#define USER_BY_ID "select username, score, total_count, win_count from user where id=%d;"
-#define USER_WIN "update user set score=score+30, total_count=total_count+1, win_count=win_count+1 where id=%d;"
-#define USER_LOSE "update user set score=score-30, total_count=total_count+1 where id=%d;"
-class user_table {
+#include <string>
+#include <vector>
+//预处理语句，参数用?占位，由mysql_stmt_bind_param绑定，不再拼接sql字符串
+#define INSERT_USER "insert user values(null,?,password(?),1000,0,0);"//初始分数与USER_INIT_SCORE相同
+#define LOGIN_USER "select id,score,total_count,win_count from user where username=? and password=password(?);"
+#define USER_BY_NAME "select id,score,total_count,win_count from user where username=?;"
+#define USER_BY_ID "select username, score, total_count, win_count from user where id=?;"
+#define USER_WIN "update user set score=score+30, total_count=total_count+1, win_count=win_count+1 where id=?;"
+#define USER_LOSE "update user set score=score-30, total_count=total_count+1 where id=?;"
+#define SCORE_SEQ "select last_seq from score_journal where id=1;"
+//与db.sql相同，已有的部署可能还没有这张表
+#define CREATE_SCORE_JOURNAL "create table if not exists score_journal(id int primary key, last_seq bigint unsigned not null);"
+
+//预处理语句编号，对应db_pool::handle::execute的id
+typedef enum {
+    STMT_INSERT_USER,
+    STMT_LOGIN_USER,
+    STMT_USER_BY_NAME,
+    STMT_USER_BY_ID,
+    STMT_USER_WIN,
+    STMT_USER_LOSE,
+    STMT_SCORE_SEQ
+} user_stmt;
+
+class stmt_util {
 public:
-    user_table(const std::string &host, const std::string &username, const std::string &password, const std::string &dbname, uint16_t port = 3306) {
-        // 使用mysql_util命名空间中的mysql_create函数创建MySQL连接
-        _mysql = mysql_util::mysql_create(host, username, password, dbname, port);
+    static void bind_u64(MYSQL_BIND &bind, uint64_t *val) {
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_LONGLONG;
+        bind.buffer = val;
+        bind.is_unsigned = true;
+    }
+
+    static void bind_i64(MYSQL_BIND &bind, int64_t *val) {
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_LONGLONG;
+        bind.buffer = val;
+    }
+
+    static void bind_i32(MYSQL_BIND &bind, int32_t *val) {
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_LONG;
+        bind.buffer = val;
+    }
+
+    //字符串参数，len指向字符串长度
+    static void bind_str(MYSQL_BIND &bind, const char *str, unsigned long *len) {
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = (void *) str;
+        bind.buffer_length = *len;
+        bind.length = len;
+    }
+
+    //字符串结果，读取后len为实际长度
+    static void bind_str_out(MYSQL_BIND &bind, char *buf, unsigned long cap, unsigned long *len) {
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = buf;
+        bind.buffer_length = cap;
+        bind.length = len;
+    }
+
+    //读取唯一的一行结果到已绑定的缓冲区，结果不是恰好一行时返回false
+    static bool fetch_one(MYSQL_STMT *stmt, MYSQL_BIND *result) {
+        bool ok = mysql_stmt_bind_result(stmt, result) == 0 &&
+                  mysql_stmt_store_result(stmt) == 0 &&
+                  mysql_stmt_num_rows(stmt) == 1;
+        if (ok) {
+            int ret = mysql_stmt_fetch(stmt);
+            ok = ret == 0 || ret == MYSQL_DATA_TRUNCATED;
+        }
+        mysql_stmt_free_result(stmt);
+        return ok;
+    }
+};
+
+//MySQL中的用户表
+class user_table : public user_store {
+public:
+    using user_store::select_by_id;
+
+    user_table(const std::string &host, const std::string &username, const std::string &password, const std::string &dbname, uint16_t port = 3306, size_t pool_size = DB_POOL_SIZE)
+        : _pool(host, username, password, dbname, port, pool_size),
+          _journal("./score." + host + "_" + std::to_string(port) + "_" + dbname + ".journal") {
+        std::replace(_journal.begin() + 2, _journal.end(), '/', '_');
         // 检查连接是否成功创建
-        assert(_mysql);
+        db_pool::handle mysql(_pool);
+        assert(mysql.get());
+        //没有score_journal表时每次写入天梯分都会失败，后台线程会一直重试，启动时就建好，建不了拒绝启动
+        if (mysql.exec(CREATE_SCORE_JOURNAL) == false) {
+            ERR_LOG("create table score_journal failed");
+            abort();
+        }
     }
 
-    // 用户表对象的析构函数，用于释放与MySQL连接相关的资源
-    ~user_table() {
-        // 调用mysql_util命名空间中的mysql_destroy函数释放MySQL连接
-        mysql_util::mysql_destroy(_mysql);
-        // 将_mysql指针置为nullptr，防止出现悬挂指针
-        _mysql = nullptr;
+    // 连接池的大小与等待时间统计
+    db_pool_stats get_pool_stats() {
+        return _pool.get_stats();
     }
 
     //注册时新增用户
-    bool insert(Json::Value &user) {
-        // 构造插入数据库的SQL语句
-        char sql[4096] = {0};
+    bool insert(Json::Value &user) override {
+        static metrics_histogram &latency = query_latency("insert");
+        metrics_timer timer(latency);
         //数据校验，用户名和密码不能为空
         if (user["password"].isNull() || user["username"].isNull()) {
             DBG_LOG("INPUT PASSWORD OR USERNAME");
             return false;
         }
-        sprintf(sql, INSERT_USER, user["username"].asCString(), user["password"].asCString());
+        std::string name = user["username"].asString();
+        std::string pass = user["password"].asString();
+        unsigned long name_len = name.size(), pass_len = pass.size();
+        MYSQL_BIND params[2];
+        stmt_util::bind_str(params[0], name.c_str(), &name_len);
+        stmt_util::bind_str(params[1], pass.c_str(), &pass_len);
 
-        // 执行SQL语句，插入新的用户
-        bool ret = mysql_util::mysql_exec(_mysql, sql);
+        // 从连接池取出一个连接，执行预处理语句，插入新的用户
+        db_pool::handle mysql(_pool);
+        MYSQL_STMT *stmt = mysql.execute(STMT_INSERT_USER, INSERT_USER, params);
         // 如果插入失败，打印错误日志并返回false
-        if (!ret) {
-            ERR_LOG("insert user failed:%s", mysql_error(_mysql));
+        if (stmt == nullptr) {
+            ERR_LOG("insert user failed");
             return false;
         }
         // 如果插入成功，返回true
@@ -52,145 +141,194 @@ public:
     //   user: 包含用户登录信息和用户信息的Json::Value对象
     // 返回值:
     //   如果登录成功，返回true；否则返回false
-    bool login(Json::Value &user) {
-        // 构建SQL查询语句，使用用户提供的用户名和密码
-        char sql[4096] = {0};
-        sprintf(sql, LOGIN_USER, user["username"].asCString(), user["password"].asCString());
-        MYSQL_RES *res = nullptr;
-        
-        {
-            // 使用互斥锁保护MySQL连接，防止多线程并发访问
-            std::unique_lock<std::mutex> lock(_mutex);
+    bool login(Json::Value &user) override {
+        static metrics_histogram &latency = query_latency("login");
+        metrics_timer timer(latency);
+        std::string name = user["username"].asString();
+        std::string pass = user["password"].asString();
+        unsigned long name_len = name.size(), pass_len = pass.size();
+        MYSQL_BIND params[2];
+        stmt_util::bind_str(params[0], name.c_str(), &name_len);
+        stmt_util::bind_str(params[1], pass.c_str(), &pass_len);
 
-            // 执行MySQL查询
-            bool ret = mysql_util::mysql_exec(_mysql, sql);
-            if (!ret) {
-                ERR_LOG("login failed:%s", mysql_error(_mysql));
+        // 查询结果直接写入info的各个字段，不需要再从文本转换
+        user_info info;
+        MYSQL_BIND result[4];
+        stmt_util::bind_u64(result[0], &info.id);
+        stmt_util::bind_i64(result[1], &info.score);
+        stmt_util::bind_i32(result[2], &info.total_count);
+        stmt_util::bind_i32(result[3], &info.win_count);
+        {
+            // 从连接池取出一个连接，查询结束后归还，其他线程可以同时使用别的连接
+            db_pool::handle mysql(_pool);
+            MYSQL_STMT *stmt = mysql.execute(STMT_LOGIN_USER, LOGIN_USER, params);
+            if (stmt == nullptr) {
+                ERR_LOG("login failed");
                 return false;
             }
-
-            // 将查询结果存储在res中
-            res = mysql_store_result(_mysql);
-            if (!res) {
-                DBG_LOG("获取用户结果失败");
+            // 结果行数不等于1，表示用户信息不唯一，登录失败
+            if (stmt_util::fetch_one(stmt, result) == false) {
+                DBG_LOG("用户信息不唯一");
                 return false;
             }
         }
 
-        // 获取查询结果的行数
-        int row_num = mysql_num_rows(res);
-
-        // 如果行数不等于1，表示用户信息不唯一，登录失败
-        if (row_num != 1) {
-            DBG_LOG("用户信息不唯一");
-            return false;
-        }
-
-        // 从查询结果中提取用户信息并存储在Json::Value对象中
-        MYSQL_ROW row = mysql_fetch_row(res);
-        user["id"] = (Json::UInt64) std::stol(row[0]);
-        user["score"] = (Json::UInt64) std::stol(row[1]);
-        user["total_count"] = std::stoi(row[2]);
-        user["win_count"] = std::stoi(row[3]);
-
-        // 释放查询结果的内存
-        mysql_free_result(res);
+        user["id"] = (Json::UInt64) info.id;
+        user["score"] = (Json::Int64) info.score;
+        user["total_count"] = info.total_count;
+        user["win_count"] = info.win_count;
 
         // 登录成功
         return true;
     }
 
     //通过用户名获取用户信息
-    bool select_by_name(const std::string &name, Json::Value &user) {
-        char sql[4096] = {0};
-        sprintf(sql, USER_BY_NAME, name.c_str());
-        MYSQL_RES *res = nullptr;
+    bool select_by_name(const std::string &name, Json::Value &user) override {
+        static metrics_histogram &latency = query_latency("select_by_name");
+        metrics_timer timer(latency);
+        user_info info;
+        unsigned long name_len = name.size();
+        MYSQL_BIND params[1];
+        stmt_util::bind_str(params[0], name.c_str(), &name_len);
+        MYSQL_BIND result[4];
+        stmt_util::bind_u64(result[0], &info.id);
+        stmt_util::bind_i64(result[1], &info.score);
+        stmt_util::bind_i32(result[2], &info.total_count);
+        stmt_util::bind_i32(result[3], &info.win_count);
         {
-            std::unique_lock<std::mutex> lock(_mutex);
-            bool ret = mysql_util::mysql_exec(_mysql, sql);
-            if (ret == false) {
+            db_pool::handle mysql(_pool);
+            MYSQL_STMT *stmt = mysql.execute(STMT_USER_BY_NAME, USER_BY_NAME, params);
+            if (stmt == nullptr) {
                 DBG_LOG("get user by name failed!!\n");
                 return false;
             }
             //按理说要么有数据，要么没有数据，就算有数据也只能有一条数据
-            res = mysql_store_result(_mysql);
-            if (res == NULL) {
-                DBG_LOG("have no user info!!");
+            if (stmt_util::fetch_one(stmt, result) == false) {
+                DBG_LOG("the user information queried is not unique!!");
                 return false;
             }
         }
-        int row_num = mysql_num_rows(res);
-        if (row_num != 1) {
-            DBG_LOG("the user information queried is not unique!!");
-            return false;
-        }
-        MYSQL_ROW row = mysql_fetch_row(res);
-        user["id"] = (Json::UInt64) std::stol(row[0]);
+        user["id"] = (Json::UInt64) info.id;
         user["username"] = name;
-        user["score"] = (Json::UInt64) std::stol(row[1]);
-        user["total_count"] = std::stoi(row[2]);
-        user["win_count"] = std::stoi(row[3]);
-        mysql_free_result(res);
+        user["score"] = (Json::Int64) info.score;
+        user["total_count"] = info.total_count;
+        user["win_count"] = info.win_count;
         return true;
     }
 
-    //通过id获取用户信息
-    bool select_by_id(int id, Json::Value &user) {
-        char sql[4096] = {0};
-        sprintf(sql, USER_BY_ID, id);
-        MYSQL_RES *res = NULL;
-        {
-            std::unique_lock<std::mutex> lock(_mutex);
-            bool ret = mysql_util::mysql_exec(_mysql, sql);
-            if (ret == false) {
-                DBG_LOG("get user by id failed!!\n");
-                return false;
-            }
-            //按理说要么有数据，要么没有数据，就算有数据也只能有一条数据
-            res = mysql_store_result(_mysql);
-            if (res == NULL) {
-                DBG_LOG("have no user info!!");
-                return false;
-            }
+    //通过id获取用户信息，结果直接写入user_info
+    bool select_by_id(uint64_t id, user_info &info) override {
+        static metrics_histogram &latency = query_latency("select_by_id");
+        metrics_timer timer(latency);
+        info.id = id;
+        MYSQL_BIND params[1];
+        stmt_util::bind_u64(params[0], &info.id);
+        MYSQL_BIND result[4];
+        stmt_util::bind_str_out(result[0], info.username, USERNAME_MAX, &info.username_len);
+        stmt_util::bind_i64(result[1], &info.score);
+        stmt_util::bind_i32(result[2], &info.total_count);
+        stmt_util::bind_i32(result[3], &info.win_count);
+
+        db_pool::handle mysql(_pool);
+        MYSQL_STMT *stmt = mysql.execute(STMT_USER_BY_ID, USER_BY_ID, params);
+        if (stmt == nullptr) {
+            DBG_LOG("get user by id failed!!\n");
+            return false;
         }
-        int row_num = mysql_num_rows(res);
-        if (row_num != 1) {
+        //按理说要么有数据，要么没有数据，就算有数据也只能有一条数据
+        if (stmt_util::fetch_one(stmt, result) == false) {
             DBG_LOG("the user information queried is not unique!!");
             return false;
         }
-        MYSQL_ROW row = mysql_fetch_row(res);
-        user["id"] = (Json::UInt64) id;
-        user["username"] = row[0];
-        user["score"] = (Json::UInt64) std::stol(row[1]);
-        user["total_count"] = std::stoi(row[2]);
-        user["win_count"] = std::stoi(row[3]);
-        mysql_free_result(res);
+        if (info.username_len > USERNAME_MAX) {
+            info.username_len = USERNAME_MAX;
+        }
         return true;
     }
+
     //胜利时天梯分增加30，战斗场次增加1，胜利场次增加1
-    bool win(uint64_t id) {
-        char sql[4096] = {0};
-        sprintf(sql, USER_WIN, id);
-        bool ret = mysql_util::mysql_exec(_mysql, sql);
-        if (ret == false) {
-            DBG_LOG("update win user info failed!!");
+    bool win(uint64_t id) override {
+        static metrics_histogram &latency = query_latency("win");
+        metrics_timer timer(latency);
+        return update(STMT_USER_WIN, USER_WIN, id, "update win user info failed!!");
+    }
+    //失败时天梯分数减少30，战斗场次增加1，其他不变。
+    bool lose(uint64_t id) override {
+        static metrics_histogram &latency = query_latency("lose");
+        metrics_timer timer(latency);
+        return update(STMT_USER_LOSE, USER_LOSE, id, "update lose user info failed!!");
+    }
+
+    //日志按数据库实例区分，文件名中不能有目录分隔符
+    std::string journal_path() const override {
+        return _journal;
+    }
+
+    //读取已经落库的对局结果的最大序号，还没有记录时为0
+    bool get_score_seq(uint64_t &seq) override {
+        static metrics_histogram &latency = query_latency("score_seq");
+        metrics_timer timer(latency);
+        seq = 0;
+        MYSQL_BIND result[1];
+        stmt_util::bind_u64(result[0], &seq);
+        db_pool::handle mysql(_pool);
+        MYSQL_STMT *stmt = mysql.execute(STMT_SCORE_SEQ, SCORE_SEQ, nullptr);
+        if (stmt == nullptr) {
             return false;
         }
+        if (stmt_util::fetch_one(stmt, result) == false) {
+            seq = 0;
+        }
         return true;
     }
-    //失败时天梯分数减少30，战斗场次增加1，其他不变。
-    bool lose(uint64_t id) {
-        char sql[4096] = {0};
-        sprintf(sql, USER_LOSE, id);
-        bool ret = mysql_util::mysql_exec(_mysql, sql);
-        if (ret == false) {
-            DBG_LOG("update lose user info failed!!");
+
+    //在一个事务中写入一批合并后的分数变化，并记录这一批结果的最大序号
+    //update语句中只有整数，直接拼接；事务内的语句失败时不能重连重试，整批回滚后由调用者重试
+    bool apply_scores(const std::vector<score_delta> &deltas, uint64_t seq) override {
+        if (deltas.empty()) {
+            return true;
+        }
+        static metrics_histogram &latency = query_latency("apply_scores");
+        metrics_timer timer(latency);
+        std::string score = "score=score+case id", total = "total_count=total_count+case id", win = "win_count=win_count+case id", ids;
+        for (auto &d: deltas) {
+            std::string when = " when " + std::to_string(d.uid) + " then ";
+            score += when + std::to_string(d.score);
+            total += when + std::to_string(d.total_count);
+            win += when + std::to_string(d.win_count);
+            ids += (ids.empty() ? "" : ",") + std::to_string(d.uid);
+        }
+        std::string sql = "update user set " + score + " else 0 end, " + total + " else 0 end, " + win + " else 0 end where id in (" + ids + ");";
+        std::string seq_sql = "insert into score_journal values(1," + std::to_string(seq) + ") on duplicate key update last_seq=greatest(last_seq,values(last_seq));";
+
+        db_pool::handle mysql(_pool);
+        MYSQL *conn = mysql.get();
+        if (conn == nullptr || mysql_util::mysql_exec(conn, "start transaction;") == false) {
+            ERR_LOG("apply scores failed");
+            return false;
+        }
+        if (mysql_util::mysql_exec(conn, sql) && mysql_util::mysql_exec(conn, seq_sql) &&
+            mysql_util::mysql_exec(conn, "commit;")) {
+            return true;
+        }
+        mysql_util::mysql_exec(conn, "rollback;");
+        return false;
+    }
+
+private:
+    bool update(user_stmt id, const char *sql, uint64_t uid, const char *err) {
+        MYSQL_BIND params[1];
+        stmt_util::bind_u64(params[0], &uid);
+        db_pool::handle mysql(_pool);
+        if (mysql.execute(id, sql, params) == nullptr) {
+            DBG_LOG("%s", err);
             return false;
         }
         return true;
     }
 
 private:
-    MYSQL *_mysql;    //mysql操作句柄
-    std::mutex _mutex;//互斥锁保护数据库的访问操作
-};
\ No newline at end of file
+    db_pool _pool;       //mysql连接池，每次操作取出一个连接
+    std::string _journal;//对局结果日志的路径
+};
+
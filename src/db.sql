@@ -8,4 +8,9 @@ create table if not exists user(
     score int,
     total_count int,
     win_count int
-);
\ No newline at end of file
+);
+-- 天梯分异步写入已经落库的最大对局序号，只有id=1一行
+create table if not exists score_journal(
+    id int primary key,
+    last_seq bigint unsigned not null
+);
@@ -0,0 +1,259 @@
+#pragma once
+#include "logger.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <mysql/errmsg.h>
+#include <string>
+#include <vector>
+
+#define DB_POOL_SIZE 8              //默认连接数
+#define DB_POOL_PING_IDLE_MS 30000  //空闲超过这个时间的连接，取出时先ping一次
+#define DB_POOL_WAIT_BUCKETS 32     //等待时间直方图的桶数，第i个桶统计[2^(i-1), 2^i)微秒
+
+//连接池的统计信息
+struct db_pool_stats {
+    size_t size;                              //连接总数
+    size_t idle;                              //当前空闲的连接数
+    uint64_t acquire_count;                   //取出连接的总次数
+    uint64_t wait_count;                      //因为没有空闲连接而等待的次数
+    uint64_t wait_total_us;                   //累计等待时间
+    uint64_t wait_max_us;                     //最长的一次等待
+    uint64_t reconnect_count;                 //重连次数
+    uint64_t wait_hist[DB_POOL_WAIT_BUCKETS]; //等待时间直方图
+
+    //根据直方图估算等待时间的百分位数(微秒，取桶的上界)，p取值(0, 1]
+    uint64_t wait_percentile(double p) const {
+        uint64_t target = (uint64_t)(acquire_count * p);
+        uint64_t seen = 0;
+        for (int i = 0; i < DB_POOL_WAIT_BUCKETS; i++) {
+            seen += wait_hist[i];
+            if (seen >= target && seen != 0) {
+                return i == 0 ? 0 : (uint64_t) 1 << i;
+            }
+        }
+        return wait_max_us;
+    }
+};
+
+//有上限的MySQL连接池：每次数据库操作取出一个连接，用完归还
+//取出时对长时间空闲的连接做健康检查，执行语句遇到连接断开(CR_SERVER_GONE_ERROR/CR_SERVER_LOST)时自动重连并重试一次
+class db_pool {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    struct slot {
+        MYSQL *mysql;                   //连接句柄，重连失败时为空
+        clock::time_point last_used;    //最近一次归还的时间
+        std::vector<MYSQL_STMT *> stmts;//在这个连接上预处理过的语句，下标为语句编号
+    };
+
+    //RAII方式使用连接：构造时取出，析构时归还
+    class handle {
+    private:
+        db_pool *_pool;
+        slot *_slot;
+
+    public:
+        handle(db_pool &pool) : _pool(&pool), _slot(pool.acquire()) {}
+        ~handle() {
+            _pool->release(_slot);
+        }
+        handle(const handle &) = delete;
+        handle &operator=(const handle &) = delete;
+
+        //连接不可用(重连也失败)时返回空
+        MYSQL *get() {
+            return _slot->mysql;
+        }
+
+        //执行sql，连接断开时重连后再试一次
+        bool exec(const std::string &sql) {
+            if (_slot->mysql == nullptr && _pool->reconnect(_slot) == false) {
+                return false;
+            }
+            if (mysql_util::mysql_exec(_slot->mysql, sql)) {
+                return true;
+            }
+            if (is_gone(_slot->mysql) == false || _pool->reconnect(_slot) == false) {
+                return false;
+            }
+            return mysql_util::mysql_exec(_slot->mysql, sql);
+        }
+
+        //执行编号为id的预处理语句，每个连接上只在第一次使用时prepare一次
+        //params为参数绑定，没有参数时传空；连接断开时重连、重新prepare后再试一次
+        //成功返回语句句柄，调用者读取结果后需要mysql_stmt_free_result
+        MYSQL_STMT *execute(size_t id, const char *sql, MYSQL_BIND *params) {
+            for (int retry = 0; retry < 2; retry++) {
+                if (_slot->mysql == nullptr && _pool->reconnect(_slot) == false) {
+                    return nullptr;
+                }
+                MYSQL_STMT *stmt = prepare(id, sql);
+                if (stmt == nullptr) {
+                    if (is_gone(_slot->mysql) && _pool->reconnect(_slot)) {
+                        continue;
+                    }
+                    return nullptr;
+                }
+                if (params != nullptr && mysql_stmt_bind_param(stmt, params)) {
+                    ERR_LOG("mysql_stmt_bind_param failed:%s", mysql_stmt_error(stmt));
+                    return nullptr;
+                }
+                if (mysql_stmt_execute(stmt) == 0) {
+                    return stmt;
+                }
+                ERR_LOG("mysql_stmt_execute failed:%s", mysql_stmt_error(stmt));
+                if (stmt_gone(stmt) == false || _pool->reconnect(_slot) == false) {
+                    return nullptr;
+                }
+            }
+            return nullptr;
+        }
+
+    private:
+        MYSQL_STMT *prepare(size_t id, const char *sql) {
+            if (id >= _slot->stmts.size()) {
+                _slot->stmts.resize(id + 1, nullptr);
+            }
+            if (_slot->stmts[id] != nullptr) {
+                return _slot->stmts[id];
+            }
+            MYSQL_STMT *stmt = mysql_stmt_init(_slot->mysql);
+            if (stmt == nullptr) {
+                ERR_LOG("mysql_stmt_init failed:%s", mysql_error(_slot->mysql));
+                return nullptr;
+            }
+            if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+                ERR_LOG("mysql_stmt_prepare failed:%s %s", sql, mysql_stmt_error(stmt));
+                mysql_stmt_close(stmt);
+                return nullptr;
+            }
+            _slot->stmts[id] = stmt;
+            return stmt;
+        }
+
+        static bool stmt_gone(MYSQL_STMT *stmt) {
+            unsigned int err = mysql_stmt_errno(stmt);
+            return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+        }
+    };
+
+    db_pool(const std::string &host, const std::string &user, const std::string &password,
+            const std::string &dbname, uint16_t port, size_t size = DB_POOL_SIZE)
+        : _host(host), _user(user), _password(password), _dbname(dbname), _port(port), _slots(size == 0 ? 1 : size) {
+        memset(&_stats, 0, sizeof(_stats));
+        _stats.size = _slots.size();
+        for (auto &s: _slots) {
+            s.mysql = mysql_util::mysql_create(_host, _user, _password, _dbname, _port);
+            s.last_used = clock::now();
+            _idle.push_back(&s);
+        }
+        _stats.idle = _idle.size();
+        DBG_LOG("数据库连接池初始化完毕，连接数:%zu", _slots.size());
+    }
+
+    ~db_pool() {
+        for (auto &s: _slots) {
+            close_stmts(&s);
+            mysql_util::mysql_destroy(s.mysql);
+            s.mysql = nullptr;
+        }
+    }
+
+    //判断语句失败是不是因为连接已经断开
+    static bool is_gone(MYSQL *mysql) {
+        unsigned int err = mysql_errno(mysql);
+        return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+    }
+
+    db_pool_stats get_stats() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _stats;
+    }
+
+private:
+    //取出一个空闲连接，没有空闲连接时阻塞等待
+    slot *acquire() {
+        clock::time_point start = clock::now();
+        slot *s = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_idle.empty()) {
+                _stats.wait_count++;
+                _cond.wait(lock, [this]() { return _idle.empty() == false; });
+            }
+            s = _idle.back();
+            _idle.pop_back();
+            uint64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+            _stats.idle = _idle.size();
+            _stats.acquire_count++;
+            _stats.wait_total_us += wait_us;
+            if (wait_us > _stats.wait_max_us) {
+                _stats.wait_max_us = wait_us;
+            }
+            int bucket = 0;
+            while (wait_us != 0 && bucket < DB_POOL_WAIT_BUCKETS - 1) {
+                wait_us >>= 1;
+                bucket++;
+            }
+            _stats.wait_hist[bucket]++;
+        }
+        //健康检查放在锁外，ping失败则重连
+        if (s->mysql == nullptr) {
+            reconnect(s);
+        } else if (start - s->last_used > std::chrono::milliseconds(DB_POOL_PING_IDLE_MS) && mysql_ping(s->mysql) != 0) {
+            ERR_LOG("mysql ping failed:%s", mysql_error(s->mysql));
+            reconnect(s);
+        }
+        return s;
+    }
+
+    void release(slot *s) {
+        s->last_used = clock::now();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.push_back(s);
+        _stats.idle = _idle.size();
+        _cond.notify_one();
+    }
+
+    //预处理语句属于具体的连接，连接关闭或重连前要先释放
+    static void close_stmts(slot *s) {
+        for (auto &stmt: s->stmts) {
+            if (stmt != nullptr) {
+                mysql_stmt_close(stmt);
+                stmt = nullptr;
+            }
+        }
+    }
+
+    bool reconnect(slot *s) {
+        close_stmts(s);
+        mysql_util::mysql_destroy(s->mysql);
+        s->mysql = mysql_util::mysql_create(_host, _user, _password, _dbname, _port);
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stats.reconnect_count++;
+        }
+        if (s->mysql == nullptr) {
+            ERR_LOG("mysql reconnect failed");
+            return false;
+        }
+        DBG_LOG("mysql reconnect success");
+        return true;
+    }
+
+private:
+    std::string _host;
+    std::string _user;
+    std::string _password;
+    std::string _dbname;
+    uint16_t _port;
+    std::vector<slot> _slots;  //所有连接，创建后大小不再变化
+    std::vector<slot *> _idle; //空闲连接
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    db_pool_stats _stats;
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FIVE_X86 1
+#endif
+
+//判胜用的打包缓冲区：落子一方的棋盘位平面分别与四个方向的判胜窗口相与的结果
+//按[字][方向]排列，同一个字下标的四个方向正好放进一个AVX2寄存器，一遍处理完四个方向
+//方向依次为横行、纵列、正斜、反斜，对应的移位步长见five_detector::step
+struct five_lines {
+    alignas(32) uint64_t w[4][4];
+};
+
+//判断打包缓冲区中是否存在某个方向上连续的5个棋子
+//提供标量、SSE2、AVX2三种实现，运行时根据CPU支持的指令集选择
+class five_detector {
+public:
+    typedef enum {
+        FIVE_SCALAR,
+        FIVE_SSE2,
+        FIVE_AVX2
+    } five_isa;
+
+    //四个方向在位平面上的移位步长：棋盘每行16位
+    static int step(int dir) {
+        static const int steps[4] = {1, 16, 17, 15};
+        return steps[dir];
+    }
+
+    //当前CPU支持的最快实现，进程内只检测一次
+    static five_isa best_isa() {
+        static const five_isa isa = detect_isa();
+        return isa;
+    }
+
+    static const char *isa_name(five_isa isa) {
+        switch (isa) {
+            case FIVE_AVX2:
+                return "avx2";
+            case FIVE_SSE2:
+                return "sse2";
+            default:
+                return "scalar";
+        }
+    }
+
+    static bool check(const five_lines &l) {
+        return check(l, best_isa());
+    }
+
+    static bool check(const five_lines &l, five_isa isa) {
+#ifdef FIVE_X86
+        if (isa == FIVE_AVX2) {
+            return check_avx2(l);
+        }
+        if (isa == FIVE_SSE2) {
+            return check_sse2(l);
+        }
+#endif
+        return check_scalar(l);
+    }
+
+    //批量判断，用于回放校验和反作弊复查：result[i]为第i个缓冲区的结果(1为五子连珠)
+    static void check_batch(const five_lines *lines, size_t n, uint8_t *result) {
+        check_batch(lines, n, result, best_isa());
+    }
+
+    static void check_batch(const five_lines *lines, size_t n, uint8_t *result, five_isa isa) {
+#ifdef FIVE_X86
+        if (isa == FIVE_AVX2) {
+            return batch_avx2(lines, n, result);
+        }
+        if (isa == FIVE_SSE2) {
+            for (size_t i = 0; i < n; i++) {
+                result[i] = check_sse2(lines[i]);
+            }
+            return;
+        }
+#endif
+        for (size_t i = 0; i < n; i++) {
+            result[i] = check_scalar(lines[i]);
+        }
+    }
+
+    static bool check_scalar(const five_lines &l) {
+        for (int d = 0; d < 4; d++) {
+            uint64_t w0 = l.w[0][d], w1 = l.w[1][d], w2 = l.w[2][d], w3 = l.w[3][d];
+            int k = step(d);
+            and_shr(w0, w1, w2, w3, k);    //连续2个
+            and_shr(w0, w1, w2, w3, 2 * k);//连续4个
+            and_shr(w0, w1, w2, w3, k);    //连续5个
+            if ((w0 | w1 | w2 | w3) != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static five_isa detect_isa() {
+#ifdef FIVE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return FIVE_AVX2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return FIVE_SSE2;
+        }
+#endif
+        return FIVE_SCALAR;
+    }
+
+    //4个字组成的256位整体右移k位后与自身相与(0<k<64)
+    static void and_shr(uint64_t &w0, uint64_t &w1, uint64_t &w2, uint64_t &w3, int k) {
+        w0 &= (w0 >> k) | (w1 << (64 - k));
+        w1 &= (w1 >> k) | (w2 << (64 - k));
+        w2 &= (w2 >> k) | (w3 << (64 - k));
+        w3 &= w3 >> k;
+    }
+
+#ifdef FIVE_X86
+    //SSE2没有按通道不同位数的移位，分别移位后用move_sd取低通道的a结果和高通道的b结果
+    static __m128i srl2(__m128i v, __m128i ka, __m128i kb) {
+        return _mm_castpd_si128(_mm_move_sd(_mm_castsi128_pd(_mm_srl_epi64(v, kb)), _mm_castsi128_pd(_mm_srl_epi64(v, ka))));
+    }
+
+    static __m128i sll2(__m128i v, __m128i ka, __m128i kb) {
+        return _mm_castpd_si128(_mm_move_sd(_mm_castsi128_pd(_mm_sll_epi64(v, kb)), _mm_castsi128_pd(_mm_sll_epi64(v, ka))));
+    }
+
+    static void and_shr_sse2(__m128i w[4], int ka, int kb) {
+        __m128i ra = _mm_cvtsi32_si128(ka), rb = _mm_cvtsi32_si128(kb);
+        __m128i la = _mm_cvtsi32_si128(64 - ka), lb = _mm_cvtsi32_si128(64 - kb);
+        w[0] = _mm_and_si128(w[0], _mm_or_si128(srl2(w[0], ra, rb), sll2(w[1], la, lb)));
+        w[1] = _mm_and_si128(w[1], _mm_or_si128(srl2(w[1], ra, rb), sll2(w[2], la, lb)));
+        w[2] = _mm_and_si128(w[2], _mm_or_si128(srl2(w[2], ra, rb), sll2(w[3], la, lb)));
+        w[3] = _mm_and_si128(w[3], srl2(w[3], ra, rb));
+    }
+
+    //每个寄存器放两个方向，两组寄存器处理完四个方向
+    static bool check_sse2(const five_lines &l) {
+        __m128i acc = _mm_setzero_si128();
+        for (int p = 0; p < 4; p += 2) {
+            __m128i w[4];
+            for (int i = 0; i < 4; i++) {
+                w[i] = _mm_loadu_si128((const __m128i *) &l.w[i][p]);
+            }
+            int ka = step(p), kb = step(p + 1);
+            and_shr_sse2(w, ka, kb);
+            and_shr_sse2(w, 2 * ka, 2 * kb);
+            and_shr_sse2(w, ka, kb);
+            acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(w[0], w[1]), _mm_or_si128(w[2], w[3])));
+        }
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff;
+    }
+
+    //AVX2有按通道的可变移位，一个寄存器放下同一个字的四个方向
+    __attribute__((target("avx2"))) static void and_shr_avx2(__m256i &w0, __m256i &w1, __m256i &w2, __m256i &w3,
+                                                           __m256i kr, __m256i kl) {
+        w0 = _mm256_and_si256(w0, _mm256_or_si256(_mm256_srlv_epi64(w0, kr), _mm256_sllv_epi64(w1, kl)));
+        w1 = _mm256_and_si256(w1, _mm256_or_si256(_mm256_srlv_epi64(w1, kr), _mm256_sllv_epi64(w2, kl)));
+        w2 = _mm256_and_si256(w2, _mm256_or_si256(_mm256_srlv_epi64(w2, kr), _mm256_sllv_epi64(w3, kl)));
+        w3 = _mm256_and_si256(w3, _mm256_srlv_epi64(w3, kr));
+    }
+
+    __attribute__((target("avx2"))) static bool kernel_avx2(const five_lines &l, __m256i k1, __m256i k1c, __m256i k2, __m256i k2c) {
+        __m256i w0 = _mm256_loadu_si256((const __m256i *) l.w[0]);
+        __m256i w1 = _mm256_loadu_si256((const __m256i *) l.w[1]);
+        __m256i w2 = _mm256_loadu_si256((const __m256i *) l.w[2]);
+        __m256i w3 = _mm256_loadu_si256((const __m256i *) l.w[3]);
+        and_shr_avx2(w0, w1, w2, w3, k1, k1c);//连续2个
+        and_shr_avx2(w0, w1, w2, w3, k2, k2c);//连续4个
+        and_shr_avx2(w0, w1, w2, w3, k1, k1c);//连续5个
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(w0, w1), _mm256_or_si256(w2, w3));
+        return !_mm256_testz_si256(acc, acc);
+    }
+
+    __attribute__((target("avx2"))) static bool check_avx2(const five_lines &l) {
+        const __m256i k1 = _mm256_setr_epi64x(1, 16, 17, 15);
+        const __m256i k2 = _mm256_add_epi64(k1, k1);
+        const __m256i full = _mm256_set1_epi64x(64);
+        return kernel_avx2(l, k1, _mm256_sub_epi64(full, k1), k2, _mm256_sub_epi64(full, k2));
+    }
+
+    __attribute__((target("avx2"))) static void batch_avx2(const five_lines *lines, size_t n, uint8_t *result) {
+        const __m256i k1 = _mm256_setr_epi64x(1, 16, 17, 15);
+        const __m256i k2 = _mm256_add_epi64(k1, k1);
+        const __m256i full = _mm256_set1_epi64x(64);
+        const __m256i k1c = _mm256_sub_epi64(full, k1);
+        const __m256i k2c = _mm256_sub_epi64(full, k2);
+        for (size_t i = 0; i < n; i++) {
+            result[i] = kernel_avx2(lines[i], k1, k1c, k2, k2c);
+        }
+    }
+#endif
+};
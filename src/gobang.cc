@@ -1,12 +1,23 @@
+#include "board.hpp"
 #include "db.hpp"
+#include "five.hpp"
 #include "logger.hpp"
 #include "matcher.hpp"
 #include "online.hpp"
 #include "room.hpp"
 #include "server.hpp"
 #include "session.hpp"
+#include "user_cache.hpp"
+#include "user_file.hpp"
 #include "util.hpp"
+#include <atomic>
+#include <fcntl.h>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #define HOST "127.0.0.1"
 #define PORT 3306
@@ -112,6 +123,264 @@ void db4_test() {
     user.lose(2);
 }
 
+//异步写入：提交后立即可以查到新的分数，析构时全部写入数据库
+void score_test() {
+    user_table user(HOST, USER, PASS, DBNAME, PORT);
+    user_info before, after;
+    user.select_by_id(1, before);
+    {
+        score_writer sw(&user);
+        for (int i = 0; i < 1000; i++) {
+            sw.submit(1, 2);
+        }
+        sw.submit(2, 1);
+        user_info info;
+        sw.select_by_id(1, info);
+        //赢了1000次输了1次，分数加29970
+        DBG_LOG("pending score:%ld expect:%ld", (long) info.score, (long) before.score + 29970);
+    }
+    user.select_by_id(1, after);
+    DBG_LOG("db score:%ld expect:%ld", (long) after.score, (long) before.score + 29970);
+}
+
+//缓存：第二次查询命中，对局结果直接写入缓存中的分数
+void cache_test() {
+    user_table user(HOST, USER, PASS, DBNAME, PORT);
+    score_writer sw(&user);
+    user_cache uc(&sw);
+    user_info info;
+    uc.select_by_id(1, info);
+    int64_t score = info.score;
+    uc.record_result(1, 2);
+    uc.select_by_id(1, info);
+    user_cache_stats stats = uc.get_stats();
+    DBG_LOG("score:%ld expect:%ld hit:%lu miss:%lu", (long) info.score, (long) score + SCORE_STEP,
+            (unsigned long) stats.hit, (unsigned long) stats.miss);
+}
+
+//嵌入式用户文件：重新打开时从记录重建索引，没有提交完整的批次被丢弃
+void user_file_test() {
+    const char *path = "./user_file_test.db";
+    unlink(path);
+    uint64_t bytes;
+    {
+        user_file uf(path);
+        Json::Value root;
+        root["username"] = "xiaoming";
+        root["password"] = "2002Phw@";
+        bool first = uf.insert(root), dup = uf.insert(root);
+        Json::Value bad = root;
+        bad["password"] = "123";
+        bool ok = uf.login(root), wrong = uf.login(bad);
+        DBG_LOG("insert:%d duplicate:%d login:%d wrong password:%d", first, dup, ok, wrong);
+        uf.win(1);
+        uf.lose(1);
+        uf.win(1);
+        std::vector<score_delta> deltas(1);
+        deltas[0].uid = 1;
+        deltas[0].score = SCORE_STEP;
+        deltas[0].total_count = 1;
+        deltas[0].win_count = 1;
+        uf.apply_scores(deltas, 5);
+        bytes = uf.get_bytes();
+    }
+    {
+        user_file uf(path);
+        user_info info;
+        uint64_t seq;
+        uf.select_by_id(1, info);
+        uf.get_score_seq(seq);
+        DBG_LOG("reopen score:%ld total:%d win:%d seq:%lu expect 1060 4 3 5", (long) info.score, info.total_count,
+                info.win_count, (unsigned long) seq);
+    }
+    //模拟崩溃时最后一条COMMIT记录只写了一半，这一批分数变化应当被丢弃
+    int fd = open(path, O_RDWR);
+    char c = 0x5a;
+    if (fd < 0 || pwrite(fd, &c, 1, bytes - 8) != 1) {
+        ERR_LOG("corrupt user file failed");
+    }
+    close(fd);
+    {
+        user_file uf(path);
+        user_info info;
+        uint64_t seq;
+        uf.select_by_id(1, info);
+        uf.get_score_seq(seq);
+        DBG_LOG("torn commit score:%ld total:%d win:%d seq:%lu expect 1030 3 2 0", (long) info.score, info.total_count,
+                info.win_count, (unsigned long) seq);
+        Json::Value root;
+        root["username"] = "xiaohong";
+        root["password"] = "2002Phw@";
+        uf.insert(root);
+    }
+    {
+        user_file uf(path);
+        Json::Value root;
+        bool ok = uf.select_by_name("xiaohong", root);
+        DBG_LOG("after recovery select:%d id:%lu expect 2", ok, (unsigned long) root["id"].asUInt64());
+    }
+    unlink(path);
+}
+
+//写库和查询并发：查到的分数必须落在查询开始前已经提交、结束前开始提交的对局数之间，不会漏加也不会重复加
+void score_race_test() {
+    const char *path = "./score_race_test.db", *journal = "./score_race_test.journal";
+    unlink(path);
+    unlink(journal);
+    user_file uf(path);
+    Json::Value a, b;
+    a["username"] = "a";
+    a["password"] = "123";
+    b["username"] = "b";
+    b["password"] = "123";
+    uf.insert(a);
+    uf.insert(b);
+    std::atomic<int> started(0), done(0);
+    std::atomic<bool> stop(false);
+    std::atomic<long> reads(0), bad(0);
+    {
+        score_writer sw(&uf, journal);
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 2; i++) {
+            readers.push_back(std::thread([&]() {
+                while (stop == false) {
+                    int lo = done;
+                    user_info info;
+                    sw.select_by_id(1, info);
+                    int hi = started;
+                    int64_t won = (info.score - USER_INIT_SCORE) / SCORE_STEP;
+                    if (won < lo || won > hi || info.win_count != won) {
+                        bad++;
+                    }
+                    reads++;
+                }
+            }));
+        }
+        for (int i = 0; i < 4000; i++) {
+            started++;
+            sw.submit(1, 2);
+            done++;
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        stop = true;
+        for (auto &th: readers) {
+            th.join();
+        }
+    }
+    user_info info;
+    uf.select_by_id(1, info);
+    DBG_LOG("score_race_test reads:%ld bad:%ld final score:%ld expect:%ld", reads.load(), bad.load(),
+            (long) info.score, (long) USER_INIT_SCORE + 4000 * SCORE_STEP);
+    unlink(path);
+    unlink(journal);
+}
+
+//缓存填充和写库并发：缓存失效后重新查询的结果同样不能漏加或者重复加，不会把错误的分数缓存下来
+void cache_race_test() {
+    const char *path = "./cache_race_test.db", *journal = "./cache_race_test.journal";
+    unlink(path);
+    unlink(journal);
+    user_file uf(path);
+    Json::Value a, b;
+    a["username"] = "a";
+    a["password"] = "123";
+    b["username"] = "b";
+    b["password"] = "123";
+    uf.insert(a);
+    uf.insert(b);
+    std::atomic<int> started(0), done(0);
+    std::atomic<bool> stop(false);
+    std::atomic<long> reads(0), bad(0);
+    {
+        score_writer sw(&uf, journal);
+        user_cache uc(&sw);
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 2; i++) {
+            readers.push_back(std::thread([&]() {
+                while (stop == false) {
+                    int lo = done;
+                    user_info info;
+                    //一半的查询先让缓存失效，走数据库并重新放入缓存
+                    if (reads % 2 == 0) {
+                        uc.invalidate(1);
+                    }
+                    uc.select_by_id(1, info);
+                    int hi = started;
+                    int64_t won = (info.score - USER_INIT_SCORE) / SCORE_STEP;
+                    if (won < lo || won > hi || info.win_count != won) {
+                        bad++;
+                    }
+                    reads++;
+                }
+            }));
+        }
+        for (int i = 0; i < 4000; i++) {
+            started++;
+            uc.record_result(1, 2);
+            done++;
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+        stop = true;
+        for (auto &th: readers) {
+            th.join();
+        }
+        user_info info;
+        uc.select_by_id(1, info);
+        DBG_LOG("cache_race_test reads:%ld bad:%ld cached score:%ld expect:%ld", reads.load(), bad.load(),
+                (long) info.score, (long) USER_INIT_SCORE + 4000 * SCORE_STEP);
+    }
+    unlink(path);
+    unlink(journal);
+}
+
+//日志压缩：对局持续提交时队列一直不空，日志大小仍有上限；重启时只保留没有落库的结果，丢弃写了一半的记录
+void score_journal_test() {
+    const char *path = "./score_journal_test.db", *journal = "./score_journal_test.journal";
+    unlink(path);
+    unlink(journal);
+    user_file uf(path);
+    Json::Value a, b;
+    a["username"] = "a";
+    a["password"] = "123";
+    b["username"] = "b";
+    b["password"] = "123";
+    uf.insert(a);
+    uf.insert(b);
+    struct stat st;
+    off_t max_size = 0;
+    {
+        score_writer sw(&uf, journal);
+        for (int i = 0; i < 100000; i++) {
+            sw.submit(1, 2);
+            if (i % 1000 == 0 && stat(journal, &st) == 0) {
+                max_size = std::max(max_size, st.st_size);
+            }
+        }
+    }
+    DBG_LOG("journal max size:%ld limit:%d written:%ld", (long) max_size, SCORE_JOURNAL_COMPACT, 100000L * (long) sizeof(score_record));
+    //一条已经落库的结果、两条没有落库的结果和一条写了一半的记录
+    uint64_t seq;
+    uf.get_score_seq(seq);
+    score_record recs[3] = {{seq, 2, 1}, {seq + 1, 2, 1}, {seq + 2, 2, 1}};
+    int fd = open(journal, O_WRONLY | O_TRUNC);
+    if (fd < 0 || write(fd, recs, sizeof(recs)) != sizeof(recs) || write(fd, recs, 5) != 5) {
+        ERR_LOG("write journal failed");
+    }
+    close(fd);
+    user_info before;
+    uf.select_by_id(2, before);
+    {
+        score_writer sw(&uf, journal);
+        stat(journal, &st);
+        user_info info;
+        sw.select_by_id(2, info);
+        DBG_LOG("replay journal size:%ld expect:%ld score:%ld expect:%ld", (long) st.st_size, 2L * (long) sizeof(score_record),
+                (long) info.score, (long) before.score + 2 * SCORE_STEP);
+    }
+    unlink(path);
+    unlink(journal);
+}
+
 //测试添加和删除
 void online_test() {
     online_manager om;
@@ -135,10 +404,158 @@ void online_test() {
 void room_test() {
     user_table user(HOST, USER, PASS, DBNAME, PORT);
     online_manager om;
-    room_manager rm(&user, &om);
+    websocketpp::lib::asio::io_service io;
+    score_writer sw(&user);
+    user_cache uc(&sw);
+    room_manager rm(&uc, &om, &io);
     room_ptr rp = rm.create_room(10, 20);
 
-    matcher mc(&rm, &user, &om);
+    matcher mc(&rm, &uc, &om);
+}
+
+//分差窗口：1000和1040立即匹配，1200要等1900的窗口放宽到700，即(700-50)/50=13秒后
+void match_test() {
+    match_engine engine;
+    match_pair pair;
+    engine.push({1, 1000, 0});
+    engine.push({2, 1900, 0});
+    engine.push({3, 1040, 0});
+    engine.push({4, 1200, 0});
+    engine.remove(4);
+    if (engine.pop_pair(0, pair)) {
+        DBG_LOG("pair %lu-%lu expect 1-3", (unsigned long) pair.a.uid, (unsigned long) pair.b.uid);
+    }
+    engine.push({4, 1200, 0});
+    int64_t ready = 0;
+    engine.next_ready(ready);
+    bool early = engine.pop_pair(ready - 1, pair);
+    bool late = engine.pop_pair(ready, pair);
+    DBG_LOG("ready:%ld expect 13000, early:%d late:%d expect 0 1", (long) ready, early, late);
+}
+
+//随机局面下，位运算检测器(标量/SSE2/AVX2/批量)与逐格计数的five()结果必须一致
+void five_test() {
+    std::mt19937 rng(2023);
+    const int count = 100000;
+    std::vector<five_lines> lines(count);
+    std::vector<uint8_t> expect(count), result(count);
+    int mismatch = 0;
+    for (int i = 0; i < count; i++) {
+        bitboard board;
+        int stones = rng() % 200;
+        for (int s = 0; s < stones; s++) {
+            int r = rng() % BOARD_ROW, c = rng() % BOARD_COL;
+            if (board.get(r, c) == 0) {
+                board.put(r, c, rng() % 2 ? CHESS_WHITE : CHESS_BLACK);
+            }
+        }
+        int row = rng() % BOARD_ROW, col = rng() % BOARD_COL;
+        int color = board.get(row, col);
+        if (color == 0) {
+            color = rng() % 2 ? CHESS_WHITE : CHESS_BLACK;
+            board.put(row, col, color);
+        }
+        expect[i] = board.five(row, col, 0, 1, color) || board.five(row, col, 1, 0, color) ||
+                    board.five(row, col, -1, 1, color) || board.five(row, col, -1, -1, color);
+        board.pack_lines(row, col, color, lines[i]);
+        if (board.check_five(row, col, color) != (bool) expect[i]) {
+            mismatch++;
+        }
+    }
+    five_detector::five_isa isas[] = {five_detector::FIVE_SCALAR, five_detector::FIVE_SSE2, five_detector::FIVE_AVX2};
+    for (five_detector::five_isa isa: isas) {
+        if (isa > five_detector::best_isa()) {
+            continue;
+        }
+        five_detector::check_batch(lines.data(), count, result.data(), isa);
+        for (int i = 0; i < count; i++) {
+            if (five_detector::check(lines[i], isa) != (bool) expect[i] || result[i] != expect[i]) {
+                mismatch++;
+            }
+        }
+        DBG_LOG("five_test %s done", five_detector::isa_name(isa));
+    }
+    if (mismatch != 0) {
+        ERR_LOG("five_test mismatch:%d", mismatch);
+    } else {
+        DBG_LOG("five_test ok");
+    }
+}
+
+//房间压力测试：io_service运行在多个线程上，几千个房间同时下棋，最后检查每个房间的棋盘
+//每个房间按(row + 2*col) % 4 < 2的规则落子，任何方向都不会出现五子连珠，对局不会中途结束
+void room_stress_test() {
+    const int room_num = 2000;
+    const int thread_num = 8;
+    user_table user(HOST, USER, PASS, DBNAME, PORT);
+    online_manager om;
+    websocketpp::lib::asio::io_service io;
+    std::unique_ptr<websocketpp::lib::asio::io_service::work> work(new websocketpp::lib::asio::io_service::work(io));
+    score_writer sw(&user);
+    user_cache uc(&sw);
+    room_manager rm(&uc, &om, &io);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < thread_num; i++) {
+        workers.emplace_back([&io]() { io.run(); });
+    }
+
+    server_t::connection_ptr conn;
+    std::vector<room_ptr> rooms;
+    for (int i = 0; i < room_num; i++) {
+        uint64_t white = 2 * i + 1, black = 2 * i + 2;
+        om.enter_game_hall(white, conn);
+        om.enter_game_hall(black, conn);
+        om.enter_game_room(white, conn);
+        om.enter_game_room(black, conn);
+        rooms.push_back(rm.create_room(white, black));
+    }
+
+    //多个客户端线程以不同顺序交错地向所有房间投递落子请求
+    std::vector<std::thread> clients;
+    for (int t = 0; t < thread_num; t++) {
+        clients.emplace_back([&rooms, t, thread_num]() {
+            for (int cell = t; cell < BOARD_ROW * BOARD_COL; cell += thread_num) {
+                int row = cell / BOARD_COL, col = cell % BOARD_COL;
+                bool white = (row + 2 * col) % 4 < 2;
+                for (auto &rp: rooms) {
+                    Json::Value req;
+                    req["optype"] = "put_chess";
+                    req["room_id"] = (Json::UInt64) rp->get_room_id();
+                    req["uid"] = (Json::UInt64)(white ? rp->get_white_id() : rp->get_black_id());
+                    req["row"] = row;
+                    req["col"] = col;
+                    rp->post_request(req);
+                }
+            }
+        });
+    }
+    for (auto &th: clients) {
+        th.join();
+    }
+    work.reset();
+    for (auto &th: workers) {
+        th.join();
+    }
+
+    int bad_room = 0;
+    for (auto &rp: rooms) {
+        const bitboard &board = rp->get_board();
+        for (int row = 0; row < BOARD_ROW; row++) {
+            for (int col = 0; col < BOARD_COL; col++) {
+                int expect = (row + 2 * col) % 4 < 2 ? CHESS_WHITE : CHESS_BLACK;
+                if (board.get(row, col) != expect || rp->get_status() != GAME_START) {
+                    bad_room++;
+                    row = BOARD_ROW;
+                    break;
+                }
+            }
+        }
+    }
+    if (bad_room != 0) {
+        ERR_LOG("room_stress_test: %d rooms inconsistent", bad_room);
+    } else {
+        DBG_LOG("room_stress_test ok: %d rooms", room_num);
+    }
 }
 
 void server_test1() {
@@ -146,7 +563,17 @@ void server_test1() {
     _server.start(8085);
 }
 
-int main() {
-    server_test1();
+//单机部署：用户存在嵌入式的用户文件中，不需要MySQL
+void server_test2() {
+    server _server(std::unique_ptr<user_store>(new user_file(USER_FILE)));
+    _server.start(8085);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "file") {
+        server_test2();
+    } else {
+        server_test1();
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,678 @@
+//端到端压测客户端，用法: ./loadgen [key=value...]
+//模拟clients个玩家，每个玩家：注册 -> 登录 -> 进入大厅 -> 匹配 -> 进入房间 -> 下一局棋(其间聊天) -> 回到大厅，共games局
+//    ./loadgen server=1 clients=200 games=3     在本机fork一个服务器再压测，用户存在本机MySQL中
+//    ./loadgen server=1 store=file               同上，用户存在嵌入式的用户文件中，不需要MySQL
+//    ./loadgen host=10.0.0.2 port=8085 pid=1234  压测已经运行的服务器，给出pid(同一台机器)时统计服务器的CPU时间
+//报告连接速率、匹配速率、落子往返时间的p50/p99/p999和服务器CPU占用
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "proto.hpp"
+#include "server.hpp"
+#include "user_file.hpp"
+#include "util.hpp"
+#include <arpa/inet.h>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include <websocketpp/client.hpp>
+#include <websocketpp/config/asio_no_tls_client.hpp>
+
+typedef websocketpp::client<websocketpp::config::asio_client> client_t;
+
+#define LOADGEN_PASSWORD "loadgen"
+#define LOADGEN_RETRY_MS 10     //大厅连接被拒绝(上一个房间连接还没有在服务器上关闭)时，隔这么久重连
+#define LOADGEN_WAIT_SERVER 200 //fork的服务器最多等这么多次，每次50毫秒
+
+struct loadgen_config {
+    std::string host;
+    uint16_t port;
+    int clients;       //玩家数，两两匹配
+    int games;         //每个玩家下几局
+    int moves;         //每局的落子数，下完后白方离开房间，黑方因对方掉线获胜
+    int chat_every;    //每隔几手棋聊天一次，0表示不聊天
+    bool binary;       //房间和大厅消息使用二进制子协议
+    int threads;       //客户端事件循环的线程数
+    int http_threads;  //并发执行注册、登录的线程数
+    int timeout;       //最长运行的秒数
+    int pid;           //服务器进程号，用于统计CPU时间
+    bool server;       //在本机fork一个服务器
+    size_t server_threads;
+    int64_t match_tick;  //fork的服务器的匹配周期(毫秒)，0表示按事件匹配
+    size_t match_batch;  //fork的服务器每个匹配周期最多匹配的对数
+    std::string store;                             //fork的服务器的用户存储：mysql或者file
+    std::string user_file;                         //store=file时的数据文件
+    std::string db_host, db_user, db_pass, db_name;
+    std::string prefix;//用户名前缀，默认带上时间，重复运行不会撞名
+
+    loadgen_config()
+        : host("127.0.0.1"), port(8085), clients(100), games(1), moves(60), chat_every(10), binary(false),
+          threads(1), http_threads(16), timeout(600), pid(0), server(false), server_threads(0),
+          match_tick(MATCH_TICK_MS), match_batch(MATCH_BATCH_MAX),
+          store("mysql"), user_file("./loadgen_users.db"),
+          db_host("127.0.0.1"), db_user("taeyeon"), db_pass("2002Phw@"), db_name("gobang"),
+          prefix("lg" + std::to_string(time(nullptr)) + "_") {}
+
+    bool parse(int argc, char *argv[]) {
+        for (int i = 0; i < argc; i++) {
+            const char *eq = strchr(argv[i], '=');
+            if (eq == nullptr) {
+                return false;
+            }
+            std::string key(argv[i], eq - argv[i]), value(eq + 1);
+            if (key == "host") host = value;
+            else if (key == "port") port = (uint16_t) atoi(value.c_str());
+            else if (key == "clients") clients = atoi(value.c_str());
+            else if (key == "games") games = atoi(value.c_str());
+            else if (key == "moves") moves = atoi(value.c_str());
+            else if (key == "chat") chat_every = atoi(value.c_str());
+            else if (key == "proto") binary = value == "bin";
+            else if (key == "threads") threads = atoi(value.c_str());
+            else if (key == "http_threads") http_threads = atoi(value.c_str());
+            else if (key == "timeout") timeout = atoi(value.c_str());
+            else if (key == "pid") pid = atoi(value.c_str());
+            else if (key == "server") server = value == "1";
+            else if (key == "server_threads") server_threads = (size_t) atoi(value.c_str());
+            else if (key == "match_tick") match_tick = atoi(value.c_str());
+            else if (key == "match_batch") match_batch = (size_t) atoi(value.c_str());
+            else if (key == "store") store = value;
+            else if (key == "user_file") user_file = value;
+            else if (key == "db_host") db_host = value;
+            else if (key == "db_user") db_user = value;
+            else if (key == "db_pass") db_pass = value;
+            else if (key == "db_name") db_name = value;
+            else if (key == "prefix") prefix = value;
+            else return false;
+        }
+        //两两匹配，玩家数必须是偶数；落子顺序来自不会形成五子的填充图案，最多下满棋盘
+        return clients > 0 && clients % 2 == 0 && games > 0 && moves > 0 && moves <= BOARD_ROW * BOARD_COL &&
+               threads > 0 && http_threads > 0 && timeout > 0 && match_tick >= 0 && (store == "mysql" || store == "file");
+    }
+};
+
+//一条服务器消息，JSON和二进制协议都解析成这个结构
+struct loadgen_event {
+    std::string optype;
+    bool result;
+    uint64_t uid;
+    uint64_t room_id;
+    uint64_t white_id;
+    uint64_t winner;
+
+    loadgen_event() : result(false), uid(0), room_id(0), white_id(0), winner(0) {}
+};
+
+struct loadgen_player {
+    std::mutex mutex;//同一个玩家的大厅和房间连接可能在不同的事件循环线程上回调
+    int index;
+    std::string name;
+    std::string cookie;
+    uint64_t uid;
+    int games_left;
+    bool waiting;    //第一阶段进入了大厅，等待统一开始匹配
+    bool white;
+    uint64_t room_id;
+    int received;    //本局已经收到的落子广播数，也是下一手的序号
+    int64_t move_ns; //自己最近一手的发送时间
+    int64_t chat_ns; //自己最近一次聊天的发送时间
+    int64_t match_ns;//发送match_start的时间
+    websocketpp::connection_hdl hall;
+    websocketpp::connection_hdl room;
+
+    loadgen_player() : index(0), uid(0), games_left(0), waiting(false), white(false), room_id(0), received(0), move_ns(0), chat_ns(0), match_ns(0) {}
+};
+
+class loadgen_util {
+public:
+    //第k手棋的位置按行优先填充棋盘，颜色按(row + 2 * col) % 4分配，整盘下满也不会出现五子连珠
+    static bool white_move(int k) {
+        int row = k / BOARD_COL, col = k % BOARD_COL;
+        return (row + 2 * col) % 4 < 2;
+    }
+
+    //短连接的HTTP POST，返回状态码，失败返回0；响应中有Set-Cookie时取出cookie
+    static int http_post(const std::string &host, uint16_t port, const std::string &uri, const std::string &body, std::string &cookie) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return 0;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = inet_addr(host.c_str());
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            return 0;
+        }
+        std::string req = "POST " + uri + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n" +
+                          "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        if (send(fd, req.c_str(), req.size(), 0) != (ssize_t) req.size()) {
+            close(fd);
+            return 0;
+        }
+        std::string rsp;
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            rsp.append(buf, n);
+        }
+        close(fd);
+        if (rsp.compare(0, 9, "HTTP/1.1 ") != 0) {
+            return 0;
+        }
+        size_t pos = rsp.find("Set-Cookie: ");
+        if (pos != std::string::npos) {
+            pos += strlen("Set-Cookie: ");
+            cookie = rsp.substr(pos, rsp.find_first_of(";\r", pos) - pos);
+        }
+        return atoi(rsp.c_str() + 9);
+    }
+
+    //进程累计的用户态+内核态CPU时间(秒)，读/proc/<pid>/stat的utime和stime
+    static double cpu_seconds(int pid) {
+        //proc文件的大小是0，不能按文件大小读
+        std::string path = "/proc/" + std::to_string(pid) + "/stat";
+        FILE *fp = pid <= 0 ? nullptr : fopen(path.c_str(), "r");
+        if (fp == nullptr) {
+            return 0;
+        }
+        char buf[1024];
+        size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        buf[n] = '\0';
+        //进程名可能包含空格，从最后一个')'之后开始数字段，utime和stime是第14、15个字段
+        const char *pos = strrchr(buf, ')');
+        if (pos == nullptr) {
+            return 0;
+        }
+        unsigned long utime = 0, stime = 0;
+        if (sscanf(pos + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+            return 0;
+        }
+        return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+    }
+
+    //本机的服务器开始监听后返回true
+    static bool wait_port(uint16_t port) {
+        for (int i = 0; i < LOADGEN_WAIT_SERVER; i++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+            bool ok = connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+            close(fd);
+            if (ok) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return false;
+    }
+
+    //直方图中的纳秒值按微秒打印
+    static void print_latency(const char *name, const metrics_histogram &hist) {
+        metrics_snapshot snap;
+        hist.snapshot(snap);
+        if (snap.count == 0) {
+            printf("%-12s no samples\n", name);
+            return;
+        }
+        printf("%-12s n=%-8lu avg=%-9.1f p50=%-9.1f p99=%-9.1f p999=%-9.1f us\n", name, (unsigned long) snap.count,
+               snap.sum / 1e3 / snap.count, snap.percentile(0.5) / 1e3, snap.percentile(0.99) / 1e3, snap.percentile(0.999) / 1e3);
+    }
+};
+
+class loadgen {
+private:
+    loadgen_config _conf;
+    client_t _client;
+    std::vector<std::unique_ptr<loadgen_player>> _players;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::unordered_map<uint64_t, int> _ready;//房间号 -> 已经收到room_ready的玩家数，两人都就绪后白方下第一手
+    int _hall_ready;                         //第一次进入大厅的玩家数
+    int _finished;                           //下完所有对局或者出错退出的玩家数
+    bool _start;                             //所有玩家进入大厅后开始匹配
+
+    std::atomic<uint64_t> _connects;//完成握手的websocket连接数
+    std::atomic<uint64_t> _matches; //收到match_success的次数，每场匹配两次
+    std::atomic<uint64_t> _games;   //结束的对局，每局两个玩家各算一次
+    std::atomic<uint64_t> _moves;   //自己的落子收到广播的次数
+    std::atomic<uint64_t> _chats;
+    std::atomic<uint64_t> _retries;
+    std::atomic<uint64_t> _errors;
+
+    metrics_histogram _reg_rtt;
+    metrics_histogram _login_rtt;
+    metrics_histogram _match_wait;
+    metrics_histogram _move_rtt;
+    metrics_histogram _chat_rtt;
+
+private:
+    void send(websocketpp::connection_hdl hdl, const std::string &body, websocketpp::frame::opcode::value op) {
+        websocketpp::lib::error_code ec;
+        _client.send(hdl, body, op, ec);
+        if (ec) {
+            _errors++;
+        }
+    }
+
+    //二进制协议中有对应格式的消息按二进制发送，其他仍然是JSON
+    void send_request(websocketpp::connection_hdl hdl, const Json::Value &req) {
+        std::string body;
+        if (_conf.binary) {
+            proto_msg msg;
+            if (proto_util::from_json(req, msg) && proto_util::encode(msg, body)) {
+                return send(hdl, body, websocketpp::frame::opcode::binary);
+            }
+        }
+        json_util::serialize(req, body);
+        send(hdl, body, websocketpp::frame::opcode::text);
+    }
+
+    bool parse(client_t::message_ptr msg, loadgen_event &ev) {
+        const std::string &payload = msg->get_payload();
+        if (msg->get_opcode() == websocketpp::frame::opcode::binary) {
+            proto_msg pm;
+            if (proto_util::decode(payload.data(), payload.size(), pm) == false) {
+                return false;
+            }
+            static const char *names[] = {"", "put_chess", "chat", "match_start", "match_stop", "match_success", "spectate_snapshot"};
+            ev.optype = pm.type < sizeof(names) / sizeof(names[0]) ? names[pm.type] : "";
+            ev.result = pm.result;
+            ev.uid = pm.uid;
+            ev.room_id = pm.room_id;
+            ev.winner = pm.winner;
+            return true;
+        }
+        Json::Value rsp;
+        if (json_util::unserialize(payload, rsp) == false) {
+            return false;
+        }
+        //result有布尔值和字符串"true"两种写法
+        const Json::Value &result = rsp["result"];
+        ev.optype = rsp["optype"].asString();
+        ev.result = result.isBool() ? result.asBool() : (result.isString() && result.asString() == "true");
+        ev.uid = rsp["uid"].asUInt64();
+        ev.room_id = rsp["room_id"].asUInt64();
+        ev.white_id = rsp["white_id"].asUInt64();
+        ev.winner = rsp["winner"].asUInt64();
+        return true;
+    }
+
+    client_t::connection_ptr open(loadgen_player *p, const char *path) {
+        websocketpp::lib::error_code ec;
+        std::string uri = "ws://" + _conf.host + ":" + std::to_string(_conf.port) + path;
+        client_t::connection_ptr conn = _client.get_connection(uri, ec);
+        if (ec) {
+            ERR_LOG("loadgen connect %s failed: %s", uri.c_str(), ec.message().c_str());
+            return client_t::connection_ptr();
+        }
+        conn->append_header("Cookie", p->cookie);
+        if (_conf.binary) {
+            conn->add_subprotocol(PROTO_SUBPROTOCOL, ec);
+        }
+        conn->set_open_handler([this](websocketpp::connection_hdl) { _connects++; });
+        conn->set_fail_handler([this](websocketpp::connection_hdl) {
+            _errors++;
+            finish();
+        });
+        return conn;
+    }
+
+    void open_hall(loadgen_player *p) {
+        client_t::connection_ptr conn = open(p, "/hall");
+        if (!conn) {
+            return finish();
+        }
+        conn->set_message_handler(std::bind(&loadgen::on_hall, this, p, std::placeholders::_1, std::placeholders::_2));
+        p->hall = conn->get_handle();
+        _client.connect(conn);
+    }
+
+    void open_room(loadgen_player *p) {
+        client_t::connection_ptr conn = open(p, "/room");
+        if (!conn) {
+            return finish();
+        }
+        conn->set_message_handler(std::bind(&loadgen::on_room, this, p, std::placeholders::_1, std::placeholders::_2));
+        conn->set_close_handler(std::bind(&loadgen::on_room_close, this, p, std::placeholders::_1));
+        p->room = conn->get_handle();
+        _client.connect(conn);
+    }
+
+    void close(websocketpp::connection_hdl hdl) {
+        websocketpp::lib::error_code ec;
+        _client.close(hdl, websocketpp::close::status::normal, "", ec);
+    }
+
+    void match(loadgen_player *p) {
+        Json::Value req;
+        req["optype"] = "match_start";
+        p->match_ns = metrics_util::now_ns();
+        send_request(p->hall, req);
+    }
+
+    //发送本局的第k手棋，需要时先发一条聊天，调用者持有p的锁
+    void move(loadgen_player *p, int k) {
+        if (_conf.chat_every > 0 && k % _conf.chat_every == 0) {
+            Json::Value chat;
+            chat["optype"] = "chat";
+            chat["room_id"] = (Json::UInt64) p->room_id;
+            chat["message"] = "move " + std::to_string(k);
+            p->chat_ns = metrics_util::now_ns();
+            send_request(p->room, chat);
+        }
+        Json::Value req;
+        req["optype"] = "put_chess";
+        req["room_id"] = (Json::UInt64) p->room_id;
+        req["row"] = k / BOARD_COL;
+        req["col"] = k % BOARD_COL;
+        p->move_ns = metrics_util::now_ns();
+        send_request(p->room, req);
+    }
+
+    void finish() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _finished++;
+        _cond.notify_all();
+    }
+
+    void on_hall(loadgen_player *p, websocketpp::connection_hdl hdl, client_t::message_ptr msg) {
+        std::unique_lock<std::mutex> lock(p->mutex);
+        loadgen_event ev;
+        if (parse(msg, ev) == false) {
+            _errors++;
+            return;
+        }
+        if (ev.optype == "hall_ready") {
+            if (ev.result == false) {
+                //上一局的房间连接在服务器上还没有关闭，稍后重连
+                _retries++;
+                close(hdl);
+                _client.set_timer(LOADGEN_RETRY_MS, [this, p](const websocketpp::lib::error_code &) {
+                    std::unique_lock<std::mutex> lock(p->mutex);
+                    open_hall(p);
+                });
+                return;
+            }
+            p->uid = ev.uid;
+            std::unique_lock<std::mutex> glock(_mutex);
+            if (_start) {
+                glock.unlock();
+                return match(p);
+            }
+            p->waiting = true;
+            _hall_ready++;
+            _cond.notify_all();
+        } else if (ev.optype == "match_success") {
+            _matches++;
+            _match_wait.record(metrics_util::now_ns() - p->match_ns);
+            //和网页一样先连接房间再离开大厅，服务器只检查玩家是否已经在房间中
+            open_room(p);
+            close(hdl);
+        } else if (ev.optype == "match_start" && ev.result == false) {
+            _errors++;
+        }
+    }
+
+    void on_room(loadgen_player *p, websocketpp::connection_hdl hdl, client_t::message_ptr msg) {
+        loadgen_event ev;
+        if (parse(msg, ev) == false) {
+            _errors++;
+            return;
+        }
+        std::unique_lock<std::mutex> lock(p->mutex);
+        if (ev.optype == "room_ready") {
+            if (ev.result == false) {
+                _errors++;
+                return close(hdl);
+            }
+            p->room_id = ev.room_id;
+            p->white = ev.white_id == p->uid;
+            p->received = 0;
+            //协议中没有对手进入房间的通知，两个玩家都在同一个进程里，在这里等双方都就绪，否则先落子会判对方掉线
+            std::unique_lock<std::mutex> glock(_mutex);
+            if (++_ready[p->room_id] < 2) {
+                return;
+            }
+            _ready.erase(p->room_id);
+            glock.unlock();
+            //后就绪的一方负责让白方下第一手；只会持有黑方的锁去拿白方的锁，不会反过来
+            if (p->white) {
+                return move(p, 0);
+            }
+            loadgen_player *white = nullptr;
+            for (auto &other: _players) {
+                if (other->uid == ev.white_id) {
+                    white = other.get();
+                    break;
+                }
+            }
+            if (white != nullptr) {
+                std::unique_lock<std::mutex> wlock(white->mutex);
+                move(white, 0);
+            }
+        } else if (ev.optype == "chat") {
+            if (ev.uid == p->uid) {
+                _chats++;
+                _chat_rtt.record(metrics_util::now_ns() - p->chat_ns);
+            }
+        } else if (ev.optype == "put_chess") {
+            if (ev.result == false) {
+                _errors++;
+                return close(hdl);
+            }
+            if (ev.winner != 0) {
+                //对方离开房间，自己获胜
+                return close(hdl);
+            }
+            if (ev.uid == p->uid) {
+                _moves++;
+                _move_rtt.record(metrics_util::now_ns() - p->move_ns);
+            }
+            int k = ++p->received;
+            if (k == _conf.moves) {
+                //下完了，白方离开房间，服务器判黑方获胜并记录对局结果
+                if (p->white) {
+                    close(hdl);
+                }
+            } else if (loadgen_util::white_move(k) == p->white) {
+                move(p, k);
+            }
+        }
+    }
+
+    void on_room_close(loadgen_player *p, websocketpp::connection_hdl) {
+        std::unique_lock<std::mutex> lock(p->mutex);
+        _games++;
+        if (--p->games_left > 0) {
+            return open_hall(p);
+        }
+        lock.unlock();
+        finish();
+    }
+
+    //注册、登录并进入大厅，由http_threads个线程分担
+    void login(loadgen_player *p) {
+        Json::Value user;
+        user["username"] = p->name;
+        user["password"] = LOADGEN_PASSWORD;
+        std::string body, cookie;
+        json_util::serialize(user, body);
+        int64_t start = metrics_util::now_ns();
+        //用户可能已经存在(指定了prefix重复运行)，注册失败时仍然尝试登录
+        loadgen_util::http_post(_conf.host, _conf.port, "/reg", body, cookie);
+        _reg_rtt.record(metrics_util::now_ns() - start);
+        start = metrics_util::now_ns();
+        int status = loadgen_util::http_post(_conf.host, _conf.port, "/login", body, cookie);
+        _login_rtt.record(metrics_util::now_ns() - start);
+        if (status != 200 || cookie.empty()) {
+            ERR_LOG("loadgen login %s failed: %d", p->name.c_str(), status);
+            _errors++;
+            return finish();
+        }
+        std::unique_lock<std::mutex> lock(p->mutex);
+        p->cookie = cookie;
+        open_hall(p);
+    }
+
+public:
+    loadgen(const loadgen_config &conf)
+        : _conf(conf), _hall_ready(0), _finished(0), _start(false),
+          _connects(0), _matches(0), _games(0), _moves(0), _chats(0), _retries(0), _errors(0) {
+        _client.set_access_channels(websocketpp::log::alevel::none);
+        _client.set_error_channels(websocketpp::log::elevel::none);
+        _client.init_asio();
+        _client.start_perpetual();
+        for (int i = 0; i < _conf.clients; i++) {
+            _players.emplace_back(new loadgen_player());
+            loadgen_player *p = _players.back().get();
+            p->index = i;
+            p->name = _conf.prefix + std::to_string(i);
+            p->games_left = _conf.games;
+        }
+    }
+
+    void run() {
+        std::vector<std::thread> io;
+        for (int i = 0; i < _conf.threads; i++) {
+            io.emplace_back([this]() { _client.run(); });
+        }
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(_conf.timeout);
+
+        //第一阶段：所有玩家注册、登录、进入大厅
+        double cpu0 = loadgen_util::cpu_seconds(_conf.pid);
+        int64_t t0 = metrics_util::now_ns();
+        std::vector<std::thread> http;
+        for (int t = 0; t < _conf.http_threads; t++) {
+            http.emplace_back([this, t]() {
+                for (int i = t; i < _conf.clients; i += _conf.http_threads) {
+                    login(_players[i].get());
+                }
+            });
+        }
+        for (auto &th: http) {
+            th.join();
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait_until(lock, deadline, [this]() { return _hall_ready + _finished >= _conf.clients; });
+        int ready = _hall_ready;
+        _start = true;
+        lock.unlock();
+        double cpu1 = loadgen_util::cpu_seconds(_conf.pid);
+        int64_t t1 = metrics_util::now_ns();
+        uint64_t connects = _connects;
+
+        //第二阶段：同时开始匹配，每个玩家下完games局
+        for (auto &p: _players) {
+            std::unique_lock<std::mutex> plock(p->mutex);
+            if (p->waiting) {
+                p->waiting = false;
+                match(p.get());
+            }
+        }
+        lock.lock();
+        bool done = _cond.wait_until(lock, deadline, [this]() { return _finished >= _conf.clients; });
+        lock.unlock();
+        double cpu2 = loadgen_util::cpu_seconds(_conf.pid);
+        int64_t t2 = metrics_util::now_ns();
+
+        _client.stop_perpetual();
+        _client.stop();
+        for (auto &th: io) {
+            th.join();
+        }
+
+        double connect_sec = (t1 - t0) / 1e9, play_sec = (t2 - t1) / 1e9;
+        printf("loadgen: clients=%d games=%d moves=%d chat=%d proto=%s threads=%d\n", _conf.clients, _conf.games,
+               _conf.moves, _conf.chat_every, _conf.binary ? "bin" : "json", _conf.threads);
+        printf("connect: %d/%d players in hall in %.2f s, %.1f players/s (register+login+hall websocket)\n",
+               ready, _conf.clients, connect_sec, ready / connect_sec);
+        printf("play:    %.2f s%s, %.1f matches/s, %.1f games/s, %.0f moves/s, %.1f ws connects/s\n", play_sec,
+               done ? "" : " (timeout)", _matches / 2 / play_sec, _games / 2 / play_sec, _moves / play_sec,
+               (_connects - connects) / play_sec);
+        printf("counts:  matches=%lu games=%lu moves=%lu chats=%lu hall_retries=%lu errors=%lu\n",
+               (unsigned long) _matches / 2, (unsigned long) _games / 2, (unsigned long) _moves.load(),
+               (unsigned long) _chats.load(), (unsigned long) _retries.load(), (unsigned long) _errors.load());
+        loadgen_util::print_latency("register", _reg_rtt);
+        loadgen_util::print_latency("login", _login_rtt);
+        loadgen_util::print_latency("match wait", _match_wait);
+        loadgen_util::print_latency("move rtt", _move_rtt);
+        loadgen_util::print_latency("chat rtt", _chat_rtt);
+        if (_conf.pid > 0) {
+            printf("server cpu: connect %.1f%%, play %.1f%% of one core, %.1f us cpu per move\n",
+                   (cpu1 - cpu0) * 100 / connect_sec, (cpu2 - cpu1) * 100 / play_sec,
+                   _moves == 0 ? 0.0 : (cpu2 - cpu1) * 1e6 / _moves);
+        } else {
+            printf("server cpu: unknown, pass pid=<server pid> or server=1\n");
+        }
+    }
+};
+
+int main(int argc, char *argv[]) {
+    loadgen_config conf;
+    if (conf.parse(argc - 1, argv + 1) == false) {
+        printf("usage: %s [host=127.0.0.1] [port=8085] [clients=100] [games=1] [moves=60] [chat=10] [proto=json|bin]\n"
+               "          [threads=1] [http_threads=16] [timeout=600] [pid=<server pid>] [prefix=<username prefix>]\n"
+               "          [server=1 [server_threads=0] [match_tick=0] [match_batch=4096] [store=mysql|file] [user_file=./loadgen_users.db]\n"
+               "                    [db_host=] [db_user=] [db_pass=] [db_name=]]\n"
+               "clients must be even, 1 <= moves <= %d\n", argv[0], BOARD_ROW * BOARD_COL);
+        return 1;
+    }
+    //在其他线程启动之前fork，子进程只运行服务器
+    pid_t child = 0;
+    if (conf.server) {
+        child = fork();
+        if (child < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0) {
+            std::unique_ptr<user_store> store;
+            if (conf.store == "file") {
+                store.reset(new user_file(conf.user_file));
+            } else {
+                store.reset(new user_table(conf.db_host, conf.db_user, conf.db_pass, conf.db_name));
+            }
+            server srv(std::move(store), WWWROOT, conf.match_tick, conf.match_batch);
+            srv.start(conf.port, conf.server_threads);
+            _exit(0);
+        }
+        conf.host = "127.0.0.1";
+        conf.pid = child;
+        if (loadgen_util::wait_port(conf.port) == false) {
+            printf("server did not start on port %u\n", conf.port);
+            kill(child, SIGKILL);
+            waitpid(child, nullptr, 0);
+            return 1;
+        }
+    }
+    {
+        loadgen lg(conf);
+        lg.run();
+    }
+    if (child > 0) {
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+    }
+    return 0;
+}
@@ -1,20 +1,502 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <memory>
+#include <mutex>
 #include <pthread.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #define INF 0
 #define DBG 1
 #define ERR 2
-#define LOG_LEVEL DBG
-#define LOG(level, format, ...)                                                                                         \
-    do {                                                                                                                \
-        if (level < LOG_LEVEL) break;                                                                                   \
-        time_t t = time(NULL);                                                                                          \
-        struct tm *ltm = localtime(&t);                                                                                 \
-        char tmp[32] = {0};                                                                                             \
-        strftime(tmp, 31, "%H:%M:%S", ltm);                                                                             \
-        fprintf(stdout, "[%p %s %s:%d] " format "\n", (void *) pthread_self(), tmp, __FILE__, __LINE__, ##__VA_ARGS__); \
+#define LOG_LEVEL DBG               //启动时的日志等级，运行中可以用logger::set_level修改
+//编译期日志等级：低于它的日志连同参数求值一起从程序中删除，运行时没有任何开销
+//release构建(-DNDEBUG)默认只保留ERR，也可以用-DLOG_COMPILE_LEVEL=...指定
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL ERR
+#else
+#define LOG_COMPILE_LEVEL INF
+#endif
+#endif
+#define LOG_RING_SIZE (64 * 1024)   //每个线程的环形缓冲区大小，必须是2的幂
+#define LOG_LINE_MAX 1024           //单条日志参数编码后的最大长度，字符串参数超过的截断
+#define LOG_FLUSH_MS 10             //后台线程写出日志的间隔
+
+//异步日志：调用线程不做格式化，只把格式串指针和参数的二进制值写进自己的环形缓冲区(单生产者单消费者，无锁)，
+//后台线程定期取出，按格式串格式化后写到stdout；时间戳、线程和文件位置放在记录头里，同一秒内的时间只格式化一次
+//格式串必须是字符串常量(宏保证了这一点)，字符串参数按值复制；缓冲区满时丢弃新日志并计数，不会阻塞调用线程
+//ERR日志在调用线程上同步写出：错误之后常常紧跟着abort()，atexit不会执行，只放进缓冲区的日志会丢失
+class logger {
+private:
+    //记录头，后面跟着len字节的参数，每个参数是一个类型字节加上值
+    struct record {
+        int64_t ns;        //CLOCK_REALTIME纳秒
+        const char *file;  //__FILE__和格式串都是字符串常量，只保存指针
+        const char *format;
+        uint32_t line;
+        uint16_t len;
+        uint16_t level;
+    };
+
+    //参数编码：i有符号整数、u无符号整数、f浮点数、p指针，都是8字节；s是2字节长度加上带'\0'的字符串
+    struct arg_writer {
+        char *pos;
+        char *end;
+
+        void put(char type, const void *val, size_t len) {
+            if ((size_t) (end - pos) < len + 1) {
+                return;
+            }
+            *pos++ = type;
+            memcpy(pos, val, len);
+            pos += len;
+        }
+
+        void put_str(const char *str) {
+            if (str == nullptr) {
+                str = "(null)";
+            }
+            size_t room = (size_t) (end - pos);
+            if (room < 4) {
+                return;
+            }
+            size_t len = strlen(str);
+            uint16_t n = (uint16_t) (len < room - 4 ? len : room - 4);
+            *pos++ = 's';
+            memcpy(pos, &n, sizeof(n));
+            memcpy(pos + sizeof(n), str, n);
+            pos[sizeof(n) + n] = 0;
+            pos += sizeof(n) + n + 1;
+        }
+    };
+
+    struct ring {
+        char data[LOG_RING_SIZE];
+        std::atomic<uint64_t> head;   //消费者读到的位置
+        std::atomic<uint64_t> tail;   //生产者写到的位置
+        std::atomic<uint64_t> dropped;//缓冲区满丢弃的条数
+        std::atomic<bool> retired;    //线程已经退出，取空后回收
+        void *tid;
+
+        ring() : head(0), tail(0), dropped(0), retired(false), tid((void *) pthread_self()) {}
+
+        void copy_in(uint64_t pos, const void *src, size_t len) {
+            size_t off = pos & (LOG_RING_SIZE - 1);
+            size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+            memcpy(data + off, src, first);
+            memcpy(data, (const char *) src + first, len - first);
+        }
+
+        void copy_out(uint64_t pos, void *dst, size_t len) const {
+            size_t off = pos & (LOG_RING_SIZE - 1);
+            size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+            memcpy(dst, data + off, first);
+            memcpy((char *) dst + first, data, len - first);
+        }
+    };
+    typedef std::shared_ptr<ring> ring_ptr;
+
+    //线程退出时把自己的缓冲区标记为可回收
+    struct ring_holder {
+        ring_ptr rp;
+
+        ~ring_holder() {
+            if (rp) {
+                rp->retired = true;
+            }
+        }
+    };
+
+    std::atomic<int> _level;
+    std::mutex _mutex;           //保护_rings和_running
+    std::mutex _drain_mutex;     //同一时间只有一个线程取日志
+    std::condition_variable _cond;
+    std::vector<ring_ptr> _rings;
+    bool _running;
+    std::thread _writer;
+    FILE *_out;
+    time_t _cached_sec;          //上一次格式化的秒
+    char _cached_time[16];       //_cached_sec对应的HH:MM:SS
+
+    logger() : _level(LOG_LEVEL), _running(true), _out(stdout), _cached_sec(-1) {
+        _cached_time[0] = 0;
+        _writer = std::thread(&logger::writer_entry, this);
+        std::atexit(&logger::flush);
+    }
+
+    ring *local_ring() {
+        static thread_local ring_holder holder;
+        if (!holder.rp) {
+            holder.rp = std::make_shared<ring>();
+            std::unique_lock<std::mutex> lock(_mutex);
+            _rings.push_back(holder.rp);
+        }
+        return holder.rp.get();
+    }
+
+    const char *format_time(time_t sec) {
+        if (sec != _cached_sec) {
+            struct tm ltm;
+            localtime_r(&sec, &ltm);
+            strftime(_cached_time, sizeof(_cached_time), "%H:%M:%S", &ltm);
+            _cached_sec = sec;
+        }
+        return _cached_time;
+    }
+
+    //按printf格式串格式化编码好的参数，每个转换说明单独交给snprintf，整数一律按long long传入
+    static void format_args(const char *format, const char *args, size_t len, std::string &out) {
+        const char *end = args + len;
+        char spec[32];
+        char buf[LOG_LINE_MAX];
+        const char *p = format;
+        while (*p != 0) {
+            if (*p != '%') {
+                const char *next = strchr(p, '%');
+                size_t n = next == nullptr ? strlen(p) : (size_t) (next - p);
+                out.append(p, n);
+                p += n;
+                continue;
+            }
+            if (p[1] == '%') {
+                out.push_back('%');
+                p += 2;
+                continue;
+            }
+            //复制标志、宽度和精度，去掉长度修饰符
+            const char *start = p++;
+            size_t n = 0;
+            spec[n++] = '%';
+            while (*p != 0 && strchr("-+ #0123456789.", *p) != nullptr && n < sizeof(spec) - 4) {
+                spec[n++] = *p++;
+            }
+            while (*p != 0 && strchr("hlLqjzt", *p) != nullptr) {
+                p++;
+            }
+            char conv = *p;
+            if (conv == 0 || args >= end) {
+                //参数不够，原样输出
+                out.append(start, conv == 0 ? strlen(start) : (size_t) (p + 1 - start));
+                if (conv == 0) {
+                    break;
+                }
+                p++;
+                continue;
+            }
+            p++;
+            char type = *args++;
+            int written = 0;
+            if (type == 's') {
+                uint16_t slen;
+                memcpy(&slen, args, sizeof(slen));
+                const char *str = args + sizeof(slen);
+                args += sizeof(slen) + slen + 1;
+                spec[n++] = 's';
+                spec[n] = 0;
+                written = snprintf(buf, sizeof(buf), spec, str);
+            } else {
+                char val[8];
+                memcpy(val, args, sizeof(val));
+                args += sizeof(val);
+                int64_t i;
+                uint64_t u;
+                double f;
+                memcpy(&i, val, sizeof(i));
+                memcpy(&u, val, sizeof(u));
+                memcpy(&f, val, sizeof(f));
+                if (strchr("feEgGaA", conv) != nullptr) {
+                    spec[n++] = conv;
+                    spec[n] = 0;
+                    written = snprintf(buf, sizeof(buf), spec, type == 'f' ? f : type == 'i' ? (double) i : (double) u);
+                } else if (conv == 'p') {
+                    spec[n++] = 'p';
+                    spec[n] = 0;
+                    written = snprintf(buf, sizeof(buf), spec, (void *) (uintptr_t) u);
+                } else if (conv == 'c') {
+                    spec[n++] = 'c';
+                    spec[n] = 0;
+                    written = snprintf(buf, sizeof(buf), spec, (int) i);
+                } else {
+                    if (type == 'f') {
+                        i = (int64_t) f;
+                        u = (uint64_t) f;
+                    }
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = conv;
+                    spec[n] = 0;
+                    if (conv == 'd' || conv == 'i') {
+                        written = snprintf(buf, sizeof(buf), spec, (long long) i);
+                    } else {
+                        written = snprintf(buf, sizeof(buf), spec, (unsigned long long) u);
+                    }
+                }
+            }
+            if (written > 0) {
+                out.append(buf, written < (int) sizeof(buf) ? written : sizeof(buf) - 1);
+            }
+        }
+    }
+
+    //取出所有缓冲区中的日志，一次写出
+    void drain() {
+        std::unique_lock<std::mutex> drain_lock(_drain_mutex);
+        std::vector<ring_ptr> rings;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            rings = _rings;
+        }
+        std::string out;
+        char args[LOG_LINE_MAX];
+        char prefix[256];
+        for (auto &rp: rings) {
+            //先读retired：之后读到的tail一定包含线程退出前写的所有日志
+            bool retired = rp->retired;
+            uint64_t head = rp->head.load(std::memory_order_relaxed);
+            uint64_t tail = rp->tail.load(std::memory_order_acquire);
+            while (head < tail) {
+                record rec;
+                rp->copy_out(head, &rec, sizeof(rec));
+                rp->copy_out(head + sizeof(rec), args, rec.len);
+                head += sizeof(rec) + rec.len;
+                time_t sec = (time_t) (rec.ns / 1000000000);
+                int n = snprintf(prefix, sizeof(prefix), "[%p %s %s:%u] ", rp->tid, format_time(sec), rec.file, rec.line);
+                out.append(prefix, n < (int) sizeof(prefix) ? n : sizeof(prefix) - 1);
+                format_args(rec.format, args, rec.len, out);
+                out.push_back('\n');
+            }
+            rp->head.store(head, std::memory_order_release);
+            uint64_t dropped = rp->dropped.exchange(0);
+            if (dropped != 0) {
+                int n = snprintf(prefix, sizeof(prefix), "[%p] log buffer full, %lu lines dropped\n", rp->tid, (unsigned long) dropped);
+                out.append(prefix, n);
+            }
+            if (retired && head == rp->tail.load(std::memory_order_acquire)) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (size_t i = 0; i < _rings.size(); i++) {
+                    if (_rings[i] == rp) {
+                        _rings[i] = _rings.back();
+                        _rings.pop_back();
+                        break;
+                    }
+                }
+            }
+        }
+        if (out.empty() == false) {
+            fwrite(out.data(), 1, out.size(), _out);
+            fflush(_out);
+        }
+    }
+
+    void writer_entry() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_running) {
+            _cond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+
+public:
+    //不析构：其他全局对象析构时仍然可以写日志，进程退出时由atexit写出剩余的日志
+    static logger &instance() {
+        static logger *lg = new logger();
+        return *lg;
+    }
+
+    static int level() {
+        return instance()._level.load(std::memory_order_relaxed);
+    }
+
+    static void set_level(int level) {
+        instance()._level = level;
+    }
+
+    //日志的输出位置，默认是stdout
+    static void set_output(FILE *fp) {
+        logger &lg = instance();
+        std::unique_lock<std::mutex> drain_lock(lg._drain_mutex);
+        lg._out = fp;
+    }
+
+    //立即写出所有已经提交的日志
+    static void flush() {
+        instance().drain();
+    }
+
+    static void encode(arg_writer &) {}
+
+    template<class T, class... Args>
+    static void encode(arg_writer &w, const T &val, const Args &...rest) {
+        encode_one(w, val);
+        encode(w, rest...);
+    }
+
+    template<class T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type encode_one(arg_writer &w, T val) {
+        if (std::is_signed<T>::value || std::is_enum<T>::value) {
+            int64_t v = (int64_t) val;
+            w.put('i', &v, sizeof(v));
+        } else {
+            uint64_t v = (uint64_t) val;
+            w.put('u', &v, sizeof(v));
+        }
+    }
+
+    template<class T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type encode_one(arg_writer &w, T val) {
+        double v = (double) val;
+        w.put('f', &v, sizeof(v));
+    }
+
+    template<class T>
+    static void encode_one(arg_writer &w, T *val) {
+        uint64_t v = (uint64_t) (uintptr_t) val;
+        w.put('p', &v, sizeof(v));
+    }
+
+    static void encode_one(arg_writer &w, const char *val) {
+        w.put_str(val);
+    }
+
+    static void encode_one(arg_writer &w, char *val) {
+        w.put_str(val);
+    }
+
+    //调用线程上的全部开销：取时间、编码参数、复制进环形缓冲区；ERR日志还要等到写出
+    template<class... Args>
+    static void write(int level, const char *file, int line, const char *format, const Args &...args) {
+        logger &lg = instance();
+        ring *rp = lg.local_ring();
+        char buf[LOG_LINE_MAX];
+        arg_writer w = {buf, buf + sizeof(buf)};
+        encode(w, args...);
+        record rec;
+        rec.len = (uint16_t) (w.pos - buf);
+        rec.level = (uint16_t) level;
+        rec.file = file;
+        rec.format = format;
+        rec.line = (uint32_t) line;
+        //粗粒度时钟不陷入内核、也不读TSC，精度是一个时钟中断(几毫秒)，对日志足够
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        rec.ns = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        size_t size = sizeof(rec) + rec.len;
+        uint64_t tail = rp->tail.load(std::memory_order_relaxed);
+        if (tail + size - rp->head.load(std::memory_order_acquire) > LOG_RING_SIZE) {
+            //ERR日志不丢弃：先把缓冲区写出腾出空间
+            if (level < ERR) {
+                rp->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            lg.drain();
+        }
+        rp->copy_in(tail, &rec, sizeof(rec));
+        rp->copy_in(tail + sizeof(rec), buf, rec.len);
+        rp->tail.store(tail + size, std::memory_order_release);
+        if (level >= ERR) {
+            lg.drain();
+        }
+    }
+};
+
+//只用于编译期检查格式串和参数是否匹配，从不调用
+__attribute__((format(printf, 1, 2))) inline void log_format_check(const char *, ...) {}
+
+//限流：每个调用点每秒最多输出limit条，超出的条数在下一秒第一条日志后面补一条说明
+class log_limiter {
+private:
+    std::atomic<int64_t> _sec;
+    std::atomic<uint32_t> _count;
+    std::atomic<uint32_t> _suppressed;
+    uint32_t _limit;
+
+public:
+    log_limiter(uint32_t limit) : _sec(0), _count(0), _suppressed(0), _limit(limit) {}
+
+    //返回true表示这一条可以输出，suppressed返回上一个窗口中被丢弃的条数
+    bool allow(uint32_t &suppressed) {
+        int64_t now = (int64_t) time(NULL);
+        int64_t sec = _sec.load(std::memory_order_relaxed);
+        suppressed = 0;
+        if (now != sec && _sec.compare_exchange_strong(sec, now)) {
+            _count = 0;
+            suppressed = _suppressed.exchange(0);
+        }
+        if (_count.fetch_add(1, std::memory_order_relaxed) < _limit) {
+            return true;
+        }
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+};
+
+//这一等级的日志是否会输出；参数之外还要做额外计算才能输出的日志，用它把计算包起来
+//编译期等级是常量，低于它时整个条件在编译期为假，不读运行时等级
+#define LOG_ENABLED(lv) ((lv) >= LOG_COMPILE_LEVEL && (lv) >= logger::level())
+
+//日志宏只在等级满足时才对参数求值
+//""format要求格式串是字符串常量，后台线程格式化时它仍然有效
+#define LOG(lv, format, ...)                                                   \
+    do {                                                                       \
+        if (!LOG_ENABLED(lv)) break;                                           \
+        if (0) log_format_check(format, ##__VA_ARGS__);                        \
+        logger::write(lv, __FILE__, __LINE__, "" format, ##__VA_ARGS__);       \
     } while (0)
+
+//每秒最多输出limit条
+#define LOG_RATE(lv, limit, format, ...)                                                     \
+    do {                                                                                     \
+        if (!LOG_ENABLED(lv)) break;                                                         \
+        if (0) log_format_check(format, ##__VA_ARGS__);                                      \
+        static log_limiter _log_limiter(limit);                                              \
+        uint32_t _log_suppressed;                                                            \
+        if (_log_limiter.allow(_log_suppressed) == false) break;                             \
+        logger::write(lv, __FILE__, __LINE__, "" format, ##__VA_ARGS__);                     \
+        if (_log_suppressed != 0) {                                                          \
+            logger::write(lv, __FILE__, __LINE__, "(上一秒限流丢弃%u条)", _log_suppressed);   \
+        }                                                                                    \
+    } while (0)
+
+//每n次调用输出一次
+#define LOG_SAMPLE(lv, n, format, ...)                                                \
+    do {                                                                              \
+        if (!LOG_ENABLED(lv)) break;                                                  \
+        if (0) log_format_check(format, ##__VA_ARGS__);                               \
+        static std::atomic<uint32_t> _log_calls(0);                                   \
+        if (_log_calls.fetch_add(1, std::memory_order_relaxed) % (n) != 0) break;     \
+        logger::write(lv, __FILE__, __LINE__, "" format, ##__VA_ARGS__);              \
+    } while (0)
+
+//低于编译期等级的日志宏在预处理阶段就展开成空语句，只保留格式检查，不生成任何代码
+#define LOG_DISABLED(format, ...)                           \
+    do {                                                    \
+        if (0) log_format_check(format, ##__VA_ARGS__);     \
+    } while (0)
+
+#if LOG_COMPILE_LEVEL <= INF
 #define INF_LOG(format, ...) LOG(INF, format, ##__VA_ARGS__)
+#else
+#define INF_LOG(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL <= DBG
 #define DBG_LOG(format, ...) LOG(DBG, format, ##__VA_ARGS__)
-#define ERR_LOG(format, ...) LOG(ERR, format, ##__VA_ARGS__)
\ No newline at end of file
+#else
+#define DBG_LOG(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL <= ERR
+#define ERR_LOG(format, ...) LOG(ERR, format, ##__VA_ARGS__)
+#else
+#define ERR_LOG(format, ...) LOG_DISABLED(format, ##__VA_ARGS__)
+#endif
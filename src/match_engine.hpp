@@ -0,0 +1,192 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+
+#define MATCH_WINDOW_BASE 50  //刚开始匹配时接受的天梯分差
+#define MATCH_WINDOW_STEP 50  //每等待1秒，接受的分差增加多少
+#define MATCH_WINDOW_MAX 1000 //分差上限，超过这个分差的两个玩家永远不会匹配
+
+//一个等待匹配的玩家
+struct match_player {
+    uint64_t uid;
+    int64_t score;
+    int64_t enqueue_ms;//开始匹配的时间(毫秒)
+};
+
+//一次匹配的结果，a的天梯分不高于b
+struct match_pair {
+    match_player a;
+    match_player b;
+};
+
+//按天梯分匹配：所有等待的玩家按(分数, 开始匹配时间)排序，只有分数相邻的两个玩家才可能互相匹配
+//每个玩家接受的分差随等待时间线性放宽，一对相邻玩家能够匹配的时间由其中等得更久的一方决定：
+//    ready = min(enqueue) + (分差 - BASE) / STEP
+//相邻对按ready排序放在另一棵树里，入队、取消、取出一对都只需要修改常数个相邻关系，均为O(log n)
+//不是线程安全的，由matcher加锁使用；时间由调用者传入，便于模拟器按模拟时间驱动
+class match_engine {
+private:
+    struct player_less {
+        bool operator()(const match_player &x, const match_player &y) const {
+            if (x.score != y.score) {
+                return x.score < y.score;
+            }
+            if (x.enqueue_ms != y.enqueue_ms) {
+                return x.enqueue_ms < y.enqueue_ms;
+            }
+            return x.uid < y.uid;
+        }
+    };
+    typedef std::set<match_player, player_less> player_set;
+    typedef player_set::iterator player_iter;
+
+    //一对分数相邻的玩家，low在排序中位于high之前
+    struct ready_pair {
+        int64_t ready_ms;
+        int64_t gap;
+        uint64_t low;
+        uint64_t high;
+
+        bool operator<(const ready_pair &o) const {
+            if (ready_ms != o.ready_ms) {
+                return ready_ms < o.ready_ms;
+            }
+            if (gap != o.gap) {
+                return gap < o.gap;
+            }
+            if (low != o.low) {
+                return low < o.low;
+            }
+            return high < o.high;
+        }
+    };
+
+    int64_t _base;
+    int64_t _step;
+    int64_t _max;
+    player_set _players;                              //按天梯分排序的等待玩家
+    std::unordered_map<uint64_t, player_iter> _index;//通过用户ID找到排序树中的位置
+    std::set<ready_pair> _ready;                      //所有可能匹配的相邻对，按能够匹配的时间排序
+
+    //计算相邻两个玩家能够匹配的时间，分差超过上限时返回false
+    bool pair_of(const match_player &low, const match_player &high, ready_pair &rp) {
+        rp.gap = high.score - low.score;
+        if (rp.gap > _max) {
+            return false;
+        }
+        rp.low = low.uid;
+        rp.high = high.uid;
+        rp.ready_ms = std::min(low.enqueue_ms, high.enqueue_ms);
+        if (rp.gap > _base) {
+            rp.ready_ms += ((rp.gap - _base) * 1000 + _step - 1) / _step;
+        }
+        return true;
+    }
+
+    void link(player_iter low, player_iter high) {
+        ready_pair rp;
+        if (pair_of(*low, *high, rp)) {
+            _ready.insert(rp);
+        }
+    }
+
+    void unlink(player_iter low, player_iter high) {
+        ready_pair rp;
+        if (pair_of(*low, *high, rp)) {
+            _ready.erase(rp);
+        }
+    }
+
+    //从排序树中删除一个玩家，原来的两个邻居变为相邻
+    void detach(player_iter it) {
+        bool has_prev = it != _players.begin();
+        player_iter prev = it, next = it;
+        if (has_prev) {
+            --prev;
+            unlink(prev, it);
+        }
+        ++next;
+        bool has_next = next != _players.end();
+        if (has_next) {
+            unlink(it, next);
+        }
+        if (has_prev && has_next) {
+            link(prev, next);
+        }
+        _index.erase(it->uid);
+        _players.erase(it);
+    }
+
+public:
+    match_engine(int64_t base = MATCH_WINDOW_BASE, int64_t step = MATCH_WINDOW_STEP, int64_t max = MATCH_WINDOW_MAX)
+        : _base(base), _step(step > 0 ? step : 1), _max(max) {}
+
+    size_t size() const {
+        return _players.size();
+    }
+
+    bool contains(uint64_t uid) const {
+        return _index.count(uid) != 0;
+    }
+
+    //加入匹配，玩家已经在等待时返回false
+    bool push(const match_player &player) {
+        if (_index.count(player.uid) != 0) {
+            return false;
+        }
+        player_iter it = _players.insert(player).first;
+        _index[player.uid] = it;
+        player_iter prev = it, next = it;
+        ++next;
+        bool has_prev = it != _players.begin();
+        bool has_next = next != _players.end();
+        if (has_prev) {
+            --prev;
+        }
+        if (has_prev && has_next) {
+            unlink(prev, next);
+        }
+        if (has_prev) {
+            link(prev, it);
+        }
+        if (has_next) {
+            link(it, next);
+        }
+        return true;
+    }
+
+    //取消匹配，玩家不在等待时返回false
+    bool remove(uint64_t uid) {
+        auto it = _index.find(uid);
+        if (it == _index.end()) {
+            return false;
+        }
+        detach(it->second);
+        return true;
+    }
+
+    //取出在now时刻已经能够匹配、并且最早能够匹配的一对玩家
+    bool pop_pair(int64_t now_ms, match_pair &pair) {
+        if (_ready.empty() || _ready.begin()->ready_ms > now_ms) {
+            return false;
+        }
+        ready_pair rp = *_ready.begin();
+        player_iter low = _index[rp.low], high = _index[rp.high];
+        pair.a = *low;
+        pair.b = *high;
+        detach(low);
+        detach(high);
+        return true;
+    }
+
+    //下一对玩家能够匹配的时间，没有可能匹配的玩家时返回false
+    bool next_ready(int64_t &ready_ms) const {
+        if (_ready.empty()) {
+            return false;
+        }
+        ready_ms = _ready.begin()->ready_ms;
+        return true;
+    }
+};
@@ -1,195 +1,482 @@
 #pragma once
 #include "db.hpp"
+#include "match_engine.hpp"
+#include "metrics.hpp"
 #include "online.hpp"
+#include "proto.hpp"
 #include "room.hpp"
+#include "user_cache.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <list>
 #include <mutex>
 #include <thread>
+#include <vector>
+#define MATCH_QUEUE_NIL UINT32_MAX//空下标
+#define MATCH_IDLE_MS 1000       //没有玩家可能匹配时，匹配线程最长挂起的时间
+#define MATCH_TICK_MS 0          //匹配周期，默认0：每有玩家加入就立即匹配；高负载时设为100左右，按周期批量匹配
+#define MATCH_BATCH_MAX 4096     //每个周期最多匹配的对数，剩下的留到紧接着的下一轮
+
+//匹配队列：先进先出，按用户ID在O(1)时间内取消
+//节点放在数组中，空闲节点串成空闲链表，队列节点用数组下标串成双向链表，用户ID到下标的索引就是节点的句柄
+//索引是开放寻址的下标数组(线性探测，删除时后移)，槽数至少是节点数的两倍，只随节点数组一起扩容
+//入队、取消、批量出队都只在一个很短的临界区内修改几个下标，不分配内存(数组扩容除外)
+//消费者在队列人数不够时挂起，只有在有人挂起、并且人数达到它等待的数量时才唤醒一个
 template<class T>
 class match_queue {
 private:
-    //使用链表而不直接使用queue是因为我们有中间删除数据的需要
-    std::list<T> _list;
-    //实现线程安全
+    struct node {
+        uint64_t key;
+        T data;
+        uint32_t prev;
+        uint32_t next;
+    };
+    std::vector<node> _nodes;
+    std::vector<uint32_t> _index;                 //用户ID -> 节点下标，空槽为MATCH_QUEUE_NIL，大小是2的幂
+    uint32_t _head;
+    uint32_t _tail;
+    uint32_t _free;                               //空闲链表，用next串起来
+    size_t _size;
+    size_t _waiters;                              //挂起的消费者数量
+    size_t _wait_size;                            //挂起的消费者等待的最少人数
+    bool _closed;
     std::mutex _mutex;
-    //这个条件变量主要为了阻塞消费者，后边使用的时候：队列中元素个数<2则阻塞
     std::condition_variable _cond;
 
+    size_t home(uint64_t key) const {
+        return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (_index.size() - 1);
+    }
+
+    //key所在的槽，不存在时返回探测到的空槽
+    size_t find_slot(uint64_t key) const {
+        size_t mask = _index.size() - 1;
+        size_t i = home(key);
+        while (_index[i] != MATCH_QUEUE_NIL && _nodes[_index[i]].key != key) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    //删除一个槽，把后面同一探测链上的下标前移填补空位，不需要墓碑
+    void erase_slot(size_t i) {
+        size_t mask = _index.size() - 1;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (_index[j] == MATCH_QUEUE_NIL) {
+                break;
+            }
+            size_t k = home(_nodes[_index[j]].key);
+            //k在(i, j]之间时j上的元素探测不会经过i，留在原地
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+                continue;
+            }
+            _index[i] = _index[j];
+            i = j;
+        }
+        _index[i] = MATCH_QUEUE_NIL;
+    }
+
+    //按队列中的节点重建索引
+    void rehash(size_t slots) {
+        _index.assign(slots, MATCH_QUEUE_NIL);
+        for (uint32_t idx = _head; idx != MATCH_QUEUE_NIL; idx = _nodes[idx].next) {
+            _index[find_slot(_nodes[idx].key)] = idx;
+        }
+    }
+
+    static size_t slots_for(size_t nodes) {
+        size_t slots = 16;
+        while (slots < nodes * 2) {
+            slots *= 2;
+        }
+        return slots;
+    }
+
+    uint32_t alloc_node() {
+        if (_free == MATCH_QUEUE_NIL) {
+            _nodes.push_back(node());
+            if (_nodes.size() * 2 > _index.size()) {
+                rehash(slots_for(_nodes.size()));
+            }
+            return (uint32_t)(_nodes.size() - 1);
+        }
+        uint32_t idx = _free;
+        _free = _nodes[idx].next;
+        return idx;
+    }
+
+    //调用者持有锁
+    void unlink(uint32_t idx) {
+        node &n = _nodes[idx];
+        if (n.prev == MATCH_QUEUE_NIL) {
+            _head = n.next;
+        } else {
+            _nodes[n.prev].next = n.next;
+        }
+        if (n.next == MATCH_QUEUE_NIL) {
+            _tail = n.prev;
+        } else {
+            _nodes[n.next].prev = n.prev;
+        }
+        erase_slot(find_slot(n.key));
+        n.data = T();
+        n.next = _free;
+        _free = idx;
+        _size--;
+    }
+
+    //调用者持有锁，队列非空
+    T pop_front() {
+        uint32_t idx = _head;
+        T data = std::move(_nodes[idx].data);
+        unlink(idx);
+        return data;
+    }
+
 public:
+    match_queue(size_t reserve = 0)
+        : _head(MATCH_QUEUE_NIL), _tail(MATCH_QUEUE_NIL), _free(MATCH_QUEUE_NIL),
+          _size(0), _waiters(0), _wait_size(0), _closed(false) {
+        _nodes.reserve(reserve);
+        _index.assign(slots_for(reserve), MATCH_QUEUE_NIL);
+    }
+
     //获取元素个数
-    int size() {
-        std::unique_lock<std::mutex> _lock(_mutex);
-        return _list.size();
-    }
-    //判断队列是否为空
-    bool empty() {
-        std::unique_lock<std::mutex> _lock(_mutex);
-        return _list.empty();
-    }
-    //阻塞线程
-    void wait() {
-        std::unique_lock<std::mutex> _lock(_mutex);
-        _cond.wait(_lock);
-    }
-    //入队列，并唤醒线程
-    bool push(const T &data) {
-        std::unique_lock<std::mutex> _lock(_mutex);
-        _list.push_back(data);
-        _cond.notify_all();
+    size_t size() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _size;
     }
-    //出队列
-    bool pop(T &data) {
-        std::unique_lock<std::mutex> _lock(_mutex);
-        if (_list.empty() == true) {
+
+    //入队列，同一个key已经在队列中时返回false
+    bool push(uint64_t key, const T &data) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_closed || _index[find_slot(key)] != MATCH_QUEUE_NIL) {
             return false;
         }
+        uint32_t idx = alloc_node();
+        node &n = _nodes[idx];
+        n.key = key;
+        n.data = data;
+        n.prev = _tail;
+        n.next = MATCH_QUEUE_NIL;
+        if (_tail == MATCH_QUEUE_NIL) {
+            _head = idx;
+        } else {
+            _nodes[_tail].next = idx;
+        }
+        _tail = idx;
+        //alloc_node可能重建了索引，重新探测
+        _index[find_slot(key)] = idx;
+        _size++;
+        if (_waiters != 0 && _size >= _wait_size) {
+            //只有一个消费者挂起时只唤醒它，多个消费者等待的人数可能不同，全部唤醒由它们自己判断
+            if (_waiters == 1) {
+                _cond.notify_one();
+            } else {
+                _cond.notify_all();
+            }
+        }
+        return true;
+    }
 
-        data = _list.front();
-        _list.pop_front();
+    //按key取消，通过索引直接找到节点摘下，不遍历队列
+    bool remove(uint64_t key) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint32_t idx = _index[find_slot(key)];
+        if (idx == MATCH_QUEUE_NIL) {
+            return false;
+        }
+        unlink(idx);
         return true;
     }
-    //移除指定的数据
-    bool remove(T &data) {
-        std::unique_lock<std::mutex> _lock(_mutex);
-        _list.remove(data);
+
+    //批量出队，最多取出max个，返回取出的个数
+    size_t pop_batch(std::vector<T> &out, size_t max) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size_t n = 0;
+        while (n < max && _size != 0) {
+            out.push_back(pop_front());
+            n++;
+        }
+        return n;
+    }
+
+    //按先后顺序两两出队，最多取出max对，返回取出的对数；人数为奇数时最后一个留在队列中
+    size_t pop_pairs(std::vector<std::pair<T, T>> &out, size_t max) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size_t n = 0;
+        while (n < max && _size >= 2) {
+            T first = pop_front();
+            out.push_back(std::make_pair(std::move(first), pop_front()));
+            n++;
+        }
+        return n;
+    }
+
+    //挂起直到队列中至少有min_size个元素、超时或者队列关闭，返回是否达到了min_size
+    bool wait(size_t min_size, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_size >= min_size || _closed) {
+            return _size >= min_size;
+        }
+        _wait_size = _waiters == 0 ? min_size : std::min(_wait_size, min_size);
+        _waiters++;
+        _cond.wait_for(lock, timeout, [this, min_size]() { return _size >= min_size || _closed; });
+        _waiters--;
+        return _size >= min_size;
     }
+
+    //关闭队列，唤醒所有挂起的消费者，之后不再接受入队
+    void close() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _closed = true;
+        _cond.notify_all();
+    }
+};
+
+//匹配统计
+struct matcher_stats {
+    uint64_t matched;   //成功创建房间的对数
+    uint64_t batches;   //处理过的批次数，每批只创建一次房间、序列化一次响应
 };
 
 class matcher {
 private:
-    //普通选手匹配队列
-    match_queue<uint64_t> _q_normal;
-    //高手匹配队列
-    match_queue<uint64_t> _q_high;
-    //大神匹配队列
-    match_queue<uint64_t> _q_super;
-    //对应三个匹配队列的处理线程
-    std::thread _th_normal;
-    std::thread _th_high;
-    std::thread _th_super;
+    //新加入匹配的玩家先进入这个队列，加入只需要一个很短的临界区，由匹配线程批量转入_engine
+    match_queue<match_player> _inbox;
+    //按天梯分排序的等待玩家，由_mutex保护，只有匹配线程和取消匹配会访问
+    match_engine _engine;
+    std::mutex _mutex;
+    std::atomic<bool> _running;
+    int64_t _tick_ms;   //匹配周期，为0时按事件驱动
+    size_t _batch_max;  //每批最多匹配的对数
+    std::atomic<uint64_t> _matched;
+    std::atomic<uint64_t> _batches;
     //连接句柄
     room_manager *_rm;
-    user_table *_ut;
+    user_cache *_uc;     //用户信息缓存，匹配只读天梯分，命中时不访问数据库
     online_manager *_om;
+    //匹配线程，最后构造，启动时其他成员都已经初始化
+    std::thread _th;
 
 private:
-    void handle_match(match_queue<uint64_t> &mq) {
-        while (true) {
-            //1. 判断队列人数是否大于2，<2则阻塞等待
-            while (mq.size() < 2) {
-                mq.wait();
-            }
-            //2. 出队两个玩家
-            uint64_t uid1, uid2;
-            bool ret = mq.pop(uid1);
-            //出队uid1失败,则继续
-            if (!ret) {
-                continue;
-            }
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+    }
 
-            //出队uid2
-            ret = mq.pop(uid2);
-            //出队uid2失败，重新添加uid1
-            if (!ret) {
-                this->add(uid1);
-                continue;
+    //按周期匹配：每个周期醒来一次，把这段时间加入的玩家一起放进排序树，整体配对后批量建房、批量通知
+    //按事件匹配：有玩家加入就醒来，逐对建房和通知
+    void handle_match() {
+        metrics_histogram &latency = metrics_registry::instance().histogram("gobang_match_batch_seconds", "匹配一批玩家(配对、建房、通知)的耗时");
+        std::vector<match_player> arrived;
+        std::vector<match_pair> pairs;
+        int64_t next_tick = now_ms();
+        while (_running) {
+            int64_t wait_ms = MATCH_IDLE_MS;
+            bool more = false;
+            uint64_t start = metrics_util::ticks();
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                //1. 把新加入的玩家转入排序树，持有_mutex，保证取消匹配不会错过正在转移的玩家
+                arrived.clear();
+                _inbox.pop_batch(arrived, SIZE_MAX);
+                for (auto &player: arrived) {
+                    _engine.push(player);
+                }
+                //2. 取出当前能够匹配的玩家，一批最多_batch_max对
+                pairs.clear();
+                match_pair pair;
+                int64_t now = now_ms();
+                while (pairs.size() < _batch_max && _engine.pop_pair(now, pair)) {
+                    pairs.push_back(pair);
+                }
+                int64_t ready;
+                if (_engine.next_ready(ready)) {
+                    more = ready <= now;
+                    wait_ms = std::min(wait_ms, ready - now);
+                }
             }
-
-            //3.校验两个玩家是否在线，如果有人掉线，则要吧另一个人重新添加入队列
-            server_t::connection_ptr conn1 = _om->get_conn_from_hall(uid1);
-            //conn1智能指针为nullptr 不在线
-            if (conn1.get() == nullptr) {
-                this->add(uid2);
-                continue;
+            //3. 创建房间和通知不持有锁，不阻塞加入和取消匹配
+            if (_tick_ms > 0) {
+                dispatch(pairs);
+            } else {
+                for (auto &p: pairs) {
+                    create_match(p);
+                }
             }
-
-            server_t::connection_ptr conn2 = _om->get_conn_from_hall(uid2);
-            if (conn2.get() == nullptr) {
-                this->add(uid1);
-                continue;
+            if (pairs.empty() == false) {
+                latency.record(metrics_util::ticks() - start);
             }
-            //4.为两个玩家创建房间，并将玩家加入房间中
-            room_ptr rp = _rm->create_room(uid1, uid2);
-            if (rp.get() == nullptr) {
-                this->add(uid1);
-                this->add(uid2);
+            //4. 这一批没有取完，立即处理下一批
+            if (more) {
                 continue;
             }
-            //5.对两个玩家进行响应
+            if (_tick_ms > 0) {
+                //等到下一个周期，期间加入的玩家不唤醒匹配线程
+                int64_t now = now_ms();
+                next_tick = std::max(next_tick + _tick_ms, now);
+                if (next_tick > now) {
+                    _inbox.wait(SIZE_MAX, std::chrono::milliseconds(next_tick - now));
+                }
+            } else if (pairs.empty()) {
+                //挂起到下一对玩家的分差窗口放宽到能够匹配，或者有玩家加入
+                _inbox.wait(1, std::chrono::milliseconds(wait_ms));
+            }
+        }
+    }
+
+    //掉线或者创建房间失败时，把玩家按原来的开始匹配时间放回，已经等待的时间继续有效
+    void requeue(const match_player &player) {
+        _inbox.push(player.uid, player);
+    }
+
+    //匹配成功的响应对所有玩家都一样，JSON和二进制各编码一次，所有连接共享
+    static const proto_frames &match_success_frames() {
+        static const proto_frames frames = []() {
             Json::Value rsp;
             rsp["optype"] = "match_success";
             rsp["result"] = true;
             std::string body;
             json_util::serialize(rsp, body);
-            //向uid1 和 uid2 对应的两个客户端（玩家）发送数据
-            conn1->send(body);
-            conn2->send(body);
-        }
+            proto_frames f;
+            proto_util::make_frames(rsp, body, true, f);
+            return f;
+        }();
+        return frames;
     }
 
-    void th_normal_entry() {
-        return handle_match(_q_normal);
-    }
+    void create_match(const match_pair &pair) {
+        uint64_t uid1 = pair.a.uid, uid2 = pair.b.uid;
+        //3.校验两个玩家是否在线，如果有人掉线，则要吧另一个人重新添加入队列
+        server_t::connection_ptr conn1 = _om->get_conn_from_hall(uid1);
+        //conn1智能指针为nullptr 不在线
+        if (conn1.get() == nullptr) {
+            return requeue(pair.b);
+        }
 
-    void th_high_entry() {
-        return handle_match(_q_high);
+        server_t::connection_ptr conn2 = _om->get_conn_from_hall(uid2);
+        if (conn2.get() == nullptr) {
+            return requeue(pair.a);
+        }
+        //4.为两个玩家创建房间，并将玩家加入房间中
+        room_ptr rp = _rm->create_room(uid1, uid2);
+        if (rp.get() == nullptr) {
+            requeue(pair.a);
+            requeue(pair.b);
+            return;
+        }
+        //5.对两个玩家进行响应
+        Json::Value rsp;
+        rsp["optype"] = "match_success";
+        rsp["result"] = true;
+        std::string body;
+        json_util::serialize(rsp, body);
+        bool bin1 = proto_util::is_binary(conn1), bin2 = proto_util::is_binary(conn2);
+        proto_frames frames;
+        proto_util::make_frames(rsp, body, bin1 || bin2, frames);
+        //向uid1 和 uid2 对应的两个客户端（玩家）发送数据，按各自协商的协议
+        conn1->send(frames.select(bin1));
+        conn2->send(frames.select(bin2));
+        _matched++;
+        _batches++;
     }
 
-    void th_super_entry() {
-        return handle_match(_q_super);
+    //批量处理一个周期的匹配结果：一次校验在线、一次加锁建好所有房间、响应只编码一次
+    void dispatch(const std::vector<match_pair> &pairs) {
+        if (pairs.empty()) {
+            return;
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> uids;
+        std::vector<std::pair<server_t::connection_ptr, server_t::connection_ptr>> conns;
+        uids.reserve(pairs.size());
+        conns.reserve(pairs.size());
+        //1.校验两个玩家是否在大厅，有人掉线则把另一个人放回；这里取得的在线记录就是建房的依据，建房时不再查询
+        for (auto &pair: pairs) {
+            online_user u1, u2;
+            bool on1 = _om->get_user(pair.a.uid, u1) && u1.hall.get() != nullptr;
+            bool on2 = _om->get_user(pair.b.uid, u2) && u2.hall.get() != nullptr;
+            if (on1 && on2) {
+                uids.push_back(std::make_pair(pair.a.uid, pair.b.uid));
+                conns.push_back(std::make_pair(u1.hall, u2.hall));
+            } else if (on1) {
+                requeue(pair.a);
+            } else if (on2) {
+                requeue(pair.b);
+            }
+        }
+        //2.批量创建房间
+        std::vector<room_ptr> rooms;
+        _rm->create_rooms(uids, rooms);
+        //3.批量通知
+        const proto_frames &frames = match_success_frames();
+        for (size_t i = 0; i < rooms.size(); i++) {
+            conns[i].first->send(frames.select(proto_util::is_binary(conns[i].first)));
+            conns[i].second->send(frames.select(proto_util::is_binary(conns[i].second)));
+        }
+        _matched += rooms.size();
+        _batches++;
     }
 
 public:
-    matcher(room_manager *rm, user_table *ut, online_manager *om)
-        : _rm(rm), _ut(ut), _om(om),
+    matcher(room_manager *rm, user_cache *uc, online_manager *om,
+            int64_t tick_ms = MATCH_TICK_MS, size_t batch_max = MATCH_BATCH_MAX)
+        : _running(true), _tick_ms(tick_ms), _batch_max(batch_max == 0 ? 1 : batch_max),
+          _matched(0), _batches(0), _rm(rm), _uc(uc), _om(om),
           //std::thread(&类名::成员函数名, 类的对象或者指针)
-          _th_normal(std::thread(&matcher::th_normal_entry, this)),
-          _th_high(std::thread(&matcher::th_high_entry, this)),
-          _th_super(std::thread(&matcher::th_super_entry, this)) {
+          _th(std::thread(&matcher::handle_match, this)) {
         DBG_LOG("游戏匹配模块初始化完毕....");
     }
 
+    ~matcher() {
+        _running = false;
+        _inbox.close();
+        _th.join();
+    }
+
     bool add(uint64_t uid) {
-        //根据玩家的天梯分数，来判定玩家档次，添加到不同的匹配队列
+        //根据玩家的天梯分数加入排序树，分数相近的玩家优先匹配，等待越久接受的分差越大
         //1.根据用户ID，获取玩家信息
-        Json::Value user;
-        bool ret = _ut->select_by_id(uid, user);
+        user_info user;
+        bool ret = _uc->select_by_id(uid, user);
         if (ret == false) {
-            DBG_LOG("获取玩家:%d 信息失败！", uid);
+            DBG_LOG("获取玩家:%lu 信息失败！", (unsigned long) uid);
             return false;
         }
 
-        int score = user["score"].asInt();
-        //2.添加到指定的队列中
-        if (score < 2000) {
-            _q_normal.push(uid);
-        } else if (score >= 2000 && score < 3000) {
-            _q_high.push(uid);
-        } else {
-            _q_super.push(uid);
-        }
+        //2.添加到匹配队列中，由匹配线程转入匹配引擎
+        return add(uid, user.score);
+    }
 
-        return true;
+    //已经知道天梯分时直接加入匹配
+    bool add(uint64_t uid, int64_t score) {
+        match_player player = {uid, score, now_ms()};
+        return _inbox.push(uid, player);
     }
 
+    //取消匹配，通过用户ID直接定位，不需要再查询天梯分
+    //还没有被匹配线程转走时直接从队列摘下，不需要等待_mutex
     bool del(uint64_t uid) {
-        Json::Value user;
-        bool ret = _ut->select_by_id(uid, user);
-        if (ret == false) {
-            DBG_LOG("获取玩家:%d 信息失败！！", uid);
-            return false;
-        }
-        int score = user["score"].asInt();
-        // 2. 添加到指定的队列中
-        if (score < 2000) {
-            _q_normal.remove(uid);
-        } else if (score >= 2000 && score < 3000) {
-            _q_high.remove(uid);
-        } else {
-            _q_super.remove(uid);
+        if (_inbox.remove(uid)) {
+            return true;
         }
-        return true;
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _engine.remove(uid);
+    }
+
+    matcher_stats get_stats() {
+        matcher_stats stats = {_matched, _batches};
+        return stats;
     }
-};
\ No newline at end of file
+
+    //正在等待匹配的人数
+    size_t size() {
+        size_t n = _inbox.size();
+        std::unique_lock<std::mutex> lock(_mutex);
+        return n + _engine.size();
+    }
+};
@@ -0,0 +1,401 @@
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#define METRICS_STRIPES 32                                     //每个指标的分片数；前METRICS_STRIPES-1个线程各自独占一个分片，之后的线程共用最后一个
+#define METRICS_SUB_BITS 3                                     //直方图把每个2的幂区间再分成8个桶，相对误差不超过12.5%
+#define METRICS_MAX_BITS 40                                    //直方图记录的最大值约2^40(按3GHz的TSC约6分钟)，更大的值记入最后一个桶
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 2) << METRICS_SUB_BITS)
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_SUMMARY
+} metric_type;
+
+class metrics_util {
+public:
+    //当前线程使用的分片，第一次调用时按顺序分配
+    static size_t stripe() {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t idx = std::min(next.fetch_add(1, std::memory_order_relaxed), (size_t) METRICS_STRIPES - 1);
+        return idx;
+    }
+
+    //独占的分片只有本线程写，读-加-写不需要带lock前缀的原子指令；共用的分片用fetch_add
+    //导出线程只读，relaxed的load/store保证不会读到撕裂的值
+    static void add(std::atomic<uint64_t> &cell, size_t stripe, uint64_t n) {
+        if (stripe < METRICS_STRIPES - 1) {
+            cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        } else {
+            cell.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    //HDR风格的对数-线性分桶：小于8的值每个值一个桶，之后每个2的幂区间按最高位之后的3位再分8个桶
+    static size_t bucket(uint64_t v) {
+        if (v < (1u << METRICS_SUB_BITS)) {
+            return (size_t) v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        if (msb > METRICS_MAX_BITS) {
+            return METRICS_BUCKETS - 1;
+        }
+        int shift = msb - METRICS_SUB_BITS;
+        return ((size_t) (shift + 1) << METRICS_SUB_BITS) + ((v >> shift) & ((1u << METRICS_SUB_BITS) - 1));
+    }
+
+    //桶内值的上界
+    static uint64_t bucket_upper(size_t idx) {
+        if (idx < (1u << METRICS_SUB_BITS)) {
+            return idx;
+        }
+        int shift = (int) (idx >> METRICS_SUB_BITS) - 1;
+        uint64_t lower = (uint64_t) ((idx & ((1u << METRICS_SUB_BITS) - 1)) | (1u << METRICS_SUB_BITS)) << shift;
+        return lower + ((uint64_t) 1 << shift) - 1;
+    }
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+    }
+
+    //CPU声明了不变TSC(频率恒定、各核同步)时用TSC计时
+    static bool use_tsc() {
+#if defined(__x86_64__)
+        static const bool invariant = []() {
+            unsigned a, b, c, d;
+            return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8)) != 0;
+        }();
+        return invariant;
+#else
+        return false;
+#endif
+    }
+
+    //计时用的时钟：读TSC比clock_gettime快得多，直方图中记录的是tick数，导出时再换算成纳秒
+    static uint64_t ticks() {
+#if defined(__x86_64__)
+        if (use_tsc()) {
+            return __rdtsc();
+        }
+#endif
+        return (uint64_t) now_ns();
+    }
+
+    //每个tick的纳秒数：用进程启动以来的TSC增量和steady_clock增量校准，运行时间越长越准确
+    static double ns_per_tick() {
+        static const uint64_t base_ticks = ticks();
+        static const int64_t base_ns = now_ns();
+        if (use_tsc() == false) {
+            return 1.0;
+        }
+        uint64_t dt = ticks() - base_ticks;
+        int64_t dns = now_ns() - base_ns;
+        if (dt < 1000000 || dns <= 0) {
+            return 1.0 / 3;//刚启动还没法校准，按3GHz估计
+        }
+        return (double) dns / dt;
+    }
+};
+
+//计数器：每个线程累加自己的分片，读取时把所有分片加起来
+//每个分片占64字节，任意两个分片的值都不在同一个缓存行上(C++11的new不保证按64字节对齐，所以用填充而不是alignas)
+class metrics_counter {
+private:
+    struct cell {
+        std::atomic<uint64_t> value;
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    cell _cells[METRICS_STRIPES];
+
+public:
+    metrics_counter() {
+        for (auto &c: _cells) {
+            c.value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void inc(uint64_t n = 1) {
+        size_t stripe = metrics_util::stripe();
+        metrics_util::add(_cells[stripe].value, stripe, n);
+    }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for (auto &c: _cells) {
+            sum += c.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+};
+
+//直方图快照，分位数取所在桶的上界，单位与记录时相同
+struct metrics_snapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[METRICS_BUCKETS];
+
+    uint64_t percentile(double p) const {
+        uint64_t target = (uint64_t) (count * p);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= target) {
+                return metrics_util::bucket_upper(i);
+            }
+        }
+        return 0;
+    }
+};
+
+//延迟直方图：记录一次只是在本线程的分片上加两个数，没有锁；计时的值是metrics_util::ticks()的差
+class metrics_histogram {
+private:
+    //每个分片有几KB，相邻分片最多在边界上共享一个缓存行
+    struct stripe {
+        std::atomic<uint64_t> buckets[METRICS_BUCKETS];
+        std::atomic<uint64_t> sum;
+    };
+    std::unique_ptr<stripe[]> _stripes;
+
+public:
+    metrics_histogram() : _stripes(new stripe[METRICS_STRIPES]) {
+        for (size_t s = 0; s < METRICS_STRIPES; s++) {
+            for (auto &b: _stripes[s].buckets) {
+                b.store(0, std::memory_order_relaxed);
+            }
+            _stripes[s].sum.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t v) {
+        size_t idx = metrics_util::stripe();
+        stripe &s = _stripes[idx];
+        metrics_util::add(s.buckets[metrics_util::bucket(v)], idx, 1);
+        metrics_util::add(s.sum, idx, v);
+    }
+
+    void snapshot(metrics_snapshot &snap) const {
+        snap.count = 0;
+        snap.sum = 0;
+        for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+            snap.buckets[i] = 0;
+        }
+        for (size_t s = 0; s < METRICS_STRIPES; s++) {
+            for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+                uint64_t n = _stripes[s].buckets[i].load(std::memory_order_relaxed);
+                snap.buckets[i] += n;
+                snap.count += n;
+            }
+            snap.sum += _stripes[s].sum.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+//指标注册表：指标创建后不会删除，热路径上保存引用直接使用；只有注册和导出需要加锁
+//导出时持有注册表的锁调用回调，回调中可以加模块自己的锁，但持有模块的锁时不能创建指标
+//同名的指标组成一族，用标签区分，导出为Prometheus文本格式；直方图按summary导出，值从tick换算成秒
+class metrics_registry {
+private:
+    struct series {
+        std::string labels;//形如 handler="login"，可以为空
+        std::unique_ptr<metrics_counter> counter;
+        std::unique_ptr<metrics_histogram> histogram;
+        std::function<double()> callback;//导出时才取值的指标，如在线人数
+        const void *owner;               //回调所属的对象，对象销毁前注销
+    };
+
+    struct family {
+        std::string help;
+        metric_type type;
+        std::vector<std::unique_ptr<series>> list;
+    };
+
+    std::mutex _mutex;
+    std::map<std::string, family> _families;
+    std::atomic<bool> _enabled;
+
+    metrics_registry() : _enabled(true) {
+        metrics_util::ns_per_tick();//记下校准的起点
+    }
+
+    series &get_series(const std::string &name, const std::string &help, metric_type type, const std::string &labels) {
+        family &fm = _families[name];
+        if (fm.list.empty()) {
+            fm.help = help;
+            fm.type = type;
+        }
+        for (auto &s: fm.list) {
+            if (s->labels == labels && !s->callback) {
+                return *s;
+            }
+        }
+        fm.list.emplace_back(new series());
+        series &s = *fm.list.back();
+        s.labels = labels;
+        s.owner = nullptr;
+        return s;
+    }
+
+    static void append_line(std::string &out, const std::string &name, const char *suffix, const std::string &labels, const char *extra, double value) {
+        out += name;
+        out += suffix;
+        if (labels.empty() == false || extra != nullptr) {
+            out += '{';
+            out += labels;
+            if (extra != nullptr) {
+                if (labels.empty() == false) {
+                    out += ',';
+                }
+                out += extra;
+            }
+            out += '}';
+        }
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %.9g\n", value);
+        out += buf;
+    }
+
+public:
+    //不析构：全局对象和其他线程在退出过程中仍然可能更新指标
+    static metrics_registry &instance() {
+        static metrics_registry *reg = new metrics_registry();
+        return *reg;
+    }
+
+    //关闭后metrics_timer不再读时钟，用于测量埋点本身的开销
+    static bool enabled() {
+        return instance()._enabled.load(std::memory_order_relaxed);
+    }
+
+    static void set_enabled(bool enabled) {
+        instance()._enabled = enabled;
+    }
+
+    metrics_counter &counter(const std::string &name, const std::string &help, const std::string &labels = "") {
+        std::unique_lock<std::mutex> lock(_mutex);
+        series &s = get_series(name, help, METRIC_COUNTER, labels);
+        if (!s.counter) {
+            s.counter.reset(new metrics_counter());
+        }
+        return *s.counter;
+    }
+
+    metrics_histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = "") {
+        std::unique_lock<std::mutex> lock(_mutex);
+        series &s = get_series(name, help, METRIC_SUMMARY, labels);
+        if (!s.histogram) {
+            s.histogram.reset(new metrics_histogram());
+        }
+        return *s.histogram;
+    }
+
+    //导出时调用fn取值，type为METRIC_COUNTER或METRIC_GAUGE
+    void add_callback(const std::string &name, const std::string &help, metric_type type, const std::string &labels,
+                      const std::function<double()> &fn, const void *owner) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        family &fm = _families[name];
+        if (fm.list.empty()) {
+            fm.help = help;
+            fm.type = type;
+        }
+        fm.list.emplace_back(new series());
+        series &s = *fm.list.back();
+        s.labels = labels;
+        s.callback = fn;
+        s.owner = owner;
+    }
+
+    //注销owner注册的所有回调
+    void remove_callbacks(const void *owner) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (auto it = _families.begin(); it != _families.end();) {
+            auto &list = it->second.list;
+            for (size_t i = 0; i < list.size();) {
+                if (list[i]->callback && list[i]->owner == owner) {
+                    list.erase(list.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+            if (list.empty()) {
+                it = _families.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    //Prometheus文本格式
+    void render(std::string &out) {
+        static const struct {
+            double q;
+            const char *label;
+        } quantiles[] = {{0.5, "quantile=\"0.5\""}, {0.9, "quantile=\"0.9\""}, {0.99, "quantile=\"0.99\""}, {0.999, "quantile=\"0.999\""}};
+        static const char *type_names[] = {"counter", "gauge", "summary"};
+        std::unique_ptr<metrics_snapshot> snap(new metrics_snapshot());
+        double sec_per_tick = metrics_util::ns_per_tick() / 1e9;
+        out.clear();
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (auto &it: _families) {
+            const std::string &name = it.first;
+            family &fm = it.second;
+            out += "# HELP " + name + " " + fm.help + "\n";
+            out += "# TYPE " + name + " " + type_names[fm.type] + "\n";
+            for (auto &s: fm.list) {
+                if (s->callback) {
+                    append_line(out, name, "", s->labels, nullptr, s->callback());
+                } else if (s->counter) {
+                    append_line(out, name, "", s->labels, nullptr, (double) s->counter->value());
+                } else if (s->histogram) {
+                    s->histogram->snapshot(*snap);
+                    for (auto &q: quantiles) {
+                        double v = snap->count == 0 ? 0 : snap->percentile(q.q) * sec_per_tick;
+                        append_line(out, name, "", s->labels, q.label, v);
+                    }
+                    append_line(out, name, "_sum", s->labels, nullptr, snap->sum * sec_per_tick);
+                    append_line(out, name, "_count", s->labels, nullptr, (double) snap->count);
+                }
+            }
+        }
+    }
+};
+
+//作用域计时：构造时读一次时钟，析构时把经过的tick数记入直方图
+class metrics_timer {
+private:
+    metrics_histogram *_hist;
+    uint64_t _start;
+
+public:
+    metrics_timer(metrics_histogram &hist) : _hist(nullptr), _start(0) {
+        if (metrics_registry::enabled()) {
+            _hist = &hist;
+            _start = metrics_util::ticks();
+        }
+    }
+
+    ~metrics_timer() {
+        if (_hist != nullptr) {
+            _hist->record(metrics_util::ticks() - _start);
+        }
+    }
+};
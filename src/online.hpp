@@ -2,73 +2,165 @@
 #include "util.hpp"
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
 
+#define ONLINE_SHARD_NUM 64//分片数量，必须是2的幂
+
+//一个在线用户的完整状态，大厅连接和房间连接放在同一条记录中，一次查找即可同时得到
+struct online_user {
+    bool in_hall;                 //是否在游戏大厅
+    bool in_room;                 //是否在游戏房间
+    server_t::connection_ptr hall;//游戏大厅的通信连接
+    server_t::connection_ptr room;//游戏房间的通信连接
+
+    online_user() : in_hall(false), in_room(false) {}
+};
+
+//在线用户管理：按用户ID分成ONLINE_SHARD_NUM个分片，每个分片一把锁
+//不同用户的操作大概率落在不同分片上，多个io线程之间几乎没有锁竞争
 class online_manager {
 private:
-    std::mutex _mutex;
-    //用于建立游戏大厅用户的用户ID与通信连接的关系
-    std::unordered_map<uint64_t, server_t::connection_ptr> _game_hall;
-    //用于建立游戏房间用户的用户ID与通信连接的关系
-    std::unordered_map<uint64_t, server_t::connection_ptr> _game_room;
+    //按缓存行对齐，避免相邻分片的锁产生伪共享
+    struct alignas(64) shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, online_user> users;
+    };
+    shard _shards[ONLINE_SHARD_NUM];
+
+    shard &get_shard(uint64_t uid) {
+        //乘法散列，连续分配的用户ID也能均匀分布到各个分片
+        return _shards[(uid * 0x9E3779B97F4A7C15ULL) >> 32 & (ONLINE_SHARD_NUM - 1)];
+    }
+
+    //用户离开大厅或房间，如果既不在大厅也不在房间，则删除整条记录
+    static bool leave(shard &sd, uint64_t uid, bool online_user::*flag, server_t::connection_ptr online_user::*conn) {
+        auto it = sd.users.find(uid);
+        if (it == sd.users.end() || it->second.*flag == false) {
+            return false;
+        }
+        it->second.*flag = false;
+        (it->second.*conn).reset();
+        if (it->second.in_hall == false && it->second.in_room == false) {
+            sd.users.erase(it);
+        }
+        return true;
+    }
 
 public:
     online_manager() {}
     //websocket连接建立的时候才会加入游戏大厅&游戏房间在线用户管理
     void enter_game_hall(uint64_t uid, server_t::connection_ptr &conn) {
-        std::unique_lock<std::mutex> _mutex;
-        _game_hall.insert(std::make_pair(uid, conn));
-        //_game_hall[uid] = conn
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        online_user &user = sd.users[uid];
+        if (user.in_hall == false) {
+            user.in_hall = true;
+            user.hall = conn;
+        }
     }
     void enter_game_room(uint64_t uid, server_t::connection_ptr &conn) {
-        std::unique_lock<std::mutex> _mutex;
-        _game_room.insert(std::make_pair(uid, conn));
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        online_user &user = sd.users[uid];
+        if (user.in_room == false) {
+            user.in_room = true;
+            user.room = conn;
+        }
     }
     //websocket连接断开的时候，才会移除游戏大厅&游戏房间在线用户管理
     bool exit_game_hall(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        _game_hall.erase(uid);
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        return leave(sd, uid, &online_user::in_hall, &online_user::hall);
     }
     bool exit_game_room(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        _game_room.erase(uid);
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        return leave(sd, uid, &online_user::in_room, &online_user::room);
     }
-    //判断当前指定用户是否在游戏大厅/游戏房间
-    bool is_in_game_hall(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        auto it = _game_hall.find(uid);
-        if (it == _game_hall.end()) {
+
+    //一次查找得到用户的大厅与房间状态，用户不在线时返回false
+    bool get_user(uint64_t uid, online_user &user) {
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.users.find(uid);
+        if (it == sd.users.end()) {
             return false;
         }
+        user = it->second;
         return true;
     }
 
+    //判断当前指定用户是否在游戏大厅/游戏房间
+    bool is_in_game_hall(uint64_t uid) {
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.users.find(uid);
+        return it != sd.users.end() && it->second.in_hall;
+    }
+
     bool is_in_game_room(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        auto it = _game_room.find(uid);
-        if (it == _game_room.end()) {
-            return false;
-        }
-        return true;
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.users.find(uid);
+        return it != sd.users.end() && it->second.in_room;
     }
 
     //通过用户ID在游戏大厅/游戏房间用户管理中获取对应的通信连接
     server_t::connection_ptr get_conn_from_hall(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        auto it = _game_hall.find(uid);
-        if (it == _game_hall.end()) {
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.users.find(uid);
+        if (it == sd.users.end()) {
             return server_t::connection_ptr();
         }
-        return it->second;
+        return it->second.hall;
+    }
+
+    //向游戏大厅中的所有连接发送同一个已编码的消息，返回发送的连接数
+    //每个分片只在加锁时取出连接，发送在锁外进行，不阻塞其他线程进出大厅
+    size_t broadcast_hall(const server_t::message_ptr &msg) {
+        std::vector<server_t::connection_ptr> conns;
+        size_t count = 0;
+        for (auto &sd: _shards) {
+            conns.clear();
+            {
+                std::unique_lock<std::mutex> lock(sd.mutex);
+                for (auto &it: sd.users) {
+                    if (it.second.in_hall && it.second.hall.get() != nullptr) {
+                        conns.push_back(it.second.hall);
+                    }
+                }
+            }
+            for (auto &conn: conns) {
+                conn->send(msg);
+            }
+            count += conns.size();
+        }
+        return count;
     }
 
     server_t::connection_ptr get_conn_from_room(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        auto it = _game_room.find(uid);
-        if (it == _game_room.end()) {
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.users.find(uid);
+        if (it == sd.users.end()) {
             return server_t::connection_ptr();
         }
-        return it->second;
+        return it->second.room;
+    }
+
+    //统计大厅和房间中的在线人数，逐个分片加锁遍历，只用于监控
+    void get_user_num(size_t &hall, size_t &room) {
+        hall = room = 0;
+        for (auto &sd: _shards) {
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            for (auto &it: sd.users) {
+                hall += it.second.in_hall;
+                room += it.second.in_room;
+            }
+        }
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,352 @@
+#pragma once
+#include "board.hpp"
+#include "util.hpp"
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define PROTO_SUBPROTOCOL "gobang.bin.v1"//握手时通过Sec-WebSocket-Protocol协商的二进制子协议
+#define PROTO_CHAT_MAX 1024              //聊天内容的最大字节数
+
+//二进制协议：对局中的高频消息(下棋、聊天、匹配)用定长小端格式，放在websocket的binary帧中
+//所有消息以4字节的头部开始：type(1) flags(1) code(1) reserved(1)，flags的最低位是result
+//    put_chess请求  16字节：头部 row(1) col(1) pad(2) room_id(8)
+//    put_chess响应  32字节：请求的16字节 uid(8) winner(8)
+//    chat          24字节 + 内容：头部 len(2) pad(2) room_id(8) uid(8) 内容(len)
+//    match_*        4字节：只有头部
+//    snapshot     257字节：头部 status(1) pad(3) room_id(8) white_id(8) black_id(8) 棋盘(BOARD_ROW*BOARD_COL)
+//请求中的uid由服务器按会话填写，客户端可以填0；握手、房间就绪等控制消息仍然是JSON文本帧
+typedef enum {
+    PROTO_PUT_CHESS = 1,
+    PROTO_CHAT = 2,
+    PROTO_MATCH_START = 3,
+    PROTO_MATCH_STOP = 4,
+    PROTO_MATCH_SUCCESS = 5,
+    PROTO_SNAPSHOT = 6
+} proto_type;
+
+//结果码，对应JSON协议中的reason
+typedef enum {
+    PROTO_OK = 0,
+    PROTO_FIVE,         //五子连珠
+    PROTO_OFFLINE,      //对方掉线
+    PROTO_OCCUPIED,     //位置被占用
+    PROTO_OUT_OF_RANGE, //位置超出棋盘
+    PROTO_ROOM_MISMATCH,//房间号不匹配
+    PROTO_SENSITIVE,    //消息中包含敏感词
+    PROTO_UNKNOWN_TYPE, //未知请求类型
+    PROTO_BAD_REQUEST   //格式错误或者其他原因
+} proto_code;
+
+#define PROTO_HEADER_SIZE 4
+#define PROTO_PUT_CHESS_REQ_SIZE 16
+#define PROTO_PUT_CHESS_RSP_SIZE 32
+#define PROTO_CHAT_SIZE 24
+#define PROTO_SNAPSHOT_SIZE (32 + BOARD_ROW * BOARD_COL)
+
+//解码后的一条消息，text指向原始缓冲区，解码不分配内存
+struct proto_msg {
+    uint8_t type;
+    bool result;
+    uint8_t code;
+    int row;
+    int col;
+    uint64_t room_id;
+    uint64_t uid;
+    uint64_t winner;
+    const char *text;
+    size_t text_len;
+
+    proto_msg() : type(0), result(false), code(PROTO_OK), row(0), col(0), room_id(0), uid(0), winner(0), text(nullptr), text_len(0) {}
+};
+
+//同一条消息的JSON编码和二进制编码，发送时按连接协商的协议选择
+struct proto_frames {
+    server_t::message_ptr text;
+    server_t::message_ptr binary;
+
+    const server_t::message_ptr &select(bool is_binary) const {
+        return is_binary ? binary : text;
+    }
+
+    bool empty() const {
+        return text.get() == nullptr && binary.get() == nullptr;
+    }
+};
+
+class proto_util {
+private:
+    static void put_u16(char *p, uint16_t v) {
+        p[0] = (char) v;
+        p[1] = (char) (v >> 8);
+    }
+
+    static void put_u64(char *p, uint64_t v) {
+        for (int i = 0; i < 8; i++) {
+            p[i] = (char) (v >> (8 * i));
+        }
+    }
+
+    static uint16_t get_u16(const char *p) {
+        return (uint16_t) ((uint8_t) p[0] | (uint8_t) p[1] << 8);
+    }
+
+    static uint64_t get_u64(const char *p) {
+        uint64_t v = 0;
+        for (int i = 7; i >= 0; i--) {
+            v = v << 8 | (uint8_t) p[i];
+        }
+        return v;
+    }
+
+    struct reason_entry {
+        const char *reason;
+        proto_code code;
+    };
+
+    //room.hpp中使用的reason
+    static const reason_entry *reasons(size_t &n) {
+        static const reason_entry table[] = {
+                {"five in a row", PROTO_FIVE},
+                {"对方掉线", PROTO_OFFLINE},
+                {"white is offline , black win", PROTO_OFFLINE},
+                {"black is offline , white win", PROTO_OFFLINE},
+                {"position is occupied", PROTO_OCCUPIED},
+                {"position is out of range", PROTO_OUT_OF_RANGE},
+                {"房间号不匹配！", PROTO_ROOM_MISMATCH},
+                {"消息中包含敏感词", PROTO_SENSITIVE},
+                {"未知请求类型", PROTO_UNKNOWN_TYPE},
+                {"请求的正文格式错误", PROTO_BAD_REQUEST},
+        };
+        n = sizeof(table) / sizeof(table[0]);
+        return table;
+    }
+
+    static proto_code reason_code(const char *begin, const char *end) {
+        size_t n;
+        const reason_entry *table = reasons(n);
+        size_t len = end - begin;
+        for (size_t i = 0; i < n; i++) {
+            if (strlen(table[i].reason) == len && memcmp(table[i].reason, begin, len) == 0) {
+                return table[i].code;
+            }
+        }
+        return PROTO_BAD_REQUEST;
+    }
+
+public:
+    //连接握手时是否协商了二进制协议
+    static bool is_binary(const server_t::connection_ptr &conn) {
+        return conn->get_subprotocol() == PROTO_SUBPROTOCOL;
+    }
+
+    //解码一条二进制消息，长度或者类型不对时返回false
+    static bool decode(const char *data, size_t len, proto_msg &msg) {
+        if (len < PROTO_HEADER_SIZE) {
+            return false;
+        }
+        msg.type = (uint8_t) data[0];
+        msg.result = (data[1] & 1) != 0;
+        msg.code = (uint8_t) data[2];
+        switch (msg.type) {
+            case PROTO_PUT_CHESS:
+                if (len != PROTO_PUT_CHESS_REQ_SIZE && len != PROTO_PUT_CHESS_RSP_SIZE) {
+                    return false;
+                }
+                msg.row = (int8_t) data[4];
+                msg.col = (int8_t) data[5];
+                msg.room_id = get_u64(data + 8);
+                if (len == PROTO_PUT_CHESS_RSP_SIZE) {
+                    msg.uid = get_u64(data + 16);
+                    msg.winner = get_u64(data + 24);
+                }
+                return true;
+            case PROTO_CHAT:
+                if (len < PROTO_CHAT_SIZE) {
+                    return false;
+                }
+                msg.text_len = get_u16(data + 4);
+                if (msg.text_len > PROTO_CHAT_MAX || len != PROTO_CHAT_SIZE + msg.text_len) {
+                    return false;
+                }
+                msg.room_id = get_u64(data + 8);
+                msg.uid = get_u64(data + 16);
+                msg.text = data + PROTO_CHAT_SIZE;
+                return true;
+            case PROTO_MATCH_START:
+            case PROTO_MATCH_STOP:
+            case PROTO_MATCH_SUCCESS:
+                return len == PROTO_HEADER_SIZE;
+            default:
+                return false;
+        }
+    }
+
+    //编码一条二进制消息，put_chess总是按响应的32字节编码
+    static bool encode(const proto_msg &msg, std::string &out) {
+        size_t len;
+        switch (msg.type) {
+            case PROTO_PUT_CHESS:
+                len = PROTO_PUT_CHESS_RSP_SIZE;
+                break;
+            case PROTO_CHAT:
+                if (msg.text_len > PROTO_CHAT_MAX) {
+                    return false;
+                }
+                len = PROTO_CHAT_SIZE + msg.text_len;
+                break;
+            case PROTO_MATCH_START:
+            case PROTO_MATCH_STOP:
+            case PROTO_MATCH_SUCCESS:
+                len = PROTO_HEADER_SIZE;
+                break;
+            default:
+                return false;
+        }
+        out.assign(len, '\0');
+        char *p = &out[0];
+        p[0] = (char) msg.type;
+        p[1] = msg.result ? 1 : 0;
+        p[2] = (char) msg.code;
+        if (msg.type == PROTO_PUT_CHESS) {
+            p[4] = (char) (int8_t) msg.row;
+            p[5] = (char) (int8_t) msg.col;
+            put_u64(p + 8, msg.room_id);
+            put_u64(p + 16, msg.uid);
+            put_u64(p + 24, msg.winner);
+        } else if (msg.type == PROTO_CHAT) {
+            put_u16(p + 4, (uint16_t) msg.text_len);
+            put_u64(p + 8, msg.room_id);
+            put_u64(p + 16, msg.uid);
+            if (msg.text_len != 0) {
+                memcpy(p + PROTO_CHAT_SIZE, msg.text, msg.text_len);
+            }
+        }
+        return true;
+    }
+
+    //房间的完整棋盘，给二进制协议的观战者
+    static void encode_snapshot(uint64_t room_id, uint64_t white_id, uint64_t black_id, bool started,
+                                const bitboard &board, std::string &out) {
+        out.assign(PROTO_SNAPSHOT_SIZE, '\0');
+        char *p = &out[0];
+        p[0] = (char) PROTO_SNAPSHOT;
+        p[1] = 1;
+        p[4] = started ? 1 : 0;
+        put_u64(p + 8, room_id);
+        put_u64(p + 16, white_id);
+        put_u64(p + 24, black_id);
+        for (int row = 0; row < BOARD_ROW; row++) {
+            for (int col = 0; col < BOARD_COL; col++) {
+                p[32 + row * BOARD_COL + col] = (char) board.get(row, col);
+            }
+        }
+    }
+
+    //消息类型在JSON协议中的optype，不认识的类型返回空串
+    static const char *type_name(uint8_t type) {
+        switch (type) {
+            case PROTO_PUT_CHESS:
+                return "put_chess";
+            case PROTO_CHAT:
+                return "chat";
+            case PROTO_MATCH_START:
+                return "match_start";
+            case PROTO_MATCH_STOP:
+                return "match_stop";
+            case PROTO_MATCH_SUCCESS:
+                return "match_success";
+            default:
+                return "";
+        }
+    }
+
+    //二进制大厅请求转成JSON请求，uid由调用者按会话填写
+    static bool to_json(const proto_msg &msg, Json::Value &req) {
+        switch (msg.type) {
+            case PROTO_PUT_CHESS:
+                req["optype"] = "put_chess";
+                req["room_id"] = (Json::UInt64) msg.room_id;
+                req["row"] = msg.row;
+                req["col"] = msg.col;
+                return true;
+            case PROTO_CHAT:
+                req["optype"] = "chat";
+                req["room_id"] = (Json::UInt64) msg.room_id;
+                req["message"] = std::string(msg.text, msg.text_len);
+                return true;
+            case PROTO_MATCH_START:
+                req["optype"] = "match_start";
+                return true;
+            case PROTO_MATCH_STOP:
+                req["optype"] = "match_stop";
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    //房间的JSON响应转成二进制消息，不认识的optype返回false；text指向rsp内部的字符串，rsp必须比msg活得久
+    static bool from_json(const Json::Value &rsp, proto_msg &msg) {
+        const Json::Value &optype = rsp["optype"];
+        const char *begin, *end;
+        if (optype.isString() == false || optype.getString(&begin, &end) == false) {
+            return false;
+        }
+        size_t len = end - begin;
+        if (len == 9 && memcmp(begin, "put_chess", len) == 0) {
+            msg.type = PROTO_PUT_CHESS;
+        } else if (len == 4 && memcmp(begin, "chat", len) == 0) {
+            msg.type = PROTO_CHAT;
+        } else if (len == 11 && memcmp(begin, "match_start", len) == 0) {
+            msg.type = PROTO_MATCH_START;
+        } else if (len == 10 && memcmp(begin, "match_stop", len) == 0) {
+            msg.type = PROTO_MATCH_STOP;
+        } else if (len == 13 && memcmp(begin, "match_success", len) == 0) {
+            msg.type = PROTO_MATCH_SUCCESS;
+        } else {
+            return false;
+        }
+        //result有布尔值和字符串"true"两种写法
+        const Json::Value &result = rsp["result"];
+        msg.result = result.isBool() ? result.asBool() : (result.isString() && result.asString() == "true");
+        msg.code = PROTO_OK;
+        const Json::Value &reason = rsp["reason"];
+        if (reason.isString() && reason.getString(&begin, &end)) {
+            msg.code = reason_code(begin, end);
+        }
+        const Json::Value &room_id = rsp["room_id"];
+        msg.room_id = room_id.isIntegral() ? room_id.asUInt64() : 0;
+        const Json::Value &uid = rsp["uid"];
+        msg.uid = uid.isIntegral() ? uid.asUInt64() : 0;
+        if (msg.type == PROTO_PUT_CHESS) {
+            const Json::Value &winner = rsp["winner"];
+            msg.winner = winner.isIntegral() ? winner.asUInt64() : 0;
+            msg.row = rsp["row"].asInt();
+            msg.col = rsp["col"].asInt();
+        } else if (msg.type == PROTO_CHAT) {
+            const Json::Value &message = rsp["message"];
+            if (message.isString() && message.getString(&begin, &end)) {
+                msg.text = begin;
+                msg.text_len = end - begin;
+            }
+        }
+        return true;
+    }
+
+    //把JSON响应编码成一对消息，binary为false时只编码JSON
+    static void make_frames(const Json::Value &rsp, const std::string &body, bool binary, proto_frames &frames) {
+        frames.text = ws_util::make_message(body);
+        frames.binary.reset();
+        if (binary) {
+            proto_msg msg;
+            std::string bin;
+            if (from_json(rsp, msg) && encode(msg, bin)) {
+                frames.binary = ws_util::make_message(bin, websocketpp::frame::opcode::binary);
+            } else {
+                //没有二进制格式的消息，仍然按JSON发送
+                frames.binary = frames.text;
+            }
+        }
+    }
+};
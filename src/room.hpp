@@ -1,94 +1,241 @@
 #pragma once
+#include "board.hpp"
 #include "db.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
 #include "online.hpp"
+#include "proto.hpp"
+#include "user_cache.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
-#define BOARD_ROW 15
-#define BOARD_COL 15
-#define CHESS_WHITE 1
-#define CHESS_BLACK 2
-
 //定义房间状态
 typedef enum {
     GAME_START,
     GAME_OVER
 } room_status;
 
-class room {
+#define ROOM_SPECTATOR_LAG_BYTES (64 * 1024)    //观战连接积压超过这个值时跳过增量，追上后补发一次完整棋盘
+#define ROOM_SPECTATOR_DROP_BYTES (1024 * 1024) //积压超过这个值时断开观战连接
+#define ROOM_USER_SHARD_NUM 64                  //用户到房间映射的分片数量，必须是2的幂
+
+//投递给房间的一个请求，只解码一次，房间的整个处理过程都使用msg
+//二进制请求的msg由帧直接解码，聊天内容指向payload中的原始帧，不经过JSON；
+//JSON请求同时保留解析出的json，文本协议的响应在它的基础上填写结果，保留客户端带上的其他字段
+//msg.text可能指向payload或者json内部，所以请求不能复制，只通过room_request_ptr传递
+struct room_request {
+    proto_msg msg;
+    server_t::message_ptr payload;//二进制请求的原始帧
+    Json::Value json;             //JSON请求
+    bool binary;
+
+    room_request() : binary(false) {}
+    room_request(const room_request &) = delete;
+    room_request &operator=(const room_request &) = delete;
+};
+typedef std::shared_ptr<room_request> room_request_ptr;
+
+class room_request_util {
 private:
+    //optype不认识时type为0，房间号和uid仍然要取出来，房间先判断房间号
+    static void from_json(room_request &req) {
+        if (proto_util::from_json(req.json, req.msg) == false) {
+            req.msg.type = 0;
+        }
+        const Json::Value &room_id = req.json["room_id"];
+        req.msg.room_id = room_id.isIntegral() ? room_id.asUInt64() : 0;
+        const Json::Value &uid = req.json["uid"];
+        req.msg.uid = uid.isIntegral() ? uid.asUInt64() : 0;
+    }
+
+public:
+    //解码一条房间消息：二进制帧按二进制协议解码，文本帧按JSON解析，uid以会话为准；格式错误时返回空
+    static room_request_ptr parse(const server_t::message_ptr &frame, uint64_t uid) {
+        room_request_ptr req = std::make_shared<room_request>();
+        const std::string &payload = frame->get_payload();
+        if (frame->get_opcode() == websocketpp::frame::opcode::binary) {
+            if (proto_util::decode(payload.data(), payload.size(), req->msg) == false) {
+                return room_request_ptr();
+            }
+            req->binary = true;
+            req->payload = frame;
+            req->msg.uid = uid;
+            return req;
+        }
+        if (json_util::unserialize(payload, req->json) == false) {
+            return room_request_ptr();
+        }
+        req->json["uid"] = (Json::UInt64) uid;
+        from_json(*req);
+        return req;
+    }
+
+    //已经带有uid的JSON请求
+    static room_request_ptr make(const Json::Value &json) {
+        room_request_ptr req = std::make_shared<room_request>();
+        req->json = json;
+        from_json(*req);
+        return req;
+    }
+};
+
+//房间是一个actor：房间内的所有状态只在自己的strand中读写，下棋、聊天、退出、广播都投递到strand上串行执行
+//不同房间的strand可以同时在不同的io线程上运行，房间之间没有任何共享锁
+//观战者的消息由另一个strand(_fanout)发送，观战人数再多也不会拖慢玩家的下棋请求
+class room : public std::enable_shared_from_this<room> {
+private:
+    //一个观战者，lagging和dropped只在_fanout中读写
+    struct spectator {
+        uint64_t uid;
+        server_t::connection_ptr conn;
+        bool binary; //协商了二进制协议
+        bool lagging;//积压过多，正在跳过增量
+        bool dropped;//积压超过上限，已经断开
+    };
+    typedef std::shared_ptr<spectator> spectator_ptr;
+    typedef std::vector<spectator_ptr> spectator_list;
+
+    //投递给_fanout的房间状态，有观战者需要完整棋盘时才生成快照
+    struct room_view {
+        uint64_t room_id;
+        uint64_t white_id;
+        uint64_t black_id;
+        room_status status;
+        bitboard board;
+    };
+
     uint64_t _room_id;                   //房间id
     room_status _status;                 //房间状态
     int _player_num;                     //房间人数
     uint64_t _white_id;                  //白棋id
     uint64_t _black_id;                  //黑棋id
-    user_table *_user;                   //用户管理
+    user_cache *_users;                  //用户信息缓存，对局结果经它写入
     online_manager *_online_user;        //在线用户管理
-    std::vector<std::vector<int>> _board;//棋盘
+    bitboard _board;                     //棋盘，黑白两个位平面
+    websocketpp::lib::asio::io_service::strand _strand;//房间的串行执行队列
+    websocketpp::lib::asio::io_service::strand _fanout;//观战消息的发送队列，保证每个观战者按顺序收到
+    std::shared_ptr<const spectator_list> _spectators; //观战者列表，在_strand中写时复制，_fanout持有旧列表时不受影响
+    size_t _binary_spectators;                         //使用二进制协议的观战者数量，为0时不需要二进制编码
 
 private:
-    bool five(int row, int col, int row_off, int col_off, int color) {
-        // row和col是棋子位置，row_off和col_off是偏移量，也就是需要检查的方向，color是棋子颜色。
-        int count = 1;                 // 初始化同色棋子数量为1，因为已经有一个棋子在(row, col)的位置上。
-        int search_row = row + row_off;// 计算向指定方向偏移后的行位置。
-        int search_col = col + col_off;// 计算向指定方向偏移后的列位置。
+    //函数返回胜利的颜色,1为白棋,2为黑棋,0为平局
+    uint64_t check_win(int row, int col, int color) {
+        // 从下棋位置的四个不同方向上检测是否出现了5个及以上相同颜色的棋子（横行，纵列，正斜，反斜）
+        if (_board.check_five(row, col, color)) {
+            //任意一个方向上出现了true也就是五星连珠，则设置返回值
+            return color == CHESS_WHITE ? _white_id : _black_id;
+        }
+        return 0;
+    }
 
-        // 当偏移后的位置在棋盘内，并且该位置的棋子颜色与指定颜色相同时，继续偏移。
-        while (search_row >= 0 && search_row < BOARD_ROW &&
-               search_col >= 0 && search_col < BOARD_COL &&
-               _board[search_row][search_col] == color) {
-            count++;// 同色棋子数量加1。
-            // 继续向指定方向偏移。
-            search_row += row_off;
-            search_col += col_off;
+    void count_binary() {
+        _binary_spectators = 0;
+        for (auto &sp: *_spectators) {
+            _binary_spectators += sp->binary;
         }
+    }
 
-        // 更改搜索方向，向相反方向偏移。
-        search_row = row - row_off;
-        search_col = col - col_off;
+    std::shared_ptr<room_view> make_view() {
+        std::shared_ptr<room_view> view = std::make_shared<room_view>();
+        view->room_id = _room_id;
+        view->white_id = _white_id;
+        view->black_id = _black_id;
+        view->status = _status;
+        view->board = _board;
+        return view;
+    }
 
-        // 同样的，当偏移后的位置在棋盘内，并且该位置的棋子颜色与指定颜色相同时，继续偏移。
-        while (search_row >= 0 && search_row < BOARD_ROW &&
-               search_col >= 0 && search_col < BOARD_COL &&
-               _board[search_row][search_col] == color) {
-            count++;// 同色棋子数量加1。
-            // 继续向指定方向偏移。
-            search_row -= row_off;
-            search_col -= col_off;
+    //完整棋盘：新观战者加入时和积压的观战者追上时发送
+    static server_t::message_ptr make_snapshot(const room_view &view, bool binary) {
+        if (binary) {
+            std::string bin;
+            proto_util::encode_snapshot(view.room_id, view.white_id, view.black_id, view.status == GAME_START, view.board, bin);
+            return ws_util::make_message(bin, websocketpp::frame::opcode::binary);
+        }
+        Json::Value rsp;
+        rsp["optype"] = "spectate_snapshot";
+        rsp["result"] = true;
+        rsp["room_id"] = (Json::UInt64) view.room_id;
+        rsp["white_id"] = (Json::UInt64) view.white_id;
+        rsp["black_id"] = (Json::UInt64) view.black_id;
+        rsp["status"] = view.status == GAME_START ? "start" : "over";
+        Json::Value &board = rsp["board"];
+        for (int row = 0; row < BOARD_ROW; row++) {
+            Json::Value line(Json::arrayValue);
+            for (int col = 0; col < BOARD_COL; col++) {
+                line.append(view.board.get(row, col));
+            }
+            board.append(line);
         }
+        return ws_util::make_message(rsp);
+    }
 
-        // 如果同色棋子数量大于等于5，返回true，表示形成五子连线；否则，返回false。
-        return (count >= 5);
+    //在_fanout中执行：同一个已编码的消息发给列表中的每个观战者，frames为空时发送完整棋盘
+    //积压超过LAG的观战者跳过这一步，积压回落后直接发完整棋盘(其中已经包含跳过的所有步)，积压超过DROP的断开
+    static void send_spectators(const spectator_list &list, const proto_frames &frames, const room_view &view) {
+        proto_frames snapshot;
+        for (auto &sp: list) {
+            if (sp->dropped) {
+                continue;
+            }
+            size_t buffered = sp->conn->get_buffered_amount();
+            if (buffered > ROOM_SPECTATOR_DROP_BYTES) {
+                DBG_LOG("房间%lu-观战者%lu积压%zu字节，断开", (unsigned long) view.room_id, (unsigned long) sp->uid, buffered);
+                sp->dropped = true;
+                sp->conn->close(websocketpp::close::status::policy_violation, "spectator too slow");
+                continue;
+            }
+            if (buffered > ROOM_SPECTATOR_LAG_BYTES) {
+                sp->lagging = true;
+                continue;
+            }
+            if (sp->lagging || frames.empty()) {
+                server_t::message_ptr &msg = sp->binary ? snapshot.binary : snapshot.text;
+                if (msg.get() == nullptr) {
+                    msg = make_snapshot(view, sp->binary);
+                }
+                sp->lagging = false;
+                sp->conn->send(msg);
+                continue;
+            }
+            sp->conn->send(frames.select(sp->binary));
+        }
     }
 
-    //函数返回胜利的颜色,1为白棋,2为黑棋,0为平局
-    uint64_t check_win(int row, int col, int color) {
-        // 从下棋位置的四个不同方向上检测是否出现了5个及以上相同颜色的棋子（横行，纵列，正斜，反斜）
-        if (five(row, col, 0, 1, color) ||
-            five(row, col, 1, 0, color) ||
-            five(row, col, -1, 1, color) ||
-            five(row, col, -1, -1, color)) {
-            //任意一个方向上出现了true也就是五星连珠，则设置返回值
-            return color == CHESS_WHITE ? _white_id : _black_id;
+    //把一条消息投递给所有观战者，只在房间的strand中调用
+    //带走当前列表的引用和一份棋盘拷贝(64字节)，发送在_fanout中进行
+    void fanout(const proto_frames &frames) {
+        if (_spectators->empty()) {
+            return;
         }
-        return 0;
+        std::shared_ptr<const spectator_list> list = _spectators;
+        std::shared_ptr<room_view> view = make_view();
+        _fanout.post([list, frames, view]() {
+            send_spectators(*list, frames, *view);
+        });
     }
 
 public:
-    room(uint64_t room_id, user_table *user, online_manager *online_user)
+    room(uint64_t room_id, user_cache *users, online_manager *online_user, websocketpp::lib::asio::io_service *io)
         : _room_id(room_id),
           _status(GAME_START),
           _player_num(0),
-          _user(user),
+          _users(users),
           _online_user(online_user),
-          _board(BOARD_ROW, std::vector<int>(BOARD_COL, 0)) {
-        DBG_LOG("room create:%d", _room_id);
+          _strand(*io),
+          _fanout(*io),
+          _spectators(std::make_shared<spectator_list>()),
+          _binary_spectators(0) {
+        DBG_LOG("room create:%lu", (unsigned long) _room_id);
     }
 
     ~room() {
-        DBG_LOG("room destroy:%d", _room_id);
+        DBG_LOG("room destroy:%lu", (unsigned long) _room_id);
     }
 
     uint64_t get_room_id() {
@@ -121,94 +268,160 @@ public:
         return _black_id;
     }
 
-    //处理下棋动作
-    Json::Value handle_chess(Json::Value &req) {
-        Json::Value json_rsp = req;// 使用请求数据初始化响应数据。
+    //获取棋盘，只能在房间的strand中调用
+    const bitboard &get_board() {
+        return _board;
+    }
+
+    //把任务投递到房间的strand上执行，同一房间的任务按投递顺序串行执行
+    void post(const std::function<void()> &task) {
+        _strand.post(task);
+    }
+
+    //投递一个房间请求，下面的handle_*函数都只能在房间的strand中调用
+    void post_request(const room_request_ptr &req) {
+        std::shared_ptr<room> self = shared_from_this();
+        _strand.post([self, req]() {
+            self->handle_request(*req);
+        });
+    }
+
+    void post_request(const Json::Value &req) {
+        post_request(room_request_util::make(req));
+    }
+
+    //观战者加入，只能在房间的strand中调用：先收到一次完整棋盘，之后收到每一步的增量
+    void add_spectator(uint64_t uid, const server_t::connection_ptr &conn) {
+        std::shared_ptr<spectator_list> list = std::make_shared<spectator_list>();
+        list->reserve(_spectators->size() + 1);
+        for (auto &sp: *_spectators) {
+            if (sp->uid != uid) {
+                list->push_back(sp);
+            }
+        }
+        spectator_ptr sp(new spectator{uid, conn, proto_util::is_binary(conn), false, false});
+        list->push_back(sp);
+        _spectators = list;
+        count_binary();
+        std::shared_ptr<room_view> view = make_view();
+        _fanout.post([sp, view]() {
+            send_spectators(spectator_list(1, sp), proto_frames(), *view);
+        });
+    }
+
+    //观战者离开，只能在房间的strand中调用
+    void remove_spectator(uint64_t uid) {
+        std::shared_ptr<spectator_list> list = std::make_shared<spectator_list>();
+        list->reserve(_spectators->size());
+        for (auto &sp: *_spectators) {
+            if (sp->uid != uid) {
+                list->push_back(sp);
+            }
+        }
+        if (list->size() != _spectators->size()) {
+            _spectators = list;
+            count_binary();
+        }
+    }
+
+    size_t get_spectator_num() {
+        return _spectators->size();
+    }
+
+    //一次查找得到两个玩家的在线记录，下棋时的掉线判断和广播共用，不在线时记录为空
+    void get_players(online_user &white, online_user &black) {
+        _online_user->get_user(_white_id, white);
+        _online_user->get_user(_black_id, black);
+    }
+
+    //处理下棋动作，white、black为本次请求开始时取得的玩家在线记录
+    //结果写入rsp(已经用请求初始化)，返回JSON协议中的reason，没有时返回nullptr
+    const char *handle_chess(proto_msg &rsp, const online_user &white, const online_user &black) {
         // 1. 判断房间中两个玩家是否都在线，任意一个不在线，就是另一方胜利。
-        if (_online_user->is_in_game_room(_white_id) == false) {
-            json_rsp["result"] = "true";                        // 结果设为true，表示有玩家获胜。
-            json_rsp["reason"] = "white is offline , black win";// 原因设为"白方离线，黑方胜利"。
-            json_rsp["winner"] = (Json::UInt64) _black_id;      // 获胜方设为黑方。
-            return json_rsp;                                    // 返回响应数据。
+        if (white.in_room == false) {
+            rsp.result = true;                     // 结果设为true，表示有玩家获胜。
+            rsp.code = PROTO_OFFLINE;
+            rsp.winner = _black_id;                // 获胜方设为黑方。
+            return "white is offline , black win"; // 原因设为"白方离线，黑方胜利"。
         }
 
-        if (_online_user->is_in_game_room(_black_id) == false) {
-            json_rsp["result"] = "true";                        // 结果设为true，表示有玩家获胜。
-            json_rsp["reason"] = "black is offline , white win";// 原因设为"黑方离线，白方胜利"。
-            json_rsp["winner"] = (Json::UInt64) _white_id;      // 获胜方设为白方。
-            return json_rsp;                                    // 返回响应数据。
+        if (black.in_room == false) {
+            rsp.result = true;                     // 结果设为true，表示有玩家获胜。
+            rsp.code = PROTO_OFFLINE;
+            rsp.winner = _white_id;                // 获胜方设为白方。
+            return "black is offline , white win"; // 原因设为"黑方离线，白方胜利"。
         }
 
         // 2. 获取走棋位置，判断当前走棋是否合理(位置是否被占用)
-        int chess_row = req["row"].asInt();             // 获取棋子行位置。
-        int chess_col = req["col"].asInt();             // 获取棋子列位置。
-        if (_board[chess_row][chess_col] != 0) {        // 如果指定位置已经有棋子，则走棋不合理。
-            json_rsp["result"] = false;                 // 结果设为false，表示走棋不合理。
-            json_rsp["reason"] = "position is occupied";// 原因设为"位置被占用"。
-            return json_rsp;                            // 返回响应数据。
+        int chess_row = rsp.row;             // 获取棋子行位置。
+        int chess_col = rsp.col;             // 获取棋子列位置。
+        if (bitboard::in_range(chess_row, chess_col) == false) {
+            rsp.code = PROTO_OUT_OF_RANGE;
+            return "position is out of range";
+        }
+        if (_board.get(chess_row, chess_col) != 0) { // 如果指定位置已经有棋子，则走棋不合理。
+            rsp.code = PROTO_OCCUPIED;
+            return "position is occupied";           // 原因设为"位置被占用"。
         }
 
         // 3. 获取当前用户的id和颜色，进行落子
-        uint64_t cur_uid = req["uid"].asUInt64();                        // 获取当前用户id。
+        uint64_t cur_uid = rsp.uid;                                      // 获取当前用户id。
         int cur_color = cur_uid == _white_id ? CHESS_WHITE : CHESS_BLACK;// 判断当前用户颜色。
-        _board[chess_row][chess_col] = cur_color;                        // 在指定位置落子。
+        _board.put(chess_row, chess_col, cur_color);                     // 在指定位置落子。
+        static metrics_counter &moves = metrics_registry::instance().counter("gobang_moves_total", "成功的落子数");
+        moves.inc();
 
         // 4. 判断是否有玩家胜利（从当前走棋位置开始判断是否存在五星连珠）
-        uint64_t winner_id = check_win(chess_row, chess_col, cur_color);
-        if (winner_id != 0) {
-            json_rsp["reason"] = "five in a row";// 原因设为"五星连珠"
-        }
-        json_rsp["result"] = "true";                  // 结果设为true，表示有玩家获胜。
-        json_rsp["winner"] = (Json::UInt64) winner_id;// 获胜方设为获胜者。
-        return json_rsp;
-    }
-
-    // 处理聊天动作
-    Json::Value handle_chat(Json::Value &req) {
-        // 定义响应的Json对象
-        Json::Value json_rsp = req;
-        // 获取请求中的消息
-        std::string msg = req["message"].asString();
-        // 搜索是否存在敏感词
-        size_t pos = msg.find("垃圾");
-        if (pos != std::string::npos) {
+        rsp.result = true;
+        rsp.winner = check_win(chess_row, chess_col, cur_color);
+        if (rsp.winner != 0) {
+            rsp.code = PROTO_FIVE;
+            return "five in a row";// 原因设为"五星连珠"
+        }
+        return nullptr;
+    }
+
+    // 处理聊天动作，结果写入rsp，返回JSON协议中的reason
+    const char *handle_chat(proto_msg &rsp) {
+        // 搜索是否存在敏感词，直接在请求的缓冲区中查找，不复制消息
+        static const std::string word = "垃圾";
+        const char *end = rsp.text + rsp.text_len;
+        if (rsp.text_len != 0 && std::search(rsp.text, end, word.begin(), word.end()) != end) {
             // 如果存在敏感词，则标记结果为false，添加不合适的原因
-            json_rsp["result"] = false;
-            json_rsp["reason"] = "消息中包含敏感词";
-            return json_rsp;
+            rsp.code = PROTO_SENSITIVE;
+            return "消息中包含敏感词";
         }
         // 如果不存在敏感词，则标记结果为true
-        json_rsp["result"] = true;
-
-        return json_rsp;
+        rsp.result = true;
+        return nullptr;
     }
 
     // 处理玩家退出房间
     void handle_exit(uint64_t uid) {
-        // 定义响应的Json对象
-        Json::Value json_rsp;
         // 如果游戏已经开始，且玩家退出
         if (_status == GAME_START) {
             // 确定赢家的id，如果退出的是白棋玩家，那么黑棋玩家就是赢家，反之亦然
-            uint64_t winner_id = (Json::UInt64)(uid == _white_id ? _black_id : _white_id);
-            // 设置响应的各项参数
-            json_rsp["optype"] = "put_chess";
-            json_rsp["result"] = "true";
-            json_rsp["reason"] = "对方掉线";
-            json_rsp["room_id"] = (Json::UInt64) _room_id;
-            json_rsp["uid"] = (Json::UInt64) uid;
-            json_rsp["row"] = -1;
-            json_rsp["col"] = -1;
-            json_rsp["winner"] = (Json::UInt64) winner_id;
+            uint64_t winner_id = uid == _white_id ? _black_id : _white_id;
+            // 设置响应的各项参数，按一步row、col为-1的落子广播
+            proto_msg rsp;
+            rsp.type = PROTO_PUT_CHESS;
+            rsp.result = true;
+            rsp.code = PROTO_OFFLINE;
+            rsp.room_id = _room_id;
+            rsp.uid = uid;
+            rsp.row = -1;
+            rsp.col = -1;
+            rsp.winner = winner_id;
             // 确定输家的id，如果赢家是白棋玩家，那么黑棋玩家就是输家，反之亦然
-            uint64_t loser_id = (Json::UInt64)(winner_id == _white_id ? _black_id : _white_id);
-            // 更新用户数据库的输赢信息
-            _user->win(winner_id);
-            _user->lose(loser_id);
+            uint64_t loser_id = winner_id == _white_id ? _black_id : _white_id;
+            // 提交输赢结果，由后台线程批量写入数据库
+            _users->record_result(winner_id, loser_id);
             // 更改游戏状态为结束
             _status = GAME_OVER;
-            // 广播响应
-            broadcast(json_rsp);
+            // 广播响应，观战者同样收到对局结束
+            online_user white, black;
+            get_players(white, black);
+            fanout(broadcast(nullptr, rsp, "对方掉线", white, black));
         }
         // 房间内玩家数量减一
         _player_num--;
@@ -216,86 +429,146 @@ public:
         return;
     }
 
-    void broadcast(Json::Value &rsp) {
-        //1. 首先，对要响应的信息进行序列化操作，将Json::Value类型的数据转换成json格式的字符串
-        std::string body;
-        json_util::serialize(rsp, body);
+    //文本协议的响应：JSON请求在请求的基础上填写结果，二进制请求和退出按响应的字段生成
+    //下棋成功的result沿用原来的字符串"true"，其他为布尔值
+    static void make_json(const Json::Value *req, const proto_msg &rsp, const char *reason, Json::Value &out) {
+        const char *optype = proto_util::type_name(rsp.type);
+        if (rsp.code == PROTO_ROOM_MISMATCH || rsp.code == PROTO_UNKNOWN_TYPE) {
+            out["optype"] = req != nullptr ? (*req)["optype"].asString() : std::string(optype);
+            out["result"] = false;
+            out["reason"] = reason;
+            return;
+        }
+        if (req != nullptr) {
+            out = *req;
+        } else {
+            out["optype"] = optype;
+            out["room_id"] = (Json::UInt64) rsp.room_id;
+            out["uid"] = (Json::UInt64) rsp.uid;
+            if (rsp.type == PROTO_PUT_CHESS) {
+                out["row"] = rsp.row;
+                out["col"] = rsp.col;
+            } else {
+                out["message"] = std::string(rsp.text, rsp.text_len);
+            }
+        }
+        if (rsp.type == PROTO_PUT_CHESS && rsp.result) {
+            out["result"] = "true";
+            out["winner"] = (Json::UInt64) rsp.winner;
+        } else {
+            out["result"] = rsp.result;
+        }
+        if (reason != nullptr) {
+            out["reason"] = reason;
+        }
+    }
+
+    //响应按接收者需要的协议编码，每种只编码一次，两个玩家和观战者共享同一个消息缓冲区，返回编码好的消息供观战者复用
+    //二进制直接由rsp编码；只有玩家或者观战者中有人使用文本协议时才生成JSON并序列化
+    //req为JSON请求本身，二进制请求和退出时为nullptr
+    proto_frames broadcast(const Json::Value *req, const proto_msg &rsp, const char *reason,
+                           const online_user &white, const online_user &black) {
+        //1. 首先，从玩家的在线记录中取出房间连接，统计需要哪些协议
+        const server_t::connection_ptr &wconn = white.room;
+        const server_t::connection_ptr &bconn = black.room;
+        bool wbin = wconn.get() != nullptr && proto_util::is_binary(wconn);
+        bool bbin = bconn.get() != nullptr && proto_util::is_binary(bconn);
+        bool need_binary = wbin || bbin || _binary_spectators != 0;
+        bool need_text = (wconn.get() != nullptr && wbin == false) || (bconn.get() != nullptr && bbin == false) ||
+                         _spectators->size() > _binary_spectators;
+
+        //2. 然后，编码成websocket消息；没有二进制格式的消息(如过长的聊天)对二进制连接也发送JSON
+        proto_frames frames;
+        if (need_binary) {
+            std::string bin;
+            if (proto_util::encode(rsp, bin)) {
+                frames.binary = ws_util::make_message(bin, websocketpp::frame::opcode::binary);
+            } else {
+                need_text = true;
+            }
+        }
+        if (need_text) {
+            Json::Value json;
+            make_json(req, rsp, reason, json);
+            std::string body;
+            json_util::serialize(json, body);
+            //每一步棋都会广播，限制日志量
+            LOG_RATE(DBG, 10, "房间-广播动作:%s", body.c_str());
+            frames.text = ws_util::make_message(body);
+            if (need_binary && frames.binary.get() == nullptr) {
+                frames.binary = frames.text;
+            }
+        }
 
-        //2. 然后，从在线用户中获取房间中白棋玩家的通信连接
-        server_t::connection_ptr wconn = _online_user->get_conn_from_room(_white_id);
         // 检查获取到的白棋玩家的连接是否为空，如果不为空，则向白棋玩家发送广播消息
         if (wconn.get() != nullptr) {
-            wconn->send(body);
+            wconn->send(frames.select(wbin));
         } else {
             // 如果白棋玩家的连接为空，则打印错误日志
             DBG_LOG("房间-白棋玩家连接获取失败");
         }
 
-        //3. 从在线用户中获取房间中黑棋玩家的通信连接
-        server_t::connection_ptr bconn = _online_user->get_conn_from_room(_black_id);
-        // 检查获取到的黑棋玩家的连接是否为空，如果不为空，则向黑棋玩家发送广播消息
+        //3. 检查获取到的黑棋玩家的连接是否为空，如果不为空，则向黑棋玩家发送广播消息
         if (bconn.get() != nullptr) {
-            bconn->send(body);
+            bconn->send(frames.select(bbin));
         } else {
             // 如果黑棋玩家的连接为空，则打印错误日志
             DBG_LOG("房间-黑棋玩家连接获取失败");
         }
-        return;
+        return frames;
     }
 
     //总的请求处理函数，在函数内部，区分请求类型，根据不同的请求调用不同的处理函数，得到响应进行广播
-    void handle_request(Json::Value &req) {
-        // 初始化响应的json对象
-        Json::Value json_rsp;
-        // 从请求中取出房间号
-        uint64_t room_id = req["room_id"].asUInt64();
+    void handle_request(room_request &req) {
+        static metrics_histogram &latency = metrics_registry::instance().histogram("gobang_room_request_seconds", "房间内请求(落子、聊天)在strand上的处理耗时");
+        metrics_timer timer(latency);
+        // 每个玩家只查找一次在线记录，掉线判断和广播都用它
+        online_user white, black;
+        get_players(white, black);
+        // 响应以请求初始化，结果字段由处理函数填写
+        proto_msg rsp = req.msg;
+        rsp.result = false;
+        rsp.code = PROTO_OK;
+        rsp.winner = 0;
+        const char *reason = nullptr;
+        const Json::Value *json = req.binary ? nullptr : &req.json;
 
         // 如果请求的房间号与当前房间号不匹配
-        if (room_id != _room_id) {
-            // 设置响应的操作类型为请求的操作类型
-            json_rsp["optype"] = req["optype"].asString();
-            // 设置响应结果为失败
-            json_rsp["result"] = false;
-            // 设置失败原因为"房间号不匹配"
-            json_rsp["reason"] = "房间号不匹配！";
-            // 广播响应结果并返回
-            return broadcast(json_rsp);
+        if (rsp.room_id != _room_id) {
+            // 设置失败原因为"房间号不匹配"，广播响应结果并返回
+            rsp.code = PROTO_ROOM_MISMATCH;
+            broadcast(json, rsp, "房间号不匹配！", white, black);
+            return;
         }
 
         // 根据请求类型调用不同的处理函数
-        if (req["optype"].asString() == "put_chess") {
+        if (rsp.type == PROTO_PUT_CHESS) {
             // 如果请求类型为"put_chess"，调用下棋处理函数
-            json_rsp = handle_chess(req);
+            reason = handle_chess(rsp, white, black);
             // 如果有胜利者
-            if (json_rsp["winner"].asUInt64() != 0) {
+            if (rsp.winner != 0) {
                 // 获取胜利者和失败者的id
-                uint64_t winner_id = json_rsp["winner"].asUInt64();
-                uint64_t loser_id = winner_id == _white_id ? _black_id : _white_id;
-                // 更新胜利者和失败者的状态
-                _user->win(winner_id);
-                _user->lose(loser_id);
+                uint64_t loser_id = rsp.winner == _white_id ? _black_id : _white_id;
+                // 提交胜利者和失败者的结果，不在房间strand上等待数据库
+                _users->record_result(rsp.winner, loser_id);
 
                 // 设置游戏状态为"游戏结束"
                 _status = GAME_OVER;
             }
-        } else if (req["optype"].asString() == "chat") {
+        } else if (rsp.type == PROTO_CHAT) {
             // 如果请求类型为"chat"，调用聊天处理函数
-            json_rsp = handle_chat(req);
+            reason = handle_chat(rsp);
         } else {
-            // 如果请求类型未知，设置响应的操作类型为请求的操作类型
-            json_rsp["optype"] = req["optype"].asString();
-            // 设置响应结果为失败
-            json_rsp["result"] = false;
-            // 设置失败原因为"未知请求类型"
-            json_rsp["reason"] = "未知请求类型";
-        }
-        // 将响应结果序列化为字符串
-        std::string body;
-        json_util::serialize(json_rsp, body);
-        // 打印广播动作的日志
-        DBG_LOG("房间-广播动作:%s", body.c_str());
-        // 广播响应结果
-        return broadcast(json_rsp);
+            // 如果请求类型未知，设置失败原因为"未知请求类型"
+            rsp.code = PROTO_UNKNOWN_TYPE;
+            reason = "未知请求类型";
+        }
+        // 广播响应结果，编码和日志都在broadcast中完成
+        proto_frames frames = broadcast(json, rsp, reason, white, black);
+        // 成功的落子和聊天作为增量发给观战者，失败的请求只有玩家需要知道
+        if (rsp.result) {
+            fanout(frames);
+        }
     }
 };
 
@@ -303,16 +576,58 @@ public:
 using room_ptr = std::shared_ptr<room>;
 class room_manager {
 private:
-    std::mutex _mutex;                               //互斥锁
+    //用户ID到所在房间的映射按用户ID分片，每步棋查找房间只锁一个分片，不经过_mutex
+    struct alignas(64) user_shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, room_ptr> rooms;
+    };
+
+    std::mutex _mutex;                               //互斥锁，保护房间ID分配、_room和_spectating
     uint64_t _room_id;                               //房间ID分配
-    user_table *_user;                               //数据库用户管理
+    websocketpp::lib::asio::io_service *_io;         //房间strand所在的io_service
+    user_cache *_users;                              //用户信息缓存
     online_manager *_online_user;                    //在线用户管理
     std::unordered_map<uint64_t, room_ptr> _room;    //建立起房间ID与房间信息的映射关系
-    std::unordered_map<uint64_t, uint64_t> _room_ids;//先通过用户ID找到所在房间ID，再去查找房间信息
+    std::unordered_map<uint64_t, uint64_t> _spectating;//观战者的用户ID到所观看房间ID的映射
+    user_shard _user_rooms[ROOM_USER_SHARD_NUM];     //用户ID -> 所在房间
+
+    user_shard &get_shard(uint64_t uid) {
+        return _user_rooms[(uid * 0x9E3779B97F4A7C15ULL) >> 32 & (ROOM_USER_SHARD_NUM - 1)];
+    }
+
+    void set_user_room(uint64_t uid, const room_ptr &rp) {
+        user_shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        sd.rooms[uid] = rp;
+    }
+
+    //只删除仍然指向这个房间的映射，用户已经进入新房间时保留
+    void erase_user_room(uint64_t uid, const room_ptr &rp) {
+        user_shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.rooms.find(uid);
+        if (it != sd.rooms.end() && it->second == rp) {
+            sd.rooms.erase(it);
+        }
+    }
+
+    //创建房间并管理起来，调用者持有_mutex
+    room_ptr new_room(uint64_t uid1, uint64_t uid2) {
+        room_ptr rp(new room(_room_id, _users, _online_user, _io));
+        rp->add_white_user(uid1);
+        rp->add_black_user(uid2);
+
+        //将房间信息管理起来
+        _room.insert(std::make_pair(_room_id, rp));
+        set_user_room(uid1, rp);
+        set_user_room(uid2, rp);
+        _room_id++;
+        return rp;
+    }
 
 public:
-    room_manager(user_table *user, online_manager *online_user)
-        : _room_id(1), _user(user), _online_user(online_user) {
+    room_manager(user_cache *users, online_manager *online_user, websocketpp::lib::asio::io_service *io)
+        : _room_id(1), _io(io), _users(users), _online_user(online_user) {
         DBG_LOG("房间管理模块初始化完毕");
     }
 
@@ -324,35 +639,36 @@ public:
     room_ptr create_room(uint64_t uid1, uint64_t uid2) {
         //两个用户在游戏大厅中进行对战匹配，匹配成功后创建房间
         //1.校验两个用户是否都还在游戏大厅中，只有都在才需要创建房间。
-        if (_online_user->is_in_game_room(uid1) == false) {
+        if (_online_user->is_in_game_hall(uid1) == false) {
             DBG_LOG("用户：%lu 不在大厅中，创建房间失败!", uid1);
             return room_ptr();
         }
 
-        if (_online_user->is_in_game_room(uid2) == false) {
+        if (_online_user->is_in_game_hall(uid2) == false) {
             DBG_LOG("用户：%lu 不在大厅中，创建房间失败!", uid2);
             return room_ptr();
         }
 
         //2.创建房间，将用户信息添加到房间中
         std::unique_lock<std::mutex> lock(_mutex);
-        room_ptr rp(new room(_room_id, _user, _online_user));
-        rp->add_white_user(uid1);
-        rp->add_black_user(uid2);
-
-        //3.将房间信息管理起来
-        _room.insert(std::make_pair(_room_id, rp));
-        _room_id++;
-        _room_ids.insert(std::make_pair(uid1, _room_id));
-        _room_ids.insert(std::make_pair(uid2, _room_id));
+        return new_room(uid1, uid2);
+    }
 
-        //4.返回房间信息
-        return rp;
+    //批量创建房间：为pairs中的每一对用户创建一个房间，rooms[i]对应pairs[i]
+    //调用者已经用get_user确认两个用户都在大厅中(匹配模块同时取得了大厅连接)，这里不再逐个查询在线状态
+    //整批只加一次锁，匹配模块每个周期把这一批匹配结果一次性建好房间
+    void create_rooms(const std::vector<std::pair<uint64_t, uint64_t>> &pairs, std::vector<room_ptr> &rooms) {
+        rooms.clear();
+        rooms.reserve(pairs.size());
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (auto &pair: pairs) {
+            rooms.push_back(new_room(pair.first, pair.second));
+        }
     }
 
     //加锁操作确保了在查找和返回_room中指定元素的操作是原子的，即在这个操作过程中不会被其他线程打断。这可以避免在找到元素后但还没来得及返回时，其他线程修改了该元素或者从_room中删除了该元素，导致返回了一个无效的引用。
     room_ptr get_room_by_rid(uint64_t rid) {
-        std::unique_lock<std::mutex> _mutex;
+        std::unique_lock<std::mutex> lock(_mutex);
         auto it = _room.find(rid);
         if (it == _room.end()) {
             return room_ptr();
@@ -361,20 +677,61 @@ public:
         return it->second;
     }
 
+    //每个房间请求都要调用，只锁用户所在的分片
     room_ptr get_room_by_uid(uint64_t uid) {
-        std::unique_lock<std::mutex> _mutex;
-        auto it = _room_ids.find(uid);
-        if (it == _room_ids.end()) {
+        user_shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        auto it = sd.rooms.find(uid);
+        if (it == sd.rooms.end()) {
             return room_ptr();
         }
+        return it->second;
+    }
 
-        uint64_t rid = it->second;
-        auto rit = _room.find(rid);
-        if (rit == _room.end()) {
-            return room_ptr();
+    //观战：把连接加入房间的观战者列表，房间不存在时返回false；一个用户同时只观看一个房间，换房间时先离开原来的
+    bool add_spectator(uint64_t rid, uint64_t uid, const server_t::connection_ptr &conn) {
+        room_ptr rp, old;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _room.find(rid);
+            if (it == _room.end()) {
+                return false;
+            }
+            rp = it->second;
+            auto sit = _spectating.find(uid);
+            if (sit != _spectating.end() && sit->second != rid) {
+                auto oit = _room.find(sit->second);
+                if (oit != _room.end()) {
+                    old = oit->second;
+                }
+            }
+            _spectating[uid] = rid;
+        }
+        if (old.get() != nullptr) {
+            old->post([old, uid]() { old->remove_spectator(uid); });
         }
+        rp->post([rp, uid, conn]() { rp->add_spectator(uid, conn); });
+        return true;
+    }
 
-        return rit->second;
+    //观战者离开或者断开连接
+    void remove_spectator(uint64_t uid) {
+        room_ptr rp;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto sit = _spectating.find(uid);
+            if (sit == _spectating.end()) {
+                return;
+            }
+            auto it = _room.find(sit->second);
+            if (it != _room.end()) {
+                rp = it->second;
+            }
+            _spectating.erase(sit);
+        }
+        if (rp.get() != nullptr) {
+            rp->post([rp, uid]() { rp->remove_spectator(uid); });
+        }
     }
 
     //通过房间ID销毁房间
@@ -391,25 +748,34 @@ public:
         uint64_t uid1 = rp->get_white_id();
         uint64_t uid2 = rp->get_black_id();
         //3. 移除房间管理中的用户信息
-        std::unique_lock<std::mutex> lock(_mutex);
-        _room_ids.erase(uid1);
-        _room_ids.erase(uid2);
+        erase_user_room(uid1, rp);
+        erase_user_room(uid2, rp);
         //4. 移除房间管理信息
+        std::unique_lock<std::mutex> lock(_mutex);
         _room.erase(rid);
     }
 
+    //当前的房间数
+    size_t get_room_num() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _room.size();
+    }
+
     void remove_room_user(uint64_t uid) {
         room_ptr rp = get_room_by_uid(uid);
         if (rp.get() == nullptr) {
             return;
         }
 
-        //处理房间中玩家退出动作
-        rp->handle_exit(uid);
-        //房间中没有玩家了，则销毁房间
-        if (rp->get_player_num() == 0) {
-            remove_room(rp->get_room_id());
-        }
+        //退出动作和房间人数的判断都要在房间的strand中执行，与房间内尚未处理完的请求保持先后顺序
+        rp->post([this, rp, uid]() {
+            //处理房间中玩家退出动作
+            rp->handle_exit(uid);
+            //房间中没有玩家了，则销毁房间
+            if (rp->get_player_num() == 0) {
+                remove_room(rp->get_room_id());
+            }
+        });
         return;
     }
 };
\ No newline at end of file
@@ -0,0 +1,332 @@
+#pragma once
+#include "db.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define SCORE_BATCH_SIZE 512           //攒够这么多条对局结果立即写库
+#define SCORE_FLUSH_MS 100             //最长攒这么久写一次库
+#define SCORE_STEP 30                  //每局胜者加、败者减的天梯分
+#define SCORE_JOURNAL_COMPACT (1 << 20)//日志超过1MB时压缩，只保留还没有落库的结果
+#define SCORE_SEQ_RETRY 10             //启动时读取已落库序号的最大尝试次数，都失败时拒绝启动
+#define SCORE_SEQ_BACKOFF_MS 5000      //读取失败后重试的最长间隔，从SCORE_FLUSH_MS开始每次翻倍
+
+//写入日志文件的一条对局结果
+struct score_record {
+    uint64_t seq;   //单调递增的序号，数据库中记录已经落库的最大序号，用于崩溃后去重
+    uint64_t winner;
+    uint64_t loser;
+};
+
+//天梯分异步批量写入：对局结束时只把结果追加到日志文件和内存队列，立即返回
+//后台线程把一批结果按用户合并，在一个事务中用一条多行update写库，并记录这一批的最大序号
+//内存中保存尚未落库的分数变化，查询用户信息时叠加上去，对外表现为立即生效
+//正在写库的一批中的用户，落库和从内存视图中扣除之间数据库与内存会重复计算，查询这些用户时等这一批结束
+//正常退出时写完队列；进程崩溃后重启，从日志中重放序号大于数据库记录的结果，日志默认使用存储给出的路径
+//队列为空时清空日志，持续有对局时队列不会空，日志超过SCORE_JOURNAL_COMPACT后把队列中的结果写入新文件替换，日志大小有上限
+class score_writer {
+private:
+    //正在查询数据库的用户，touched为查询期间开始写库的批次中包含这个用户的次数
+    struct reading {
+        int readers;
+        uint64_t touched;
+    };
+
+    user_store *_ut;
+    std::string _path;
+    int _fd;                                           //日志文件
+    size_t _journal_size;                              //日志文件的字节数
+    uint64_t _seq;                                     //最近分配的序号
+    std::vector<score_record> _queue;                  //等待写库的结果
+    std::unordered_map<uint64_t, score_delta> _pending;//尚未落库的分数变化，包括正在写库的一批
+    std::unordered_set<uint64_t> _inflight;            //正在写库的一批中的用户
+    std::unordered_map<uint64_t, reading> _reading;    //正在查询数据库的用户
+    bool _running;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::condition_variable _flushed;                  //一批写库结束，_inflight清空
+    std::thread _thread;
+
+    static void add_result(std::unordered_map<uint64_t, score_delta> &deltas, const score_record &rec) {
+        score_delta &w = deltas[rec.winner];
+        w.uid = rec.winner;
+        w.score += SCORE_STEP;
+        w.total_count += 1;
+        w.win_count += 1;
+        score_delta &l = deltas[rec.loser];
+        l.uid = rec.loser;
+        l.score -= SCORE_STEP;
+        l.total_count += 1;
+    }
+
+    //读取已经落库的最大序号，失败时退避重试
+    //不能当作0继续：重放会把已经落库的结果再写一次，新结果的序号也会小于数据库记录的序号，崩溃后重放时被当作已落库丢弃
+    uint64_t load_committed() {
+        uint64_t committed = 0;
+        int64_t backoff = SCORE_FLUSH_MS;
+        for (int i = 1; i <= SCORE_SEQ_RETRY; i++) {
+            if (_ut->get_score_seq(committed)) {
+                return committed;
+            }
+            ERR_LOG("read score seq failed(%d/%d)", i, SCORE_SEQ_RETRY);
+            if (i < SCORE_SEQ_RETRY) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
+                backoff = std::min<int64_t>(backoff * 2, SCORE_SEQ_BACKOFF_MS);
+            }
+        }
+        ERR_LOG("read score seq failed, refuse to start");
+        abort();
+    }
+
+    //读取日志，把数据库中还没有的结果重新放入队列；_seq已经是数据库记录的序号
+    void replay() {
+        uint64_t committed = _seq;
+        std::vector<score_record> buf(1024);
+        size_t replayed = 0;
+        ssize_t n;
+        //崩溃时最后一条记录可能只写了一半，丢弃不完整的记录
+        while ((n = read(_fd, buf.data(), buf.size() * sizeof(score_record))) >= (ssize_t) sizeof(score_record)) {
+            for (size_t i = 0; i < n / sizeof(score_record); i++) {
+                const score_record &rec = buf[i];
+                if (rec.seq > _seq) {
+                    _seq = rec.seq;
+                }
+                if (rec.seq <= committed) {
+                    continue;
+                }
+                _queue.push_back(rec);
+                add_result(_pending, rec);
+                replayed++;
+            }
+            _journal_size += n;
+        }
+        if (replayed != 0) {
+            DBG_LOG("score journal replay:%zu results", replayed);
+        }
+        //去掉已经落库的记录和不完整的尾部，之后追加的记录从对齐的位置开始
+        if (_journal_size != 0 || n > 0) {
+            compact();
+        }
+    }
+
+    //把队列中的结果写入新文件并落盘，再替换原来的日志，任何时刻崩溃磁盘上的日志都包含所有没有落库的结果
+    //调用者持有锁(或者后台线程还没有启动)，期间提交的结果等待替换完成
+    bool compact() {
+        std::string tmp = _path + ".tmp";
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+            ERR_LOG("open score journal %s failed", tmp.c_str());
+            return false;
+        }
+        size_t bytes = _queue.size() * sizeof(score_record);
+        if ((bytes != 0 && write(fd, _queue.data(), bytes) != (ssize_t) bytes) || fdatasync(fd) != 0 ||
+            rename(tmp.c_str(), _path.c_str()) != 0) {
+            ERR_LOG("compact score journal failed");
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        close(_fd);
+        _fd = fd;
+        _journal_size = bytes;
+        return true;
+    }
+
+    void writer_entry() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cond.wait_for(lock, std::chrono::milliseconds(SCORE_FLUSH_MS), [this]() {
+                return _running == false || _queue.size() >= SCORE_BATCH_SIZE;
+            });
+            if (_queue.empty()) {
+                if (_running == false) {
+                    break;
+                }
+                continue;
+            }
+            std::vector<score_record> batch;
+            batch.swap(_queue);
+            std::unordered_map<uint64_t, score_delta> merged;
+            uint64_t max_seq = merge(batch, merged);
+            //标记这一批的用户，正在查询这些用户的线程需要重新查询
+            for (auto &it: merged) {
+                _inflight.insert(it.first);
+                auto rit = _reading.find(it.first);
+                if (rit != _reading.end()) {
+                    rit->second.touched++;
+                }
+            }
+            lock.unlock();
+            bool ok = flush(merged, max_seq);
+            lock.lock();
+            _inflight.clear();
+            _flushed.notify_all();
+            if (ok == false) {
+                //写库失败，放回队列头部等下次重试；退出时也不丢弃，日志中还有记录，重启后会重放
+                batch.insert(batch.end(), _queue.begin(), _queue.end());
+                _queue.swap(batch);
+                if (_running == false) {
+                    break;
+                }
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(SCORE_FLUSH_MS));
+                lock.lock();
+                continue;
+            }
+            //已经落库的变化从内存视图中扣除
+            for (auto &rec: batch) {
+                undo_pending(rec.winner, SCORE_STEP, 1);
+                undo_pending(rec.loser, -SCORE_STEP, 0);
+            }
+            //所有结果都已落库，日志可以清空；还有结果在排队时，日志过大才压缩
+            if (_queue.empty()) {
+                if (ftruncate(_fd, 0) != 0) {
+                    ERR_LOG("truncate score journal failed");
+                } else {
+                    _journal_size = 0;
+                }
+            } else if (_journal_size >= SCORE_JOURNAL_COMPACT) {
+                compact();
+            }
+        }
+    }
+
+    void undo_pending(uint64_t uid, int64_t score, int32_t win) {
+        auto it = _pending.find(uid);
+        if (it == _pending.end()) {
+            return;
+        }
+        it->second.score -= score;
+        it->second.total_count -= 1;
+        it->second.win_count -= win;
+        if (it->second.total_count == 0) {
+            _pending.erase(it);
+        }
+    }
+
+    //按用户合并一批结果，返回这一批的最大序号
+    static uint64_t merge(const std::vector<score_record> &batch, std::unordered_map<uint64_t, score_delta> &merged) {
+        uint64_t max_seq = 0;
+        for (auto &rec: batch) {
+            add_result(merged, rec);
+            if (rec.seq > max_seq) {
+                max_seq = rec.seq;
+            }
+        }
+        return max_seq;
+    }
+
+    //写库前先把日志刷到磁盘
+    bool flush(const std::unordered_map<uint64_t, score_delta> &merged, uint64_t max_seq) {
+        if (fdatasync(_fd) != 0) {
+            ERR_LOG("sync score journal failed");
+        }
+        std::vector<score_delta> deltas;
+        deltas.reserve(merged.size());
+        for (auto &it: merged) {
+            deltas.push_back(it.second);
+        }
+        return _ut->apply_scores(deltas, max_seq);
+    }
+
+public:
+    score_writer(user_store *ut) : score_writer(ut, ut->journal_path()) {}
+
+    score_writer(user_store *ut, const std::string &path)
+        : _ut(ut), _path(path), _journal_size(0), _seq(0), _running(true) {
+        //日志打不开时也要从数据库记录的序号之后分配序号
+        _seq = load_committed();
+        _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0) {
+            ERR_LOG("open score journal %s failed", _path.c_str());
+        } else {
+            replay();
+        }
+        _thread = std::thread(&score_writer::writer_entry, this);
+        DBG_LOG("天梯分异步写入模块初始化完毕");
+    }
+
+    //正常退出时把队列中的结果全部写库
+    ~score_writer() {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _running = false;
+            _cond.notify_one();
+        }
+        _thread.join();
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        DBG_LOG("天梯分异步写入模块销毁");
+    }
+
+    //提交一局的结果，只写日志和内存，不等待数据库
+    void submit(uint64_t winner, uint64_t loser) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        score_record rec = {++_seq, winner, loser};
+        if (_fd >= 0 && write(_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+            ERR_LOG("write score journal failed");
+        }
+        _journal_size += sizeof(rec);
+        _queue.push_back(rec);
+        add_result(_pending, rec);
+        if (_queue.size() >= SCORE_BATCH_SIZE) {
+            _cond.notify_one();
+        }
+    }
+
+    //查询用户信息，结果包含尚未落库的对局
+    //数据库查询不持有锁：用户在正在写库的一批中时先等这一批结束，查询期间有包含它的一批开始写库时重新查询，
+    //保证查到的行与叠加的内存变化对应同一时刻，不会漏加也不会重复加
+    bool select_by_id(uint64_t uid, user_info &info) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _flushed.wait(lock, [this, uid]() { return _inflight.count(uid) == 0; });
+            reading &r = _reading[uid];
+            r.readers++;
+            uint64_t touched = r.touched;
+            lock.unlock();
+            bool ret = _ut->select_by_id(uid, info);
+            lock.lock();
+            auto it = _reading.find(uid);
+            bool retry = it->second.touched != touched;
+            if (--it->second.readers == 0) {
+                _reading.erase(it);
+            }
+            if (ret == false) {
+                return false;
+            }
+            if (retry) {
+                continue;
+            }
+            auto pit = _pending.find(uid);
+            if (pit != _pending.end()) {
+                info.score += pit->second.score;
+                info.total_count += pit->second.total_count;
+                info.win_count += pit->second.win_count;
+            }
+            return true;
+        }
+    }
+
+    bool select_by_id(uint64_t uid, Json::Value &user) {
+        user_info info;
+        if (select_by_id(uid, info) == false) {
+            return false;
+        }
+        info.to_json(user);
+        return true;
+    }
+};
@@ -2,42 +2,43 @@
 #include "db.hpp"
 #include "logger.hpp"
 #include "matcher.hpp"
+#include "metrics.hpp"
 #include "online.hpp"
+#include "proto.hpp"
 #include "room.hpp"
+#include "score_writer.hpp"
+#include "user_cache.hpp"
 #include "session.hpp"
+#include "static_cache.hpp"
+#include "user_file.hpp"
+#include "user_store.hpp"
 #include "util.hpp"
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 #define WWWROOT "./wwwroot/"
 
 class server {
 private:
-    std::string _web_root;//静态资源根目录 ./wwwroot/    /register.html ->  ./wwwroot/register.html
+    static_cache _static;//静态资源缓存，根目录 ./wwwroot/    /register.html ->  ./wwwroot/register.html
+    websocketpp::lib::asio::io_service _io;//事件循环，websocketpp与房间的strand共用
     server_t _server;
-    user_table _ut;
+    std::unique_ptr<user_store> _ut;//用户存储，MySQL或者嵌入式文件
+    score_writer _sw;               //天梯分异步写入，必须在_ut之后构造、之前析构
+    user_cache _uc;  //用户信息缓存
     online_manager _om;
     room_manager _rm;
     matcher _mm;
     session_manager _sm;
 
 private:
-    //静态资源请求的处理
+    //静态资源请求的处理：从内存缓存中取出文件，按Accept-Encoding选择压缩版本，ETag相同时只返回304
     void file_handler(server_t::connection_ptr &conn) {
-        //1.获取到请求uri-资源路径，了解客户端请求的页面文件名称
-        websocketpp::http::parser::request req = conn->get_request();
-        std::string uri = req.get_uri();
-        //2.组合出文件的实际路径  相对根目录 + uri
-        std::string realpath = _web_root + uri;
-        //3.如果请求的是个目录，增加一个后缀  login.html,    /  ->  /login.html
-        if (realpath.back() == '/') {
-            realpath += "login.html";
-        }
-        //4.读取文件内容
-        std::string body;
-        bool ret = file_util::read(realpath, body);
-        //4.1文件不存在，读取文件内容失败，返回404
-        if (!ret) {
+        static_file_ptr file = _static.find(conn->get_resource());
+        //文件不存在，返回404
+        if (!file) {
+            std::string body;
             body += "<html>";
             body += "<head>";
             body += "<meta charset = 'UTF-8/>";
@@ -49,19 +50,26 @@ private:
             conn->set_body(body);
             return;
         }
-
-        //5.设置响应文件
-        conn->set_body(body);
+        static_encoding enc = file->select(static_util::accept_encoding(conn->get_request_header("Accept-Encoding")));
+        conn->append_header("ETag", file->etag[enc]);
+        conn->append_header("Cache-Control", file->cache_control);
+        conn->append_header("Vary", "Accept-Encoding");
+        if (static_util::etag_match(conn->get_request_header("If-None-Match"), file->etag[enc])) {
+            conn->set_status(websocketpp::http::status_code::not_modified);
+            return;
+        }
+        conn->append_header("Content-Type", file->content_type);
+        if (enc != ENCODING_IDENTITY) {
+            conn->append_header("Content-Encoding", enc == ENCODING_BR ? "br" : "gzip");
+        }
+        conn->set_body(file->body[enc]);
         conn->set_status(websocketpp::http::status_code::ok);
     }
 
     void http_resp(server_t::connection_ptr &conn, bool result,
                    websocketpp::http::status_code::value code, const std::string &reason) {
-        Json::Value resp_json;
-        resp_json["result"] = result;
-        resp_json["reason"] = reason;
         std::string resp_body;
-        json_util::serialize(resp_json, resp_body);
+        json_writer(resp_body).add("result", result).add("reason", reason).end();
         conn->set_status(code);
         conn->set_body(resp_body);
         conn->append_header("Content-Type", "application/json");
@@ -87,7 +95,7 @@ private:
             return http_resp(conn, false, websocketpp::http::status_code::bad_request, "请输入用户名/密码");
         }
 
-        ret = _ut.insert(login_info);
+        ret = _ut->insert(login_info);
         if (!ret) {
             DBG_LOG("向数据库插入数据失败");
             return http_resp(conn, false, websocketpp::http::status_code::bad_request, "用户名已经被占用");
@@ -111,7 +119,7 @@ private:
             DBG_LOG("用户名或者密码不完整");
             return http_resp(conn, false, websocketpp::http::status_code::bad_request, "请输入用户名/密码");
         }
-        ret = _ut.login(login_info);
+        ret = _ut->login(login_info);
         if (!ret) {
             //  1. 如果验证失败，则返回400
             DBG_LOG("用户名或者密码错误");
@@ -120,38 +128,14 @@ private:
 
         //3. 如果验证成功，给客户端创建session
         uint64_t uid = login_info["id"].asUInt64();
-        session_ptr ssp = _sm.create_sesson(uid, LOGIN);
-        if (ssp.get() == nullptr) {
-            DBG_LOG("创建会话失败");
-            return http_resp(conn, false, websocketpp::http::status_code::internal_server_error, "创建会话失败");
-        }
-        _sm.set_session_expire_time(ssp->get_ssid(), SESSION_TIMEOUT);
+        session ss = _sm.create_sesson(uid, LOGIN);
+        _sm.set_session_expire_time(ss.get_ssid(), SESSION_TIMEOUT);
         //4. 设置响应头部：Set-Cookie,将sessionid通过cookie返回
-        std::string cookie_ssid = "SSID=" + std::to_string(ssp->get_ssid());
+        std::string cookie_ssid = "SSID=" + ss.get_ssid().to_string();
         conn->append_header("Set-Cookie", cookie_ssid);
         return http_resp(conn, true, websocketpp::http::status_code::ok, "登录成功");
     }
 
-    //获取cookie的值
-    bool get_cookie_val(const std::string &cookie_str, const std::string &key, std::string &val) {
-        // Cookie: SSID=XXX; path=/;
-        //1. 以 ; 作为间隔，对字符串进行分割，得到各个单个的cookie信息
-        std::string sep = "; ";
-        std::vector<std::string> cookie_arr;
-        string_util::split(cookie_str, sep, cookie_arr);
-        for (auto str: cookie_arr) {
-            //2. 对单个cookie字符串，以 = 为间隔进行分割，得到key和val
-            std::vector<std::string> tmp_arr;
-            string_util::split(str, "=", tmp_arr);
-            if (tmp_arr.size() != 2) { continue; }
-            if (tmp_arr[0] == key) {
-                val = tmp_arr[1];
-                return true;
-            }
-        }
-        return false;
-    }
-
     //用户信息获取功能请求的处理
     void info(server_t::connection_ptr &conn) {
         // 1. 获取请求信息中的Cookie，从Cookie中获取ssid
@@ -161,25 +145,17 @@ private:
             return http_resp(conn, false, websocketpp::http::status_code::bad_request, "找不到cookie信息，请重新登录");
         }
 
-        //1.5. 从cookie中取出ssid
-        std::string ssid_str;
-        bool ret = get_cookie_val(cookie_str, "SSID", ssid_str);
-        if (!ret) {
-            //cookie中没有ssid，返回错误：没有ssid信息，让客户端重新登录
-            return http_resp(conn, false, websocketpp::http::status_code::bad_request, "找不到ssid信息，请重新登录");
-        }
-        
-        // 2.在session管理中查找对应的会话信息
-        session_ptr ssp = _sm.get_sesson((uint64_t) (std::stol(ssid_str)));
-        if (ssp.get() == nullptr) {
-            //没有找到session，则认为登录已经过期，需要重新登录
+        // 2.从cookie中取出ssid，在session管理中查找对应的会话信息，同时刷新session的过期时间
+        session ss;
+        if (_sm.get_session_by_cookie(cookie_str, SESSION_TIMEOUT, ss) == false) {
+            //cookie中没有ssid或者没有找到session，则认为登录已经过期，需要重新登录
             return http_resp(conn, false, websocketpp::http::status_code::bad_request, "登录过期，请重新登录");
         }
 
         //3.从数据库中取出用户信息
-        uint64_t uid = ssp->get_user();
+        uint64_t uid = ss.get_user();
         Json::Value user_info;
-        ret = _ut.select_by_id(uid, user_info);
+        bool ret = _uc.select_by_id(uid, user_info);
         if (!ret) {
             //获取用户信息失败，返回错误：找不到用户信息
             return http_resp(conn, false, websocketpp::http::status_code::bad_request, "找不到用户信息，请重新登录");
@@ -191,9 +167,6 @@ private:
         conn->set_body(body);
         conn->append_header("Content-Type", "application/json");
         conn->set_status(websocketpp::http::status_code::ok);
-
-        //5.用户操作后，需要刷新session的过期时间
-        _sm.set_session_expire_time(ssp->get_ssid(), SESSION_TIMEOUT);
     }
 
     //
@@ -204,48 +177,389 @@ private:
         std::string method = req.get_method();
         std::string uri = req.get_uri();
         if (method == "POST" && uri == "/reg") {
+            static metrics_histogram &latency = http_latency("reg");
+            metrics_timer timer(latency);
             return reg(conn);
         } else if (method == "POST" && uri == "/login") {
+            static metrics_histogram &latency = http_latency("login");
+            metrics_timer timer(latency);
             return login(conn);
         } else if (method == "GET" && uri == "/info") {
+            static metrics_histogram &latency = http_latency("info");
+            metrics_timer timer(latency);
             return info(conn);
+        } else if (method == "GET" && uri == "/metrics") {
+            return metrics_handler(conn);
         } else {
+            static metrics_histogram &latency = http_latency("static");
+            metrics_timer timer(latency);
             return file_handler(conn);
         }
     }
 
+    //HTTP请求的处理耗时，按处理函数区分
+    static metrics_histogram &http_latency(const char *handler) {
+        return metrics_registry::instance().histogram("gobang_http_request_seconds", "HTTP请求的处理耗时", std::string("handler=\"") + handler + "\"");
+    }
+
+    //Prometheus文本格式的监控指标
+    void metrics_handler(server_t::connection_ptr &conn) {
+        std::string body;
+        metrics_registry::instance().render(body);
+        conn->set_status(websocketpp::http::status_code::ok);
+        conn->set_body(body);
+        conn->append_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+    }
+
+    //导出时才取值的指标：在线人数、房间数、匹配队列长度等，回调属于这个server对象，析构时注销
+    void register_metrics() {
+        metrics_registry &reg = metrics_registry::instance();
+        reg.add_callback("gobang_online_users", "在线人数", METRIC_GAUGE, "where=\"hall\"", [this]() {
+            size_t hall, room;
+            _om.get_user_num(hall, room);
+            return (double) hall;
+        }, this);
+        reg.add_callback("gobang_online_users", "在线人数", METRIC_GAUGE, "where=\"room\"", [this]() {
+            size_t hall, room;
+            _om.get_user_num(hall, room);
+            return (double) room;
+        }, this);
+        reg.add_callback("gobang_rooms", "当前的房间数", METRIC_GAUGE, "", [this]() { return (double) _rm.get_room_num(); }, this);
+        reg.add_callback("gobang_match_queue_depth", "正在等待匹配的人数", METRIC_GAUGE, "", [this]() { return (double) _mm.size(); }, this);
+        reg.add_callback("gobang_matches_total", "匹配成功的对数", METRIC_COUNTER, "", [this]() { return (double) _mm.get_stats().matched; }, this);
+        reg.add_callback("gobang_sessions", "当前的会话数", METRIC_GAUGE, "", [this]() { return (double) _sm.size(); }, this);
+        reg.add_callback("gobang_user_cache_lookups_total", "用户信息缓存的查询次数", METRIC_COUNTER, "result=\"hit\"", [this]() { return (double) _uc.get_stats().hit; }, this);
+        reg.add_callback("gobang_user_cache_lookups_total", "用户信息缓存的查询次数", METRIC_COUNTER, "result=\"miss\"", [this]() { return (double) _uc.get_stats().miss; }, this);
+        //连接池只有MySQL存储才有
+        user_table *mysql = dynamic_cast<user_table *>(_ut.get());
+        if (mysql != nullptr) {
+            reg.add_callback("gobang_db_pool_idle", "连接池中空闲的连接数", METRIC_GAUGE, "", [mysql]() { return (double) mysql->get_pool_stats().idle; }, this);
+            reg.add_callback("gobang_db_pool_waits_total", "因为没有空闲连接而等待的次数", METRIC_COUNTER, "", [mysql]() { return (double) mysql->get_pool_stats().wait_count; }, this);
+        }
+    }
+
+    //按连接协商的协议发送响应，二进制协议中没有的消息(握手、就绪等控制消息)仍然用JSON
+    void ws_resp(server_t::connection_ptr &conn, Json::Value &resp) {
+        std::string body;
+        json_util::serialize(resp, body);
+        bool binary = proto_util::is_binary(conn);
+        proto_frames frames;
+        proto_util::make_frames(resp, body, binary, frames);
+        conn->send(frames.select(binary));
+    }
+
+    //解析一条websocket请求：二进制帧按二进制协议解码，文本帧按JSON解析
+    bool ws_request(server_t::message_ptr &msg, Json::Value &req) {
+        const std::string &payload = msg->get_payload();
+        if (msg->get_opcode() == websocketpp::frame::opcode::binary) {
+            proto_msg pm;
+            return proto_util::decode(payload.data(), payload.size(), pm) && proto_util::to_json(pm, req);
+        }
+        return json_util::unserialize(payload, req);
+    }
+
+    //通过websocket握手请求中的cookie获取会话，长连接期间会话永久有效；找不到会话时响应错误并关闭连接
+    bool ws_session(server_t::connection_ptr &conn, const std::string &optype, session &ss) {
+        std::string cookie_str = conn->get_request_header("Cookie");
+        if (_sm.get_session_by_cookie(cookie_str, SESSION_FOREVER, ss)) {
+            return true;
+        }
+        Json::Value resp;
+        resp["optype"] = optype;
+        resp["result"] = false;
+        resp["reason"] = "没有找到会话信息，请重新登录";
+        ws_resp(conn, resp);
+        conn->close(websocketpp::close::status::policy_violation, "unauthorized");
+        return false;
+    }
+
+    //长连接断开后，用户既不在大厅也不在房间时，会话恢复为临时的
+    void ws_release(const session &ss) {
+        uint64_t uid = ss.get_user();
+        if (_om.is_in_game_hall(uid) == false && _om.is_in_game_room(uid) == false) {
+            _sm.set_session_expire_time(ss.get_ssid(), SESSION_TIMEOUT);
+        }
+    }
+
+    void ws_error(server_t::connection_ptr &conn, const std::string &optype, const std::string &reason) {
+        Json::Value resp;
+        resp["optype"] = optype;
+        resp["result"] = false;
+        resp["reason"] = reason;
+        ws_resp(conn, resp);
+    }
+
+    //客户端在Sec-WebSocket-Protocol中带上PROTO_SUBPROTOCOL时使用二进制协议，否则仍然使用JSON
+    bool validate_callback(websocketpp::connection_hdl hd1) {
+        server_t::connection_ptr conn = _server.get_con_from_hdl(hd1);
+        const std::vector<std::string> &protocols = conn->get_requested_subprotocols();
+        for (auto &protocol: protocols) {
+            if (protocol == PROTO_SUBPROTOCOL) {
+                conn->select_subprotocol(protocol);
+                break;
+            }
+        }
+        return true;
+    }
+
+    //游戏大厅长连接建立：同一个用户不能重复进入大厅或者房间
+    void wsopen_game_hall(server_t::connection_ptr &conn) {
+        session ss;
+        if (ws_session(conn, "hall_ready", ss) == false) {
+            return;
+        }
+        uint64_t uid = ss.get_user();
+        if (_om.is_in_game_hall(uid) || _om.is_in_game_room(uid)) {
+            ws_error(conn, "hall_ready", "玩家重复登录");
+            conn->close(websocketpp::close::status::policy_violation, "duplicate");
+            return;
+        }
+        _om.enter_game_hall(uid, conn);
+        Json::Value resp;
+        resp["optype"] = "hall_ready";
+        resp["result"] = true;
+        resp["uid"] = (Json::UInt64) uid;
+        ws_resp(conn, resp);
+    }
+
+    //游戏大厅请求：开始匹配、停止匹配
+    void wsmsg_game_hall(server_t::connection_ptr &conn, server_t::message_ptr &msg) {
+        session ss;
+        if (ws_session(conn, "hall_ready", ss) == false) {
+            return;
+        }
+        Json::Value req;
+        if (ws_request(msg, req) == false) {
+            return ws_error(conn, "unknown", "请求的正文格式错误");
+        }
+        std::string optype = req["optype"].asString();
+        Json::Value resp;
+        resp["optype"] = optype;
+        if (optype == "match_start") {
+            resp["result"] = _mm.add(ss.get_user());
+        } else if (optype == "match_stop") {
+            resp["result"] = _mm.del(ss.get_user());
+        } else {
+            return ws_error(conn, optype, "未知请求类型");
+        }
+        ws_resp(conn, resp);
+    }
+
+    //游戏大厅长连接断开：重复登录被拒绝的连接不影响已经在大厅中的连接
+    void wsclose_game_hall(server_t::connection_ptr &conn) {
+        session ss;
+        std::string cookie_str = conn->get_request_header("Cookie");
+        if (_sm.get_session_by_cookie(cookie_str, SESSION_FOREVER, ss) == false) {
+            return;
+        }
+        uint64_t uid = ss.get_user();
+        if (_om.get_conn_from_hall(uid) != conn) {
+            return;
+        }
+        _om.exit_game_hall(uid);
+        _mm.del(uid);
+        ws_release(ss);
+    }
+
+    //游戏房间长连接建立：匹配成功后客户端从大厅跳转过来，大厅连接可能还没有断开，只检查是否已经在房间中
+    void wsopen_game_room(server_t::connection_ptr &conn) {
+        session ss;
+        if (ws_session(conn, "room_ready", ss) == false) {
+            return;
+        }
+        uint64_t uid = ss.get_user();
+        if (_om.is_in_game_room(uid)) {
+            ws_error(conn, "room_ready", "玩家重复登录");
+            conn->close(websocketpp::close::status::policy_violation, "duplicate");
+            return;
+        }
+        room_ptr rp = _rm.get_room_by_uid(uid);
+        if (rp.get() == nullptr) {
+            ws_error(conn, "room_ready", "没有找到玩家的房间信息");
+            conn->close(websocketpp::close::status::policy_violation, "no room");
+            return;
+        }
+        _om.enter_game_room(uid, conn);
+        Json::Value resp;
+        resp["optype"] = "room_ready";
+        resp["result"] = true;
+        resp["room_id"] = (Json::UInt64) rp->get_room_id();
+        resp["uid"] = (Json::UInt64) uid;
+        resp["white_id"] = (Json::UInt64) rp->get_white_id();
+        resp["black_id"] = (Json::UInt64) rp->get_black_id();
+        ws_resp(conn, resp);
+    }
+
+    //游戏房间请求：下棋、聊天，投递到房间的strand中处理，uid以会话为准
+    void wsmsg_game_room(server_t::connection_ptr &conn, server_t::message_ptr &msg) {
+        session ss;
+        if (ws_session(conn, "room_ready", ss) == false) {
+            return;
+        }
+        uint64_t uid = ss.get_user();
+        room_ptr rp = _rm.get_room_by_uid(uid);
+        if (rp.get() == nullptr) {
+            return ws_error(conn, "unknown", "没有找到玩家的房间信息");
+        }
+        //二进制请求直接解码后交给房间，不转成JSON
+        room_request_ptr req = room_request_util::parse(msg, uid);
+        if (req.get() == nullptr) {
+            return ws_error(conn, "unknown", "请求的正文格式错误");
+        }
+        rp->post_request(req);
+    }
+
+    //游戏房间长连接断开：退出房间，房间中没有玩家后销毁
+    void wsclose_game_room(server_t::connection_ptr &conn) {
+        session ss;
+        std::string cookie_str = conn->get_request_header("Cookie");
+        if (_sm.get_session_by_cookie(cookie_str, SESSION_FOREVER, ss) == false) {
+            return;
+        }
+        uint64_t uid = ss.get_user();
+        if (_om.get_conn_from_room(uid) != conn) {
+            return;
+        }
+        _om.exit_game_room(uid);
+        _rm.remove_room_user(uid);
+        ws_release(ss);
+    }
+
+    //观战长连接建立
+    void wsopen_spectate(server_t::connection_ptr &conn) {
+        session ss;
+        if (ws_session(conn, "spectate_ready", ss) == false) {
+            return;
+        }
+        Json::Value resp;
+        resp["optype"] = "spectate_ready";
+        resp["result"] = true;
+        resp["uid"] = (Json::UInt64) ss.get_user();
+        ws_resp(conn, resp);
+    }
+
+    //观战请求：{"optype":"spectate_join","room_id":1}加入房间的观战，{"optype":"spectate_leave"}离开
+    void wsmsg_spectate(server_t::connection_ptr &conn, server_t::message_ptr &msg) {
+        session ss;
+        if (ws_session(conn, "spectate_ready", ss) == false) {
+            return;
+        }
+        Json::Value req;
+        if (json_util::unserialize(msg->get_payload(), req) == false) {
+            return ws_error(conn, "unknown", "请求的正文格式错误");
+        }
+        std::string optype = req["optype"].asString();
+        if (optype == "spectate_join") {
+            uint64_t rid = req["room_id"].asUInt64();
+            //加入成功后由房间发送完整棋盘，失败时才在这里响应
+            if (_rm.add_spectator(rid, ss.get_user(), conn) == false) {
+                return ws_error(conn, optype, "房间不存在或者对局已经结束");
+            }
+            return;
+        } else if (optype == "spectate_leave") {
+            _rm.remove_spectator(ss.get_user());
+            Json::Value resp;
+            resp["optype"] = optype;
+            resp["result"] = true;
+            return ws_resp(conn, resp);
+        }
+        return ws_error(conn, optype, "未知请求类型");
+    }
+
+    //观战长连接断开：离开观战
+    void wsclose_spectate(server_t::connection_ptr &conn) {
+        session ss;
+        std::string cookie_str = conn->get_request_header("Cookie");
+        if (_sm.get_session_by_cookie(cookie_str, SESSION_FOREVER, ss) == false) {
+            return;
+        }
+        _rm.remove_spectator(ss.get_user());
+        ws_release(ss);
+    }
+
     void wsopen_callback(websocketpp::connection_hdl hd1) {
+        server_t::connection_ptr conn = _server.get_con_from_hdl(hd1);
+        std::string uri = conn->get_resource();
+        if (uri == "/hall") {
+            return wsopen_game_hall(conn);
+        } else if (uri == "/room") {
+            return wsopen_game_room(conn);
+        } else if (uri == "/spectate") {
+            return wsopen_spectate(conn);
+        }
     }
 
     void wsclose_callback(websocketpp::connection_hdl hd1) {
+        server_t::connection_ptr conn = _server.get_con_from_hdl(hd1);
+        std::string uri = conn->get_resource();
+        if (uri == "/hall") {
+            return wsclose_game_hall(conn);
+        } else if (uri == "/room") {
+            return wsclose_game_room(conn);
+        } else if (uri == "/spectate") {
+            return wsclose_spectate(conn);
+        }
     }
 
     void wsmsg_callback(websocketpp::connection_hdl hd1, server_t::message_ptr msg) {
+        server_t::connection_ptr conn = _server.get_con_from_hdl(hd1);
+        std::string uri = conn->get_resource();
+        if (uri == "/hall") {
+            return wsmsg_game_hall(conn, msg);
+        } else if (uri == "/room") {
+            return wsmsg_game_room(conn, msg);
+        } else if (uri == "/spectate") {
+            return wsmsg_spectate(conn, msg);
+        }
     }
 
 public:
-    //进行成员初始化，以及服务器回调函数的设置
-    server(const std::string &host, const std::string &username, const std::string &password, const std::string &dbname, uint16_t port = 3306, const std::string &wwwroot = WWWROOT)
-        : _web_root(wwwroot),
-          _ut(host, username, password, dbname, port),
+    //用户存在MySQL中
+    server(const std::string &host, const std::string &username, const std::string &password, const std::string &dbname, uint16_t port = 3306, const std::string &wwwroot = WWWROOT,
+           int64_t match_tick_ms = MATCH_TICK_MS, size_t match_batch = MATCH_BATCH_MAX)
+        : server(std::unique_ptr<user_store>(new user_table(host, username, password, dbname, port)), wwwroot, match_tick_ms, match_batch) {}
+
+    //进行成员初始化，以及服务器回调函数的设置；store为用户存储，如单机部署时的user_file
+    //match_tick_ms为匹配周期，0表示有玩家加入就匹配，大于0时按周期批量匹配，每批最多match_batch对
+    server(std::unique_ptr<user_store> store, const std::string &wwwroot = WWWROOT,
+           int64_t match_tick_ms = MATCH_TICK_MS, size_t match_batch = MATCH_BATCH_MAX)
+        : _static(wwwroot),
+          _ut(std::move(store)),
+          _sw(_ut.get()),
+          _uc(&_sw),
           _om(),
-          _rm(&_ut, &_om),
-          _sm(&_server),
-          _mm(&_rm, &_ut, &_om) {
+          _rm(&_uc, &_om, &_io),
+          _sm(SESSION_SNAPSHOT),
+          _mm(&_rm, &_uc, &_om, match_tick_ms, match_batch) {
         _server.set_access_channels(websocketpp::log::alevel::none);
-        _server.init_asio();
+        _server.init_asio(&_io);
         _server.set_reuse_addr(true);
         //当HTTP请求到来时，WebSocket++库将自动调用这个处理函数(http_callback)，并自动传入一个websocketpp::connection_hdl参数给占位符-1
         _server.set_http_handler(std::bind(&server::http_callback, this, std::placeholders::_1));
+        _server.set_validate_handler(std::bind(&server::validate_callback, this, std::placeholders::_1));
         _server.set_open_handler(std::bind(&server::wsopen_callback, this, std::placeholders::_1));
         _server.set_close_handler(std::bind(&server::wsclose_callback, this, std::placeholders::_1));
         _server.set_message_handler(std::bind(&server::wsmsg_callback, this, std::placeholders::_1, std::placeholders::_2));
+        register_metrics();
+    }
+
+    ~server() {
+        metrics_registry::instance().remove_callbacks(this);
+    }
+
+    //向游戏大厅中的所有玩家发送公告，返回收到公告的连接数
+    size_t announce(const std::string &content) {
+        Json::Value rsp;
+        rsp["optype"] = "announce";
+        rsp["result"] = true;
+        rsp["content"] = content;
+        return _om.broadcast_hall(ws_util::make_message(rsp));
     }
 
-    //启动服务器
-    void start(int port) {
+    //启动服务器，thread_num为运行事件循环的工作线程数，0表示使用CPU核心数
+    void start(int port, size_t thread_num = 0) {
         _server.listen(port);
         _server.start_accept();
-        _server.run();
+        io_util::run(_server, thread_num);
     }
 };
\ No newline at end of file
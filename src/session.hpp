@@ -1,8 +1,20 @@
 #pragma once
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "timer_wheel.hpp"
 #include "util.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <mutex>
-#include <unordered_map>
+#include <string>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 // 定义会话状态枚举
 typedef enum {
@@ -10,26 +22,85 @@ typedef enum {
     LOGIN   // 表示已登录状态
 } sesson_status;
 
+// 128位随机会话ID，cookie中是32个十六进制字符；全0表示无效
+struct session_id {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(const session_id &o) const {
+        return hi == o.hi && lo == o.lo;
+    }
+
+    bool empty() const {
+        return hi == 0 && lo == 0;
+    }
+
+    std::string to_string() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string str(32, '0');
+        for (int i = 0; i < 16; i++) {
+            str[15 - i] = digits[(hi >> (4 * i)) & 0xf];
+            str[31 - i] = digits[(lo >> (4 * i)) & 0xf];
+        }
+        return str;
+    }
+
+    // 解析32个十六进制字符，格式不对时返回false
+    static bool parse(const char *str, size_t len, session_id &id) {
+        if (len != 32) {
+            return false;
+        }
+        uint64_t v[2] = {0, 0};
+        for (int i = 0; i < 32; i++) {
+            char c = str[i];
+            uint64_t d;
+            if (c >= '0' && c <= '9') {
+                d = c - '0';
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                d = (c | 0x20) - 'a' + 10;
+            } else {
+                return false;
+            }
+            v[i / 16] = v[i / 16] << 4 | d;
+        }
+        id.hi = v[0];
+        id.lo = v[1];
+        return id.empty() == false;
+    }
+
+    // 从内核的密码学安全随机数生成器取128位
+    static session_id random() {
+        session_id id = {0, 0};
+        while (id.empty()) {
+            if (getrandom(&id, sizeof(id), 0) != (ssize_t) sizeof(id)) {
+                int fd = open("/dev/urandom", O_RDONLY);
+                if (fd < 0 || read(fd, &id, sizeof(id)) != (ssize_t) sizeof(id)) {
+                    ERR_LOG("read random session id failed");
+                    abort();
+                }
+                close(fd);
+            }
+        }
+        return id;
+    }
+};
+
+// 会话信息，按值传递，会话表中只保存这几个字段
 class session {
 private:
-    uint64_t _ssid;         // 会话ID
+    session_id _ssid;       // 会话ID
     uint64_t _uid;          // 用户ID
     sesson_status _status;  // 会话状态
-    server_t::timer_ptr _tp;// 定时器对象指针
 public:
-    // 构造函数
-    session(uint64_t ssid)
-        : _ssid(ssid) {
-        DBG_LOG("session %p 创建了", this);
+    session() : _uid(0), _status(UNLOGIN) {
+        _ssid.hi = _ssid.lo = 0;
     }
 
-    // 析构函数
-    ~session() {
-        DBG_LOG("session %p 销毁了", this);
-    }
+    session(const session_id &ssid, uint64_t uid, sesson_status status)
+        : _ssid(ssid), _uid(uid), _status(status) {}
 
     // 获取会话ID
-    uint64_t get_ssid() {
+    const session_id &get_ssid() const {
         return _ssid;
     }
 
@@ -39,7 +110,7 @@ public:
     }
 
     // 获取用户ID
-    uint64_t get_user() {
+    uint64_t get_user() const {
         return _uid;
     }
 
@@ -49,124 +120,461 @@ public:
     }
 
     // 判断是否登录
-    bool is_login() {
-        if (_status == LOGIN) {
-            return true;
-        }
-        return false;
-    }
-
-    // 设置定时器对象
-    void set_timer(const server_t::timer_ptr &tp) {
-        _tp = tp;
-    }
-
-    // 获取定时器对象
-    server_t::timer_ptr &get_timer() {
-        return _tp;
+    bool is_login() const {
+        return _status == LOGIN;
     }
 };
 
 #define SESSION_TIMEOUT 30000                // 定义会话超时时间
 #define SESSION_FOREVER -1                   // 定义永久会话
-using session_ptr = std::shared_ptr<session>;// 定义会话智能指针
+#define SESSION_WHEEL_TICK_MS 100            // 会话过期时间的精度
+#define SESSION_WHEEL_SLOTS 1024             // 时间轮的槽数，一圈102.4秒，大于SESSION_TIMEOUT
+#define SESSION_SHARD_NUM 64                 // 会话表的分片数量，必须是2的幂
+#define SESSION_SHARD_INIT 1024              // 每个分片哈希表的初始容量，必须是2的幂
+#define SESSION_SNAPSHOT "./session.snapshot"// 会话快照文件
+#define SESSION_SNAPSHOT_MS 10000            // 每隔多久保存一次快照
+#define SESSION_SNAPSHOT_MAGIC 0x53534247    // "GBSS"
+#define SESSION_SNAPSHOT_VERSION 1
+
+// 快照文件头，后面紧跟count条session_record
+struct session_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    int64_t saved_ms;// 保存时的系统时间(毫秒)，加载时扣除停机的时间
+};
 
+// 快照中的一条会话，32字节
+struct session_record {
+    uint64_t hi;
+    uint64_t lo;
+    uint64_t uid;
+    uint32_t ttl_ms;// 保存时距离过期的剩余时间
+    uint32_t status;
+};
+
+// 会话管理：按会话ID分成SESSION_SHARD_NUM个分片，每个分片一把锁、一张开放寻址哈希表和一个时间轮
+// 会话ID本身是随机数，低位选分片、高位选起始槽，不需要再做散列
+// 查找会话和刷新过期时间在同一个分片的同一次加锁中完成，不同分片之间没有共享的锁
+// 指定快照文件时，后台线程定期把所有会话写入快照，退出时再写一次，启动时从快照恢复，重启不会让玩家掉线
 class session_manager {
 private:
-    uint64_t _session_id;                              // 会话ID计数器
-    std::mutex _mutex;                                 // 互斥锁
-    std::unordered_map<uint64_t, session_ptr> _session;// 存储会话的哈希表
-    server_t *_server;                                 // 服务器对象
+    typedef enum {
+        SLOT_EMPTY,
+        SLOT_FULL,
+        SLOT_DELETED
+    } slot_state;
+
+    // 哈希表的一个槽，32字节
+    struct slot {
+        session_id ssid;
+        uint64_t uid;
+        uint32_t timer; // 在时间轮中的句柄，永久会话为TIMER_WHEEL_NIL
+        uint8_t status;
+        uint8_t state;
+    };
+
+    struct alignas(64) shard {
+        std::mutex mutex;
+        std::vector<slot> slots;   // 线性探测
+        size_t size;               // SLOT_FULL的个数
+        size_t used;               // SLOT_FULL和SLOT_DELETED的个数，超过容量的3/4时重建
+        timer_wheel<session_id> wheel;
+
+        shard() : slots(SESSION_SHARD_INIT), size(0), used(0), wheel(SESSION_WHEEL_TICK_MS, SESSION_WHEEL_SLOTS, now_ms()) {
+            memset(&slots[0], 0, slots.size() * sizeof(slot));
+        }
+    };
+
+    shard _shards[SESSION_SHARD_NUM];
+    std::string _path;             // 快照文件，为空时不做持久化
+    bool _running;
+    std::mutex _mutex;             // 保护_running
+    std::condition_variable _cond;
+    std::thread _sweeper;          // 推进时间轮的线程
+    metrics_counter &_created;     // 监控：创建、删除、过期的会话数，按cookie查找的命中与未命中次数
+    metrics_counter &_removed;
+    metrics_counter &_expired;
+    metrics_counter &_hits;
+    metrics_counter &_misses;
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+    }
+
+    // 快照跨越进程重启，需要用系统时间
+    static int64_t wall_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                .count();
+    }
+
+    shard &get_shard(const session_id &ssid) {
+        return _shards[ssid.lo & (SESSION_SHARD_NUM - 1)];
+    }
+
+    // 查找会话所在的槽，调用者持有分片的锁
+    static slot *find(shard &sd, const session_id &ssid) {
+        size_t mask = sd.slots.size() - 1;
+        for (size_t i = ssid.hi & mask;; i = (i + 1) & mask) {
+            slot &s = sd.slots[i];
+            if (s.state == SLOT_EMPTY) {
+                return nullptr;
+            }
+            if (s.state == SLOT_FULL && s.ssid == ssid) {
+                return &s;
+            }
+        }
+    }
+
+    // 插入一个槽，调用者持有分片的锁并保证ID不重复
+    static void insert(shard &sd, const slot &item) {
+        if ((sd.used + 1) * 4 > sd.slots.size() * 3) {
+            rehash(sd);
+        }
+        size_t mask = sd.slots.size() - 1;
+        for (size_t i = item.ssid.hi & mask;; i = (i + 1) & mask) {
+            slot &s = sd.slots[i];
+            if (s.state != SLOT_FULL) {
+                sd.used += s.state == SLOT_EMPTY;
+                s = item;
+                s.state = SLOT_FULL;
+                sd.size++;
+                return;
+            }
+        }
+    }
+
+    // 重建哈希表，清除删除标记，表中有效会话超过一半时容量翻倍
+    static void rehash(shard &sd) {
+        rehash(sd, sd.size * 2 >= sd.slots.size() ? sd.slots.size() * 2 : sd.slots.size());
+    }
+
+    static void rehash(shard &sd, size_t capacity) {
+        std::vector<slot> old(capacity);
+        memset(&old[0], 0, old.size() * sizeof(slot));
+        old.swap(sd.slots);
+        sd.size = sd.used = 0;
+        for (auto &s: old) {
+            if (s.state == SLOT_FULL) {
+                insert(sd, s);
+            }
+        }
+    }
+
+    // 删除一个槽，同时移出时间轮，调用者持有分片的锁
+    static void erase(shard &sd, slot *s) {
+        if (s->timer != TIMER_WHEEL_NIL) {
+            sd.wheel.remove(s->timer);
+        }
+        s->state = SLOT_DELETED;
+        sd.size--;
+    }
+
+    // 设置过期时间，调用者持有分片的锁
+    static void set_expire(shard &sd, slot *s, int ms) {
+        if (s->timer == TIMER_WHEEL_NIL && ms == SESSION_FOREVER) {
+            //1.在sesson永久存在的情况下，设置永久存在，无需任何更改
+            return;
+        } else if (s->timer == TIMER_WHEEL_NIL && ms != SESSION_FOREVER) {
+            //2.在sesson永久存在的情况下，设置指定时间之后被删除：加入时间轮
+            s->timer = sd.wheel.add(s->ssid, now_ms(), ms);
+        } else if (s->timer != TIMER_WHEEL_NIL && ms == SESSION_FOREVER) {
+            //3.在sesson设置了定时删除的情况下，将sesson设置为永久存在：从时间轮中移除
+            sd.wheel.remove(s->timer);
+            s->timer = TIMER_WHEEL_NIL;
+        } else {
+            //4.在sesson设置了定时删除的情况下，重置删除时间：在时间轮中换一个槽
+            sd.wheel.refresh(s->timer, now_ms(), ms);
+        }
+    }
+
+    static session to_session(const slot *s) {
+        return session(s->ssid, s->uid, (sesson_status) s->status);
+    }
+
+    // 启动时从快照恢复会话，扣除停机期间流逝的时间，已经过期的丢弃
+    // 先按会话数量一次性分配好每个分片的哈希表和时间轮，加载过程中不会重建
+    void load() {
+        std::string buf;
+        int fd = open(_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            buf.resize(st.st_size);
+            if (read(fd, &buf[0], buf.size()) != (ssize_t) buf.size()) {
+                buf.clear();
+            }
+        }
+        close(fd);
+        session_snapshot_header header;
+        if (buf.size() < sizeof(header)) {
+            ERR_LOG("session snapshot %s truncated, ignored", _path.c_str());
+            return;
+        }
+        memcpy(&header, buf.data(), sizeof(header));
+        if (header.magic != SESSION_SNAPSHOT_MAGIC || header.version != SESSION_SNAPSHOT_VERSION ||
+            buf.size() != sizeof(header) + header.count * sizeof(session_record)) {
+            ERR_LOG("session snapshot %s corrupted, ignored", _path.c_str());
+            return;
+        }
+        const session_record *records = (const session_record *) (buf.data() + sizeof(header));
+        std::vector<size_t> counts(SESSION_SHARD_NUM, 0);
+        for (uint64_t i = 0; i < header.count; i++) {
+            counts[records[i].lo & (SESSION_SHARD_NUM - 1)]++;
+        }
+        for (int i = 0; i < SESSION_SHARD_NUM; i++) {
+            size_t capacity = SESSION_SHARD_INIT;
+            while (counts[i] * 4 > capacity * 3) {
+                capacity <<= 1;
+            }
+            std::unique_lock<std::mutex> lock(_shards[i].mutex);
+            rehash(_shards[i], capacity);
+            _shards[i].wheel.reserve(counts[i]);
+        }
+        int64_t elapsed = wall_ms() - header.saved_ms;
+        if (elapsed < 0) {
+            elapsed = 0;
+        }
+        int64_t now = now_ms();
+        size_t loaded = 0;
+        for (uint64_t i = 0; i < header.count; i++) {
+            const session_record &rec = records[i];
+            int64_t ttl = (int64_t) rec.ttl_ms - elapsed;
+            if (ttl <= 0) {
+                continue;
+            }
+            slot item;
+            memset(&item, 0, sizeof(item));
+            item.ssid.hi = rec.hi;
+            item.ssid.lo = rec.lo;
+            item.uid = rec.uid;
+            item.status = rec.status;
+            shard &sd = get_shard(item.ssid);
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            if (item.ssid.empty() || find(sd, item.ssid) != nullptr) {
+                continue;
+            }
+            item.timer = sd.wheel.add(item.ssid, now, ttl);
+            insert(sd, item);
+            loaded++;
+        }
+        DBG_LOG("session snapshot loaded:%zu sessions, %lu expired", loaded, (unsigned long) (header.count - loaded));
+    }
+
+    // 每个tick依次推进各个分片的时间轮，删除这段时间内到期的会话，到时间时保存快照
+    void sweeper_entry() {
+        std::vector<session_id> expired;
+        int64_t next_snapshot = now_ms() + SESSION_SNAPSHOT_MS;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_running) {
+            _cond.wait_for(lock, std::chrono::milliseconds(SESSION_WHEEL_TICK_MS));
+            int64_t now = now_ms();
+            for (auto &sd: _shards) {
+                std::unique_lock<std::mutex> shard_lock(sd.mutex);
+                expired.clear();
+                sd.wheel.advance(now, expired);
+                _expired.inc(expired.size());
+                for (auto &ssid: expired) {
+                    slot *s = find(sd, ssid);
+                    if (s != nullptr) {
+                        //句柄已经被时间轮回收
+                        s->timer = TIMER_WHEEL_NIL;
+                        erase(sd, s);
+                    }
+                }
+            }
+            if (_path.empty() == false && now >= next_snapshot) {
+                save();
+                next_snapshot = now + SESSION_SNAPSHOT_MS;
+            }
+        }
+    }
 
 public:
-    // 构造函数
-    session_manager(server_t *server)
-        : _session_id(1), _server(server) {
+    // 构造函数，path为快照文件，为空时不做持久化
+    session_manager(const std::string &path = "")
+        : _path(path), _running(true),
+          _created(metrics_registry::instance().counter("gobang_sessions_created_total", "创建的会话数")),
+          _removed(metrics_registry::instance().counter("gobang_sessions_removed_total", "会话被删除的次数", "reason=\"logout\"")),
+          _expired(metrics_registry::instance().counter("gobang_sessions_removed_total", "会话被删除的次数", "reason=\"expired\"")),
+          _hits(metrics_registry::instance().counter("gobang_session_lookups_total", "按cookie查找会话的次数", "result=\"hit\"")),
+          _misses(metrics_registry::instance().counter("gobang_session_lookups_total", "按cookie查找会话的次数", "result=\"miss\"")) {
+        if (_path.empty() == false) {
+            load();
+        }
+        _sweeper = std::thread(&session_manager::sweeper_entry, this);
         DBG_LOG("session_manager初始化完毕");
     }
 
     // 析构函数
     ~session_manager() {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _running = false;
+            _cond.notify_one();
+        }
+        _sweeper.join();
+        if (_path.empty() == false) {
+            save();
+        }
         DBG_LOG("session_manager销毁成功");
     }
 
-    // 创建新会话
-    session_ptr create_sesson(uint64_t uid, sesson_status status) {
-        std::unique_lock<std::mutex> _mutex;// 独占锁，保护共享资源
-        session_ptr ssp(new session(_session_id));
-        ssp->set_status(status);
-        ssp->set_user(uid);
-        _session.insert(std::make_pair(_session_id, ssp));
-
-        _session_id++;
-        return ssp;
+    // 创建新会话，会话ID是随机数，不能被猜到
+    session create_sesson(uint64_t uid, sesson_status status) {
+        slot item;
+        memset(&item, 0, sizeof(item));
+        item.uid = uid;
+        item.status = status;
+        item.timer = TIMER_WHEEL_NIL;
+        while (true) {
+            item.ssid = session_id::random();
+            shard &sd = get_shard(item.ssid);
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            if (find(sd, item.ssid) == nullptr) {
+                insert(sd, item);
+                _created.inc();
+                return to_session(&item);
+            }
+        }
     }
 
-    // 获取会话
-    session_ptr get_sesson(uint64_t sesson_id) {
-        std::unique_lock<std::mutex> _mutex;// 独占锁，保护共享资源
-        auto it = _session.find(sesson_id); // 查找会话
-        if (it == _session.end()) {
-            return session_ptr();// 未找到，返回空智能指针
+    // 获取会话，不存在时返回false
+    bool get_sesson(const session_id &ssid, session &ss) {
+        shard &sd = get_shard(ssid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        slot *s = find(sd, ssid);
+        if (s == nullptr) {
+            return false;
         }
+        ss = to_session(s);
+        return true;
+    }
 
-        return it->second;// 返回找到的会话
+    // 从cookie中取出SSID并查找会话，找到时在同一次加锁中把过期时间设置为ms
+    // 每个需要登录的请求都走这里：直接在cookie字符串上解析，不分割、不分配内存
+    bool get_session_by_cookie(const std::string &cookie, int ms, session &ss) {
+        // Cookie: SSID=XXX; path=/;
+        static const char key[] = "SSID=";
+        const size_t key_len = sizeof(key) - 1;
+        size_t pos = 0;
+        while ((pos = cookie.find(key, pos)) != std::string::npos) {
+            if (pos == 0 || cookie[pos - 1] == ' ' || cookie[pos - 1] == ';') {
+                break;
+            }
+            pos += key_len;
+        }
+        if (pos == std::string::npos) {
+            _misses.inc();
+            return false;
+        }
+        size_t begin = pos + key_len, end = cookie.find(';', begin);
+        if (end == std::string::npos) {
+            end = cookie.size();
+        }
+        session_id ssid;
+        if (session_id::parse(cookie.c_str() + begin, end - begin, ssid) == false) {
+            _misses.inc();
+            return false;
+        }
+        shard &sd = get_shard(ssid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        slot *s = find(sd, ssid);
+        if (s == nullptr) {
+            _misses.inc();
+            return false;
+        }
+        _hits.inc();
+        set_expire(sd, s, ms);
+        ss = to_session(s);
+        return true;
     }
 
     // 移除会话
-    void remove_session(uint64_t sesson_id) {
-        std::unique_lock<std::mutex> _mutex;// 独占锁，保护共享资源
-        _session.erase(sesson_id);          // 移除会话
+    void remove_session(const session_id &ssid) {
+        shard &sd = get_shard(ssid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        slot *s = find(sd, ssid);
+        if (s != nullptr) {
+            erase(sd, s);
+            _removed.inc();
+        }
+    }
+
+    // 当前的会话数量
+    size_t size() {
+        size_t n = 0;
+        for (auto &sd: _shards) {
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            n += sd.size;
+        }
+        return n;
     }
 
-    // 添加会话
-    void append_session(const session_ptr &ssp) {
-        std::unique_lock<std::mutex> lock(_mutex);            // 独占锁，保护共享资源
-        _session.insert(std::make_pair(ssp->get_ssid(), ssp));// 添加会话
+    // 把所有会话写入临时文件，刷到磁盘后再改名覆盖快照，写到一半崩溃不会损坏上一份快照
+    // 永久会话属于已经断开的websocket连接，按普通的超时时间保存，客户端重连后会再次设置为永久
+    bool save() {
+        if (_path.empty()) {
+            return false;
+        }
+        std::vector<session_record> records;
+        records.reserve(size());
+        int64_t now = now_ms();
+        for (auto &sd: _shards) {
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            for (auto &s: sd.slots) {
+                if (s.state != SLOT_FULL) {
+                    continue;
+                }
+                int64_t ttl = SESSION_TIMEOUT;
+                if (s.timer != TIMER_WHEEL_NIL) {
+                    ttl = sd.wheel.expire_ms(s.timer) - now;
+                    if (ttl <= 0) {
+                        continue;
+                    }
+                }
+                session_record rec = {s.ssid.hi, s.ssid.lo, s.uid, (uint32_t) ttl, s.status};
+                records.push_back(rec);
+            }
+        }
+        session_snapshot_header header = {SESSION_SNAPSHOT_MAGIC, SESSION_SNAPSHOT_VERSION, records.size(), wall_ms()};
+        std::string tmp_path = _path + ".tmp";
+        //快照中是有效的会话ID，只允许服务器用户读取
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            ERR_LOG("open session snapshot %s failed", tmp_path.c_str());
+            return false;
+        }
+        size_t body = records.size() * sizeof(session_record);
+        bool ok = write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+                  (body == 0 || write(fd, records.data(), body) == (ssize_t) body) &&
+                  fdatasync(fd) == 0;
+        close(fd);
+        if (ok == false || rename(tmp_path.c_str(), _path.c_str()) != 0) {
+            ERR_LOG("write session snapshot %s failed", _path.c_str());
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
     }
 
-    void set_session_expire_time(uint64_t session_id, int ms) {
-        //依赖于websocketpp的定时器来完成session生命周期的管理
+    void set_session_expire_time(const session_id &ssid, int ms) {
         //在http通信的时候(登录，注册)session应该具备生命周期，指定时间无通信后删除
         //在客户端建立websocket长连接之后，sesson应该是永久存在的
         //登录之后，创建session，session需要在指定时间无通信后删除
         //但是进入游戏大厅，或者游戏房间，这个session就应该长久存在
         //等到退出游戏大厅，或者游戏房间，这个session应该被重新设置为临时，在长时间无通信后删除
-        session_ptr ssp = get_sesson(session_id);//通过会话ID，获取对应的sesson类
-        if (ssp.get() == nullptr) {
+        shard &sd = get_shard(ssid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        slot *s = find(sd, ssid);
+        if (s == nullptr) {
             return;
         }
-
-        server_t::timer_ptr tp = ssp->get_timer();//获取定时器
-        if (tp.get() == nullptr && ms == SESSION_FOREVER) {
-            //意味着session在创建时被设置为永久存在，所以无需任何更改，所以函数直接返回。
-            //1.在sesson永久存在的情况下，设置永久存在
-            return;
-        } else if (tp.get() == nullptr && ms != SESSION_FOREVER) {
-            //2.在sesson永久存在的情况下，设置指定时间之后被删除的定时任务
-            //意味着要将永久存在的session更改为临时session。因此，创建一个新的定时器，当指定的时间ms到达时移除session。
-            server_t::timer_ptr tmp_tp = _server->set_timer(ms, std::bind(&session_manager::remove_session, this, session_id));
-            ssp->set_timer(tmp_tp);
-        } else if (tp.get() != nullptr && ms == SESSION_FOREVER) {
-            //3.在sesson设置了定时删除的情况下，将sesson设置为永久存在
-            //删除定时任务--- stready_timer删除定时任务会导致任务直接执行
-            //意味着要将临时的session更改为永久的session。因此，取消定时器并将其设置为空，因为永久的session不需要定时器。
-            tp->cancel();                         //这个取消定时任务不是立即取消的
-            ssp->set_timer(server_t::timer_ptr());//将session关联的定时器设置为空
-                                                  //因此重新给session管理器中，添加一个session信息, 且添加的时候需要使用定时器，而不是立即添加
-            _server->set_timer(0, std::bind(&session_manager::append_session, this, ssp));
-        } else if (tp.get() != nullptr && ms != SESSION_FOREVER) {
-            //4.在sesson设置了定时删除的情况下，将sesson重置删除时间
-            //意味着要更改session的过期时间。因此，取消原来的定时器，并创建一个新的定时器，当新的时间ms到达时移除session。
-            tp->cancel();
-            ssp->set_timer(server_t::timer_ptr());
-            _server->set_timer(0, std::bind(&session_manager::append_session, this, ssp));
-
-            //重新给session添加定时销毁任务
-            server_t::timer_ptr tmp_tp = _server->set_timer(ms, std::bind(&session_manager::remove_session, this, ssp->get_ssid()));
-
-            //重新设置session关联的定时器
-            ssp->set_timer(tmp_tp);
-        }
-    }
-};
\ No newline at end of file
+        set_expire(sd, s, ms);
+    }
+};
@@ -0,0 +1,409 @@
+#pragma once
+#include "logger.hpp"
+#include "util.hpp"
+#include <brotli/encode.h>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <zlib.h>
+
+#define STATIC_INDEX "login.html"                 //请求目录时返回的页面
+#define STATIC_CACHE_CONTROL "public, max-age=3600"//图片、脚本等资源在浏览器中缓存一小时
+#define STATIC_MIN_COMPRESS 256                   //小于这个大小的文件不压缩
+#define STATIC_INOTIFY_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE)
+
+//客户端能接受的压缩方式
+typedef enum {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP = 1,
+    ENCODING_BR = 2
+} static_encoding;
+
+//一个缓存的静态文件：原始内容和预先压缩好的版本，压缩后不比原文件小的版本为空
+//每种编码有各自的ETag(原文件ETag加后缀)，和Vary: Accept-Encoding一起让中间缓存区分不同编码
+struct static_file {
+    std::string body[3];//下标是static_encoding
+    std::string etag[3];
+    const char *content_type;
+    const char *cache_control;
+
+    //按客户端能接受的压缩方式选出最小的版本
+    static_encoding select(int accept) const {
+        if ((accept & (1 << ENCODING_BR)) && body[ENCODING_BR].empty() == false) {
+            return ENCODING_BR;
+        }
+        if ((accept & (1 << ENCODING_GZIP)) && body[ENCODING_GZIP].empty() == false) {
+            return ENCODING_GZIP;
+        }
+        return ENCODING_IDENTITY;
+    }
+};
+typedef std::shared_ptr<const static_file> static_file_ptr;
+
+class static_util {
+public:
+    static const char *content_type(const std::string &path) {
+        static const struct {
+            const char *ext;
+            const char *type;
+        } types[] = {
+                {".html", "text/html; charset=utf-8"},
+                {".htm", "text/html; charset=utf-8"},
+                {".css", "text/css; charset=utf-8"},
+                {".js", "application/javascript; charset=utf-8"},
+                {".json", "application/json"},
+                {".txt", "text/plain; charset=utf-8"},
+                {".svg", "image/svg+xml"},
+                {".jpeg", "image/jpeg"},
+                {".jpg", "image/jpeg"},
+                {".png", "image/png"},
+                {".gif", "image/gif"},
+                {".ico", "image/x-icon"},
+                {".webp", "image/webp"},
+                {".woff2", "font/woff2"},
+        };
+        size_t dot = path.rfind('.');
+        if (dot != std::string::npos) {
+            for (auto &t: types) {
+                if (strcasecmp(path.c_str() + dot, t.ext) == 0) {
+                    return t.type;
+                }
+            }
+        }
+        return "application/octet-stream";
+    }
+
+    //图片、字体等本身已经压缩过，再压缩只会浪费CPU
+    static bool compressible(const char *type) {
+        return strncmp(type, "text/", 5) == 0 || strstr(type, "javascript") != nullptr ||
+               strstr(type, "json") != nullptr || strstr(type, "svg") != nullptr;
+    }
+
+    static bool gzip(const std::string &in, std::string &out) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        //windowBits加16输出gzip格式
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&zs, in.size()));
+        zs.next_in = (Bytef *) in.data();
+        zs.avail_in = (uInt) in.size();
+        zs.next_out = (Bytef *) &out[0];
+        zs.avail_out = (uInt) out.size();
+        int ret = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        return ret == Z_STREAM_END;
+    }
+
+    static bool brotli(const std::string &in, std::string &out) {
+        size_t size = BrotliEncoderMaxCompressedSize(in.size());
+        out.resize(size);
+        if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in.size(),
+                                  (const uint8_t *) in.data(), &size, (uint8_t *) &out[0]) == BROTLI_FALSE) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+
+    //解析Accept-Encoding，返回能接受的编码的位掩码；q=0表示明确拒绝
+    static int accept_encoding(const std::string &header) {
+        int mask = 0;
+        size_t pos = 0;
+        while (pos < header.size()) {
+            size_t end = header.find(',', pos);
+            if (end == std::string::npos) {
+                end = header.size();
+            }
+            size_t semi = header.find(';', pos);
+            size_t name_end = semi < end ? semi : end;
+            while (pos < name_end && header[pos] == ' ') {
+                pos++;
+            }
+            while (name_end > pos && header[name_end - 1] == ' ') {
+                name_end--;
+            }
+            bool refused = false;
+            if (semi < end) {
+                size_t q = header.find("q=", semi);
+                refused = q < end && strtod(header.c_str() + q + 2, nullptr) <= 0;
+            }
+            if (refused == false) {
+                std::string name = header.substr(pos, name_end - pos);
+                if (strcasecmp(name.c_str(), "br") == 0) {
+                    mask |= 1 << ENCODING_BR;
+                } else if (strcasecmp(name.c_str(), "gzip") == 0) {
+                    mask |= 1 << ENCODING_GZIP;
+                } else if (name == "*") {
+                    mask |= (1 << ENCODING_BR) | (1 << ENCODING_GZIP);
+                }
+            }
+            pos = end + 1;
+        }
+        return mask;
+    }
+
+    //If-None-Match中的任意一个ETag(忽略W/前缀)与etag相同，或者是*，都表示客户端的缓存仍然有效
+    static bool etag_match(const std::string &header, const std::string &etag) {
+        size_t pos = 0;
+        while (pos < header.size()) {
+            size_t end = header.find(',', pos);
+            if (end == std::string::npos) {
+                end = header.size();
+            }
+            while (pos < end && header[pos] == ' ') {
+                pos++;
+            }
+            if (header.compare(pos, 2, "W/") == 0) {
+                pos += 2;
+            }
+            size_t tag_end = end;
+            while (tag_end > pos && header[tag_end - 1] == ' ') {
+                tag_end--;
+            }
+            if ((tag_end - pos == 1 && header[pos] == '*') ||
+                header.compare(pos, tag_end - pos, etag) == 0) {
+                return true;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+};
+
+//静态资源缓存：启动时把wwwroot下的文件全部读进内存并预先压缩，请求时只查一次哈希表
+//inotify监视每个目录，文件被改写、替换、删除时重新加载或者移除对应的条目
+//条目是不可变的，替换时换一个新的shared_ptr，正在发送旧内容的请求不受影响
+class static_cache {
+private:
+    std::string _root;//末尾不带'/'
+    std::mutex _mutex;
+    std::unordered_map<std::string, static_file_ptr> _files;//键是请求路径，如/login.html
+    std::unordered_map<int, std::string> _watch_dirs;      //inotify的wd -> 请求路径中的目录部分，如/或者/img/
+    int _inotify_fd;
+    int _stop_fd;//析构时唤醒监视线程
+    std::thread _watcher;
+
+    static std::string make_etag(const std::string &body) {
+        //FNV-1a，加上长度降低碰撞的概率
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c: body) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        char buf[48];
+        snprintf(buf, sizeof(buf), "\"%zx-%016llx", body.size(), (unsigned long long) hash);
+        return buf;
+    }
+
+    //读取并压缩一个文件，不持有锁
+    static static_file_ptr build(const std::string &realpath) {
+        std::shared_ptr<static_file> file = std::make_shared<static_file>();
+        if (file_util::read(realpath, file->body[ENCODING_IDENTITY]) == false) {
+            return static_file_ptr();
+        }
+        const std::string &body = file->body[ENCODING_IDENTITY];
+        file->content_type = static_util::content_type(realpath);
+        //页面不带版本号，每次都要向服务器确认(命中时只返回304)；其他资源在有效期内直接用本地缓存
+        file->cache_control = strncmp(file->content_type, "text/html", 9) == 0 ? "no-cache" : STATIC_CACHE_CONTROL;
+        if (body.size() >= STATIC_MIN_COMPRESS && static_util::compressible(file->content_type)) {
+            if (static_util::gzip(body, file->body[ENCODING_GZIP]) == false || file->body[ENCODING_GZIP].size() >= body.size()) {
+                file->body[ENCODING_GZIP].clear();
+            }
+            if (static_util::brotli(body, file->body[ENCODING_BR]) == false || file->body[ENCODING_BR].size() >= body.size()) {
+                file->body[ENCODING_BR].clear();
+            }
+        }
+        std::string etag = make_etag(body);
+        file->etag[ENCODING_IDENTITY] = etag + "\"";
+        file->etag[ENCODING_GZIP] = etag + "-gz\"";
+        file->etag[ENCODING_BR] = etag + "-br\"";
+        return file;
+    }
+
+    void load_file(const std::string &path) {
+        static_file_ptr file = build(_root + path);
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (file) {
+            _files[path] = file;
+        } else {
+            _files.erase(path);
+        }
+    }
+
+    void remove_path(const std::string &path) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _files.erase(path);
+        //删除的如果是目录，把目录下的条目一起删除
+        std::string prefix = path + "/";
+        for (auto it = _files.begin(); it != _files.end();) {
+            if (it->first.compare(0, prefix.size(), prefix) == 0) {
+                it = _files.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    //加载目录dir(请求路径形式，以'/'结尾)下的所有文件，子目录递归加载并加入监视
+    void scan(const std::string &dir) {
+        std::string realdir = _root + dir;
+        if (_inotify_fd >= 0) {
+            int wd = inotify_add_watch(_inotify_fd, realdir.c_str(), STATIC_INOTIFY_MASK);
+            if (wd < 0) {
+                ERR_LOG("inotify_add_watch %s failed:%s", realdir.c_str(), strerror(errno));
+            } else {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _watch_dirs[wd] = dir;
+            }
+        }
+        DIR *dp = opendir(realdir.c_str());
+        if (dp == nullptr) {
+            ERR_LOG("opendir %s failed:%s", realdir.c_str(), strerror(errno));
+            return;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(dp)) != nullptr) {
+            if (ent->d_name[0] == '.') {
+                continue;
+            }
+            std::string path = dir + ent->d_name;
+            struct stat st;
+            if (stat((_root + path).c_str(), &st) != 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                scan(path + "/");
+            } else if (S_ISREG(st.st_mode)) {
+                load_file(path);
+            }
+        }
+        closedir(dp);
+    }
+
+    void handle_event(const struct inotify_event *ev) {
+        if (ev->mask & IN_IGNORED) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _watch_dirs.erase(ev->wd);
+            return;
+        }
+        if (ev->len == 0 || ev->name[0] == '.') {
+            return;
+        }
+        std::string dir;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _watch_dirs.find(ev->wd);
+            if (it == _watch_dirs.end()) {
+                return;
+            }
+            dir = it->second;
+        }
+        std::string path = dir + ev->name;
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            remove_path(path);
+            DBG_LOG("static file removed:%s", path.c_str());
+        } else if (ev->mask & IN_ISDIR) {
+            scan(path + "/");
+        } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            //IN_CREATE的文件可能还没写完，等IN_CLOSE_WRITE再加载
+            load_file(path);
+            DBG_LOG("static file reloaded:%s", path.c_str());
+        }
+    }
+
+    void watcher_entry() {
+        //inotify_event后面跟着变长的文件名，缓冲区按事件头对齐
+        alignas(struct inotify_event) char buf[4096];
+        struct pollfd fds[2] = {{_inotify_fd, POLLIN, 0}, {_stop_fd, POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ERR_LOG("static cache poll failed:%s", strerror(errno));
+                return;
+            }
+            if (fds[1].revents != 0) {
+                return;
+            }
+            ssize_t len = read(_inotify_fd, buf, sizeof(buf));
+            if (len <= 0) {
+                continue;
+            }
+            for (char *p = buf; p < buf + len;) {
+                const struct inotify_event *ev = (const struct inotify_event *) p;
+                handle_event(ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+
+public:
+    static_cache(const std::string &root)
+        : _root(root), _inotify_fd(-1), _stop_fd(-1) {
+        while (_root.empty() == false && _root.back() == '/') {
+            _root.pop_back();
+        }
+        _inotify_fd = inotify_init1(IN_CLOEXEC);
+        _stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (_inotify_fd < 0 || _stop_fd < 0) {
+            ERR_LOG("static cache inotify init failed:%s, files will not be reloaded", strerror(errno));
+            if (_inotify_fd >= 0) {
+                close(_inotify_fd);
+                _inotify_fd = -1;
+            }
+        }
+        scan("/");
+        if (_inotify_fd >= 0) {
+            _watcher = std::thread(&static_cache::watcher_entry, this);
+        }
+        DBG_LOG("static cache loaded:%zu files", size());
+    }
+
+    ~static_cache() {
+        if (_watcher.joinable()) {
+            uint64_t one = 1;
+            if (write(_stop_fd, &one, sizeof(one)) < 0) {
+                ERR_LOG("static cache stop failed:%s", strerror(errno));
+            }
+            _watcher.join();
+        }
+        if (_inotify_fd >= 0) {
+            close(_inotify_fd);
+        }
+        if (_stop_fd >= 0) {
+            close(_stop_fd);
+        }
+    }
+
+    //按请求路径查找，忽略查询参数，以'/'结尾的路径返回目录下的STATIC_INDEX
+    //只返回缓存中的文件，uri中的..不会访问到根目录以外的文件
+    static_file_ptr find(const std::string &uri) {
+        std::string path = uri.substr(0, uri.find_first_of("?#"));
+        if (path.empty() || path.back() == '/') {
+            path += path.empty() ? "/" STATIC_INDEX : STATIC_INDEX;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _files.find(path);
+        if (it == _files.end()) {
+            return static_file_ptr();
+        }
+        return it->second;
+    }
+
+    size_t size() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _files.size();
+    }
+};
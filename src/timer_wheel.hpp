@@ -0,0 +1,151 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#define TIMER_WHEEL_NIL UINT32_MAX//空句柄
+
+//时间轮：到期时间按tick取整后放进对应的槽，每个槽是一条双向链表
+//节点放在数组中，用下标作为句柄，添加、刷新(从一个槽摘下挂到另一个槽)、删除都是O(1)，不分配内存(数组扩容除外)
+//advance每走过一个tick处理一个槽，槽中到期的节点一起取出，没到期的(超过一圈的)留在槽中等下一圈
+//不是线程安全的，由使用者加锁
+template<class T>
+class timer_wheel {
+public:
+    typedef uint32_t handle;
+
+private:
+    struct node {
+        T data;
+        int64_t expire;//到期的tick
+        uint32_t slot;
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    int64_t _tick_ms;
+    uint32_t _mask;
+    std::vector<uint32_t> _slots;//每个槽链表头的下标
+    std::vector<node> _nodes;
+    uint32_t _free;              //空闲链表，用next串起来
+    int64_t _current;            //下一个要处理的tick
+    size_t _size;
+
+    void link(uint32_t idx, int64_t expire) {
+        node &n = _nodes[idx];
+        n.expire = expire;
+        n.slot = (uint32_t)(expire & _mask);
+        n.prev = TIMER_WHEEL_NIL;
+        n.next = _slots[n.slot];
+        if (n.next != TIMER_WHEEL_NIL) {
+            _nodes[n.next].prev = idx;
+        }
+        _slots[n.slot] = idx;
+    }
+
+    void unlink(uint32_t idx) {
+        node &n = _nodes[idx];
+        if (n.prev == TIMER_WHEEL_NIL) {
+            _slots[n.slot] = n.next;
+        } else {
+            _nodes[n.prev].next = n.next;
+        }
+        if (n.next != TIMER_WHEEL_NIL) {
+            _nodes[n.next].prev = n.prev;
+        }
+    }
+
+    //到期时间换算成tick，向上取整，并且至少是下一个要处理的tick
+    int64_t expire_tick(int64_t now_ms, int64_t ms) const {
+        int64_t tick = (now_ms + ms + _tick_ms - 1) / _tick_ms;
+        return tick < _current ? _current : tick;
+    }
+
+public:
+    //slot_num取2的幂，tick_ms * slot_num最好大于常用的超时时间，这样节点在第一次经过时就会到期
+    timer_wheel(int64_t tick_ms, uint32_t slot_num, int64_t now_ms)
+        : _tick_ms(tick_ms > 0 ? tick_ms : 1), _free(TIMER_WHEEL_NIL), _size(0) {
+        uint32_t n = 1;
+        while (n < slot_num) {
+            n <<= 1;
+        }
+        _mask = n - 1;
+        _slots.assign(n, TIMER_WHEEL_NIL);
+        _current = now_ms / _tick_ms;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    //预先分配节点数组
+    void reserve(size_t n) {
+        _nodes.reserve(n);
+    }
+
+    //添加一个ms毫秒后到期的定时任务，返回句柄
+    handle add(const T &data, int64_t now_ms, int64_t ms) {
+        uint32_t idx;
+        if (_free == TIMER_WHEEL_NIL) {
+            _nodes.push_back(node());
+            idx = (uint32_t)(_nodes.size() - 1);
+        } else {
+            idx = _free;
+            _free = _nodes[idx].next;
+        }
+        _nodes[idx].data = data;
+        link(idx, expire_tick(now_ms, ms));
+        _size++;
+        return idx;
+    }
+
+    //把定时任务的到期时间重设为ms毫秒后，落在同一个槽时不需要移动
+    void refresh(handle h, int64_t now_ms, int64_t ms) {
+        int64_t expire = expire_tick(now_ms, ms);
+        if (_nodes[h].expire == expire) {
+            return;
+        }
+        if ((uint32_t)(expire & _mask) == _nodes[h].slot) {
+            _nodes[h].expire = expire;
+            return;
+        }
+        unlink(h);
+        link(h, expire);
+    }
+
+    //定时任务的到期时间(毫秒，按tick取整)
+    int64_t expire_ms(handle h) const {
+        return _nodes[h].expire * _tick_ms;
+    }
+
+    //删除定时任务，句柄随后会被复用
+    void remove(handle h) {
+        unlink(h);
+        _nodes[h].data = T();
+        _nodes[h].next = _free;
+        _free = h;
+        _size--;
+    }
+
+    //处理到now_ms为止所有到期的槽，到期任务的数据追加到expired中，句柄随即释放，返回到期的个数
+    size_t advance(int64_t now_ms, std::vector<T> &expired) {
+        int64_t now = now_ms / _tick_ms;
+        size_t count = 0;
+        //落后超过一圈时只需要把每个槽走一遍
+        if (now - _current > (int64_t) _mask) {
+            _current = now - _mask;
+        }
+        for (; _current <= now; _current++) {
+            uint32_t idx = _slots[_current & _mask];
+            while (idx != TIMER_WHEEL_NIL) {
+                uint32_t next = _nodes[idx].next;
+                if (_nodes[idx].expire <= now) {
+                    expired.push_back(_nodes[idx].data);
+                    remove(idx);
+                    count++;
+                }
+                idx = next;
+            }
+        }
+        return count;
+    }
+};
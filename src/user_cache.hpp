@@ -0,0 +1,172 @@
+#pragma once
+#include "db.hpp"
+#include "logger.hpp"
+#include "score_writer.hpp"
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#define USER_CACHE_SHARD_NUM 16     //分片数量，必须是2的幂
+#define USER_CACHE_CAPACITY 65536   //缓存的用户总数上限，平均分到各个分片
+#define USER_CACHE_TTL_MS 60000     //缓存项的有效期，过期后重新从数据库读取
+
+//用户信息缓存的命中统计
+struct user_cache_stats {
+    uint64_t hit;      //命中次数
+    uint64_t miss;     //未命中(包括过期)，需要查询数据库的次数
+    uint64_t evict;    //超出容量被淘汰的次数
+    uint64_t size;     //当前缓存的用户数
+};
+
+//用户信息缓存：按用户ID分片，每个分片一个LRU链表和一把锁
+//大厅查询和匹配只需要天梯分，命中时不访问数据库
+//对局结果在同一把锁内写入缓存中的用户信息并提交给score_writer(写穿)，缓存与数据库最终一致
+//未命中时经score_writer查询，它返回的数据库行和叠加的未落库变化对应同一时刻，后台写库不会改变两者之和，
+//所以缓存只需要用epoch排除查询期间提交的对局结果
+class user_cache {
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct entry {
+        user_info info;
+        clock::time_point expire;//过期时间
+    };
+    typedef std::list<entry> lru_list;//表头是最近使用的用户
+
+    struct alignas(64) shard {
+        std::mutex mutex;
+        lru_list lru;
+        std::unordered_map<uint64_t, lru_list::iterator> index;
+        uint64_t epoch;//分片内每提交一局结果加一，用来丢弃查询期间已经过时的查询结果
+        uint64_t hit;
+        uint64_t miss;
+        uint64_t evict;
+
+        shard() : epoch(0), hit(0), miss(0), evict(0) {}
+    };
+
+    score_writer *_score;
+    size_t _shard_capacity;
+    shard _shards[USER_CACHE_SHARD_NUM];
+
+    shard &get_shard(uint64_t uid) {
+        return _shards[(uid * 0x9E3779B97F4A7C15ULL) >> 32 & (USER_CACHE_SHARD_NUM - 1)];
+    }
+
+    //调用者持有分片的锁
+    static void erase(shard &sd, uint64_t uid) {
+        auto it = sd.index.find(uid);
+        if (it == sd.index.end()) {
+            return;
+        }
+        sd.lru.erase(it->second);
+        sd.index.erase(it);
+    }
+
+    //调用者持有分片的锁
+    void insert(shard &sd, const user_info &info) {
+        erase(sd, info.id);
+        entry e;
+        e.info = info;
+        e.expire = clock::now() + std::chrono::milliseconds(USER_CACHE_TTL_MS);
+        sd.lru.push_front(e);
+        sd.index[info.id] = sd.lru.begin();
+        while (sd.lru.size() > _shard_capacity) {
+            sd.index.erase(sd.lru.back().info.id);
+            sd.lru.pop_back();
+            sd.evict++;
+        }
+    }
+
+    //调用者持有分片的锁
+    static void apply(shard &sd, uint64_t uid, int64_t score, int32_t win) {
+        sd.epoch++;
+        auto it = sd.index.find(uid);
+        if (it == sd.index.end()) {
+            return;
+        }
+        user_info &info = it->second->info;
+        info.score += score;
+        info.total_count += 1;
+        info.win_count += win;
+    }
+
+public:
+    user_cache(score_writer *score, size_t capacity = USER_CACHE_CAPACITY)
+        : _score(score), _shard_capacity(capacity / USER_CACHE_SHARD_NUM == 0 ? 1 : capacity / USER_CACHE_SHARD_NUM) {
+        DBG_LOG("用户信息缓存初始化完毕");
+    }
+
+    //查询用户信息，命中且未过期时直接返回，否则查询数据库并放入缓存
+    bool select_by_id(uint64_t uid, user_info &info) {
+        shard &sd = get_shard(uid);
+        uint64_t epoch;
+        {
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            auto it = sd.index.find(uid);
+            if (it != sd.index.end() && it->second->expire > clock::now()) {
+                sd.lru.splice(sd.lru.begin(), sd.lru, it->second);
+                sd.hit++;
+                info = it->second->info;
+                return true;
+            }
+            sd.miss++;
+            epoch = sd.epoch;
+        }
+        //数据库查询不持有锁，结果包含尚未落库的对局，score_writer保证不会与正在写库的一批重复或者遗漏
+        if (_score->select_by_id(uid, info) == false) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        //查询期间分片内有对局结果提交，无法判断结果是否已经包含，不放入缓存，下次重新查询
+        if (sd.epoch == epoch) {
+            insert(sd, info);
+        }
+        return true;
+    }
+
+    bool select_by_id(uint64_t uid, Json::Value &user) {
+        user_info info;
+        if (select_by_id(uid, info) == false) {
+            return false;
+        }
+        info.to_json(user);
+        return true;
+    }
+
+    //提交一局的结果：在两个用户所在分片的锁内提交给score_writer并更新缓存
+    //与select_by_id的epoch检查配合，保证缓存中的分数不会漏加也不会重复加
+    void record_result(uint64_t winner, uint64_t loser) {
+        shard &ws = get_shard(winner), &ls = get_shard(loser);
+        std::unique_lock<std::mutex> wlock(ws.mutex, std::defer_lock), llock(ls.mutex, std::defer_lock);
+        if (&ws == &ls) {
+            wlock.lock();
+        } else {
+            std::lock(wlock, llock);
+        }
+        _score->submit(winner, loser);
+        apply(ws, winner, SCORE_STEP, 1);
+        apply(ls, loser, -SCORE_STEP, 0);
+    }
+
+    //用户信息在别处被修改时(例如后台直接改库)使缓存失效
+    void invalidate(uint64_t uid) {
+        shard &sd = get_shard(uid);
+        std::unique_lock<std::mutex> lock(sd.mutex);
+        sd.epoch++;
+        erase(sd, uid);
+    }
+
+    user_cache_stats get_stats() {
+        user_cache_stats stats = {0, 0, 0, 0};
+        for (auto &sd: _shards) {
+            std::unique_lock<std::mutex> lock(sd.mutex);
+            stats.hit += sd.hit;
+            stats.miss += sd.miss;
+            stats.evict += sd.evict;
+            stats.size += sd.lru.size();
+        }
+        return stats;
+    }
+};
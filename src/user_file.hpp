@@ -0,0 +1,539 @@
+#pragma once
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "user_store.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <openssl/sha.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+#define USER_FILE "./users.db"               //嵌入式用户存储的数据文件
+#define USER_FILE_MAGIC "GOBANGU1"           //文件头部的魔数，8字节
+#define USER_FILE_HEADER 64                  //文件头部的大小，第一条记录从这里开始
+#define USER_FILE_GROW (4 << 20)             //文件每次扩展4MB，用posix_fallocate预先分配磁盘空间
+#define USER_FILE_MAP_SIZE (1ULL << 34)      //预留16GB的地址空间映射整个文件，文件扩展时映射地址不变
+#define USER_FILE_SALT 16                    //每个用户随机的盐
+#define USER_FILE_HASH SHA256_DIGEST_LENGTH  //sha256(盐 + 口令)
+
+//记录类型
+typedef enum {
+    USER_RECORD_USER = 1,  //新用户，头部之后是盐、口令哈希和用户名
+    USER_RECORD_SCORE = 2, //win/lose之后用户的天梯分和场次
+    USER_RECORD_BATCH = 3, //apply_scores中的一个用户，读到同一批次的COMMIT之后才生效
+    USER_RECORD_COMMIT = 4 //一批结束，seq为这一批对局结果的最大序号；写到一半失败的批次没有COMMIT，重放时丢弃
+} user_record_type;
+
+//记录头部，定长48字节；记录总长度按8字节对齐
+//crc覆盖从type开始到记录末尾的所有字节，崩溃时写了一半的记录校验不通过，从这里截断
+struct user_record {
+    uint32_t crc;
+    uint16_t type;
+    uint16_t len;//头部之后的字节数
+    uint64_t id;
+    int64_t score;
+    int32_t total_count;
+    int32_t win_count;
+    uint64_t seq;  //COMMIT：对局结果的序号
+    uint64_t batch;//BATCH和COMMIT：批次号，COMMIT只提交紧挨在它前面、批次号相同的BATCH记录
+};
+
+//单机部署用的嵌入式用户存储：mmap映射的只追加记录文件 + 内存中的哈希索引
+//    所有修改都追加一条记录，内存索引立即更新，读操作只查索引和映射，不做系统调用
+//    修改的调用者等待后台线程落盘后才返回；落盘线程每次把已追加的所有记录一起msync，
+//    并发的多个修改共用一次落盘(组提交)，负载越高每次落盘覆盖的修改越多
+//    打开时顺序重放记录重建索引，遇到校验失败或者没有提交的批次就截断，保证崩溃后只丢失没有返回的修改
+//文件只增不减，每局对局结果追加两条记录(64字节)，没有做压缩
+class user_file : public user_store {
+private:
+    struct user_slot {
+        uint64_t off;//USER记录在文件中的偏移，用户名、盐和口令哈希从映射中读取
+        int64_t score;
+        int32_t total_count;
+        int32_t win_count;
+    };
+
+    std::string _path;
+    int _fd;
+    char *_base;                                     //文件的映射，预留USER_FILE_MAP_SIZE
+    uint64_t _size;                                  //文件大小
+    uint64_t _end;                                   //有效记录的末尾，新记录追加在这里
+    uint64_t _synced;                                //已经落盘的位置
+    uint64_t _synced_size;                           //上次落盘时的文件大小，扩展后需要同步元数据
+    uint64_t _seq;                                   //已经写入的对局结果的最大序号
+    uint64_t _batch;                                 //最近一个批次的批次号
+    uint64_t _sync_count;                            //落盘次数
+    bool _failed;                                    //落盘失败后不再接受修改，重启后从文件恢复
+    bool _running;
+    std::vector<user_slot> _users;                   //下标为id-1
+    std::unordered_map<std::string, uint64_t> _names;//用户名 -> id
+    std::mutex _mutex;
+    std::condition_variable _append_cond;            //有新的记录等待落盘
+    std::condition_variable _sync_cond;              //一次落盘完成
+    std::thread _thread;
+
+private:
+    static size_t record_size(uint16_t len) {
+        return (sizeof(user_record) + len + 7) & ~(size_t) 7;
+    }
+
+    static uint32_t checksum(const char *rec, size_t size) {
+        return (uint32_t) crc32(0, (const Bytef *) rec + 4, (uInt) (size - 4));
+    }
+
+    static void hash_password(const unsigned char *salt, const std::string &password, unsigned char *out) {
+        std::string buf((const char *) salt, USER_FILE_SALT);
+        buf += password;
+        SHA256((const unsigned char *) buf.data(), buf.size(), out);
+    }
+
+    //比较口令哈希，耗时与内容无关
+    static bool hash_equal(const unsigned char *a, const unsigned char *b) {
+        unsigned char diff = 0;
+        for (int i = 0; i < USER_FILE_HASH; i++) {
+            diff |= a[i] ^ b[i];
+        }
+        return diff == 0;
+    }
+
+    //扩展文件使[0, need)都可以写，失败(如磁盘满)时返回false
+    bool grow(uint64_t need) {
+        if (need > USER_FILE_MAP_SIZE) {
+            ERR_LOG("user file %s is full", _path.c_str());
+            return false;
+        }
+        uint64_t size = (need + USER_FILE_GROW - 1) / USER_FILE_GROW * USER_FILE_GROW;
+        int ret = posix_fallocate(_fd, _size, size - _size);
+        if (ret != 0) {
+            ERR_LOG("extend user file %s failed: %s", _path.c_str(), strerror(ret));
+            return false;
+        }
+        _size = size;
+        return true;
+    }
+
+    //追加一条记录，返回记录的偏移，调用者持有锁
+    bool append(user_record &rec, const void *payload, uint16_t len, uint64_t &off) {
+        size_t size = record_size(len);
+        if (_failed || (_end + size > _size && grow(_end + size) == false)) {
+            return false;
+        }
+        char *p = _base + _end;
+        rec.len = len;
+        memcpy(p, &rec, sizeof(rec));
+        if (len != 0) {
+            memcpy(p + sizeof(rec), payload, len);
+        }
+        memset(p + sizeof(rec) + len, 0, size - sizeof(rec) - len);
+        rec.crc = checksum(p, size);
+        memcpy(p, &rec.crc, sizeof(rec.crc));
+        off = _end;
+        _end += size;
+        return true;
+    }
+
+    //等待[0, end)落盘，调用者持有锁
+    bool wait_synced(std::unique_lock<std::mutex> &lock, uint64_t end) {
+        _append_cond.notify_one();
+        _sync_cond.wait(lock, [this, end]() { return _synced >= end || _failed; });
+        return _failed == false;
+    }
+
+    void sync_entry() {
+        long page = sysconf(_SC_PAGESIZE);
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _append_cond.wait(lock, [this]() { return _running == false || (_end > _synced && _failed == false); });
+            if (_end == _synced || _failed) {
+                if (_running == false) {
+                    break;
+                }
+                continue;
+            }
+            //落盘期间其他线程可以继续追加，追加的记录由下一次落盘覆盖
+            uint64_t from = _synced / page * page, to = _end;
+            bool grown = _size != _synced_size;
+            uint64_t size = _size;
+            lock.unlock();
+            bool ok = msync(_base + from, to - from, MS_SYNC) == 0 && (grown == false || fdatasync(_fd) == 0);
+            lock.lock();
+            if (ok == false) {
+                ERR_LOG("sync user file %s failed: %s", _path.c_str(), strerror(errno));
+                _failed = true;
+            } else {
+                _synced = to;
+                _synced_size = size;
+                _sync_count++;
+            }
+            _sync_cond.notify_all();
+        }
+    }
+
+    //顺序重放所有记录重建索引，截掉末尾不完整的记录和没有提交的批次
+    void load() {
+        uint64_t off = USER_FILE_HEADER, batch_start = 0;
+        std::vector<user_record> batch;//还没有读到COMMIT的批次
+        while (off + sizeof(user_record) <= _size) {
+            user_record rec;
+            memcpy(&rec, _base + off, sizeof(rec));
+            if (rec.crc == 0 && rec.type == 0) {
+                break;
+            }
+            size_t size = record_size(rec.len);
+            if (off + size > _size || checksum(_base + off, size) != rec.crc) {
+                ERR_LOG("user file %s: bad record at %lu, truncated", _path.c_str(), (unsigned long) off);
+                break;
+            }
+            _batch = std::max(_batch, rec.batch);
+            //批次中间出现了别的记录，说明这个批次写到一半失败了
+            if (batch.empty() == false && (rec.type == USER_RECORD_USER || rec.type == USER_RECORD_SCORE ||
+                                           rec.batch != batch.back().batch)) {
+                batch.clear();
+            }
+            if (rec.type == USER_RECORD_USER) {
+                if (rec.id != _users.size() + 1 || rec.len <= USER_FILE_SALT + USER_FILE_HASH ||
+                    rec.len > USER_FILE_SALT + USER_FILE_HASH + USERNAME_MAX) {
+                    ERR_LOG("user file %s: bad user record at %lu, truncated", _path.c_str(), (unsigned long) off);
+                    break;
+                }
+                user_slot slot = {off, rec.score, rec.total_count, rec.win_count};
+                _users.push_back(slot);
+                const char *name = _base + off + sizeof(user_record) + USER_FILE_SALT + USER_FILE_HASH;
+                _names[std::string(name, rec.len - USER_FILE_SALT - USER_FILE_HASH)] = rec.id;
+            } else if (rec.type == USER_RECORD_SCORE) {
+                set_score(rec);
+            } else if (rec.type == USER_RECORD_BATCH) {
+                if (batch.empty()) {
+                    batch_start = off;
+                }
+                batch.push_back(rec);
+            } else if (rec.type == USER_RECORD_COMMIT) {
+                for (auto &r: batch) {
+                    set_score(r);
+                }
+                batch.clear();
+                _seq = std::max(_seq, rec.seq);
+            } else {
+                ERR_LOG("user file %s: unknown record type %d at %lu, truncated", _path.c_str(), rec.type, (unsigned long) off);
+                break;
+            }
+            off += size;
+        }
+        if (batch.empty() == false) {
+            off = batch_start;
+        }
+        //截断点之后可能还有崩溃前没有落盘完整的记录(mmap的脏页不按顺序写回)，清零后新记录不会和它们拼在一起
+        if (off < _size) {
+            uint64_t from = off / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+            memset(_base + off, 0, _size - off);
+            msync(_base + from, _size - from, MS_SYNC);
+        }
+        _end = off;
+        _synced = off;
+    }
+
+    void set_score(const user_record &rec) {
+        if (rec.id == 0 || rec.id > _users.size()) {
+            return;
+        }
+        user_slot &slot = _users[rec.id - 1];
+        slot.score = rec.score;
+        slot.total_count = rec.total_count;
+        slot.win_count = rec.win_count;
+    }
+
+    //落盘失败时按变化量撤销内存中已经生效的战绩
+    //不能恢复成修改前的值：等待落盘期间其他线程可能已经在它的基础上修改了同一个用户
+    void undo_score(uint64_t id, int64_t score, int32_t total_count, int32_t win_count) {
+        if (id == 0 || id > _users.size()) {
+            return;
+        }
+        user_slot &slot = _users[id - 1];
+        slot.score -= score;
+        slot.total_count -= total_count;
+        slot.win_count -= win_count;
+    }
+
+    void fill(uint64_t id, const user_slot &slot, user_info &info) {
+        const user_record *rec = (const user_record *) (_base + slot.off);
+        info.id = id;
+        info.username_len = rec->len - USER_FILE_SALT - USER_FILE_HASH;
+        memcpy(info.username, _base + slot.off + sizeof(user_record) + USER_FILE_SALT + USER_FILE_HASH, info.username_len);
+        info.username[info.username_len] = '\0';
+        info.score = slot.score;
+        info.total_count = slot.total_count;
+        info.win_count = slot.win_count;
+    }
+
+    //win/lose：追加一条用户最新战绩的记录
+    bool update(uint64_t id, int64_t score, int32_t win) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (id == 0 || id > _users.size()) {
+            return false;
+        }
+        user_slot &slot = _users[id - 1];
+        user_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = USER_RECORD_SCORE;
+        rec.id = id;
+        rec.score = slot.score + score;
+        rec.total_count = slot.total_count + 1;
+        rec.win_count = slot.win_count + win;
+        uint64_t off;
+        if (append(rec, nullptr, 0, off) == false) {
+            return false;
+        }
+        set_score(rec);
+        if (wait_synced(lock, _end) == false) {
+            undo_score(id, score, 1, win);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    using user_store::select_by_id;
+
+    user_file(const std::string &path = USER_FILE)
+        : _path(path), _fd(-1), _base(nullptr), _size(0), _end(0), _synced(0), _synced_size(0), _seq(0), _batch(0),
+          _sync_count(0), _failed(false), _running(true) {
+        _fd = open(_path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (_fd < 0 || fstat(_fd, &st) != 0) {
+            ERR_LOG("open user file %s failed: %s", _path.c_str(), strerror(errno));
+            abort();
+        }
+        _size = st.st_size;
+        void *base = mmap(nullptr, USER_FILE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (base == MAP_FAILED) {
+            ERR_LOG("mmap user file %s failed: %s", _path.c_str(), strerror(errno));
+            abort();
+        }
+        _base = (char *) base;
+        if (_size == 0) {
+            if (grow(USER_FILE_HEADER) == false) {
+                abort();
+            }
+            memcpy(_base, USER_FILE_MAGIC, strlen(USER_FILE_MAGIC));
+        } else if (_size < USER_FILE_HEADER || memcmp(_base, USER_FILE_MAGIC, strlen(USER_FILE_MAGIC)) != 0) {
+            ERR_LOG("%s is not a user file", _path.c_str());
+            abort();
+        }
+        load();
+        if (fdatasync(_fd) != 0) {
+            ERR_LOG("sync user file %s failed: %s", _path.c_str(), strerror(errno));
+        }
+        _synced_size = _size;
+        _thread = std::thread(&user_file::sync_entry, this);
+
+        metrics_registry &reg = metrics_registry::instance();
+        reg.add_callback("gobang_user_file_bytes", "用户文件中有效记录的字节数", METRIC_GAUGE, "", [this]() { return (double) get_bytes(); }, this);
+        reg.add_callback("gobang_user_file_syncs_total", "用户文件的落盘次数", METRIC_COUNTER, "", [this]() { return (double) get_sync_count(); }, this);
+        DBG_LOG("user file %s: %zu users, %lu bytes", _path.c_str(), _users.size(), (unsigned long) _end);
+    }
+
+    ~user_file() {
+        metrics_registry::instance().remove_callbacks(this);
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _running = false;
+            _append_cond.notify_one();
+        }
+        _thread.join();
+        munmap(_base, USER_FILE_MAP_SIZE);
+        close(_fd);
+    }
+
+    //落盘次数，并发修改越多，每次落盘覆盖的修改越多
+    uint64_t get_sync_count() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _sync_count;
+    }
+
+    //文件中有效记录的字节数(包括头部)
+    uint64_t get_bytes() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _end;
+    }
+
+    bool insert(Json::Value &user) override {
+        static metrics_histogram &latency = query_latency("insert");
+        metrics_timer timer(latency);
+        if (user["password"].isNull() || user["username"].isNull()) {
+            DBG_LOG("INPUT PASSWORD OR USERNAME");
+            return false;
+        }
+        std::string name = user["username"].asString();
+        if (name.empty() || name.size() > USERNAME_MAX) {
+            return false;
+        }
+        //盐、口令哈希、用户名
+        char payload[USER_FILE_SALT + USER_FILE_HASH + USERNAME_MAX];
+        unsigned char *salt = (unsigned char *) payload;
+        if (getrandom(salt, USER_FILE_SALT, 0) != USER_FILE_SALT) {
+            ERR_LOG("read random salt failed");
+            return false;
+        }
+        hash_password(salt, user["password"].asString(), salt + USER_FILE_SALT);
+        memcpy(payload + USER_FILE_SALT + USER_FILE_HASH, name.data(), name.size());
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_names.count(name) != 0) {
+            return false;
+        }
+        user_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = USER_RECORD_USER;
+        rec.id = _users.size() + 1;
+        rec.score = USER_INIT_SCORE;
+        uint64_t off;
+        if (append(rec, payload, (uint16_t) (USER_FILE_SALT + USER_FILE_HASH + name.size()), off) == false) {
+            return false;
+        }
+        user_slot slot = {off, rec.score, 0, 0};
+        _users.push_back(slot);
+        _names[name] = rec.id;
+        return wait_synced(lock, _end);
+    }
+
+    bool login(Json::Value &user) override {
+        static metrics_histogram &latency = query_latency("login");
+        metrics_timer timer(latency);
+        unsigned char salt[USER_FILE_SALT], expect[USER_FILE_HASH], actual[USER_FILE_HASH];
+        uint64_t id;
+        user_slot slot;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _names.find(user["username"].asString());
+            if (it == _names.end()) {
+                DBG_LOG("用户不存在");
+                return false;
+            }
+            id = it->second;
+            slot = _users[id - 1];
+            const char *p = _base + slot.off + sizeof(user_record);
+            memcpy(salt, p, USER_FILE_SALT);
+            memcpy(expect, p + USER_FILE_SALT, USER_FILE_HASH);
+        }
+        hash_password(salt, user["password"].asString(), actual);
+        if (hash_equal(expect, actual) == false) {
+            return false;
+        }
+        user["id"] = (Json::UInt64) id;
+        user["score"] = (Json::Int64) slot.score;
+        user["total_count"] = slot.total_count;
+        user["win_count"] = slot.win_count;
+        return true;
+    }
+
+    bool select_by_name(const std::string &name, Json::Value &user) override {
+        user_info info;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _names.find(name);
+            if (it == _names.end()) {
+                return false;
+            }
+            fill(it->second, _users[it->second - 1], info);
+        }
+        info.to_json(user);
+        return true;
+    }
+
+    bool select_by_id(uint64_t id, user_info &info) override {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (id == 0 || id > _users.size()) {
+            return false;
+        }
+        fill(id, _users[id - 1], info);
+        return true;
+    }
+
+    bool win(uint64_t id) override {
+        static metrics_histogram &latency = query_latency("win");
+        metrics_timer timer(latency);
+        return update(id, 30, 1);
+    }
+
+    bool lose(uint64_t id) override {
+        static metrics_histogram &latency = query_latency("lose");
+        metrics_timer timer(latency);
+        return update(id, -30, 0);
+    }
+
+    //日志放在用户文件旁边
+    std::string journal_path() const override {
+        return _path + ".journal";
+    }
+
+    bool get_score_seq(uint64_t &seq) override {
+        std::unique_lock<std::mutex> lock(_mutex);
+        seq = _seq;
+        return true;
+    }
+
+    //一批分数变化写成若干BATCH记录和一条COMMIT记录，重放时只有读到COMMIT才生效
+    bool apply_scores(const std::vector<score_delta> &deltas, uint64_t seq) override {
+        if (deltas.empty()) {
+            return true;
+        }
+        static metrics_histogram &latency = query_latency("apply_scores");
+        metrics_timer timer(latency);
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t batch_id = ++_batch, off;
+        std::vector<user_record> batch;
+        batch.reserve(deltas.size());
+        bool ok = true;
+        for (auto &d: deltas) {
+            if (d.uid == 0 || d.uid > _users.size()) {
+                continue;
+            }
+            const user_slot &slot = _users[d.uid - 1];
+            user_record rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.type = USER_RECORD_BATCH;
+            rec.batch = batch_id;
+            rec.id = d.uid;
+            rec.score = slot.score + d.score;
+            rec.total_count = slot.total_count + d.total_count;
+            rec.win_count = slot.win_count + d.win_count;
+            if (append(rec, nullptr, 0, off) == false) {
+                ok = false;
+                break;
+            }
+            batch.push_back(rec);
+        }
+        user_record commit;
+        memset(&commit, 0, sizeof(commit));
+        commit.type = USER_RECORD_COMMIT;
+        commit.seq = seq;
+        commit.batch = batch_id;
+        //追加失败时已经写入的BATCH记录没有COMMIT，重放时会被丢弃
+        if (ok == false || append(commit, nullptr, 0, off) == false) {
+            return false;
+        }
+        //先修改内存，后面的追加基于这一批之后的战绩；落盘失败时撤销，
+        //score_writer仍然把这一批留在未落库的变化中，查询时不会重复计算
+        for (auto &rec: batch) {
+            set_score(rec);
+        }
+        if (wait_synced(lock, _end) == false) {
+            for (auto &d: deltas) {
+                undo_score(d.uid, d.score, d.total_count, d.win_count);
+            }
+            return false;
+        }
+        _seq = std::max(_seq, seq);
+        return true;
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include "metrics.hpp"
+#include <cstdint>
+#include <cstring>
+#include <jsoncpp/json/json.h>
+#include <string>
+#include <vector>
+
+#define USERNAME_MAX 128//username varchar(32)，utf8下最多96字节
+#define USER_INIT_SCORE 1000//新用户的天梯分
+
+//用户信息，查询结果直接绑定到这个结构体的字段上
+struct user_info {
+    uint64_t id;
+    char username[USERNAME_MAX + 1];
+    unsigned long username_len;
+    int64_t score;
+    int32_t total_count;
+    int32_t win_count;
+
+    user_info() {
+        memset(this, 0, sizeof(*this));
+    }
+
+    void to_json(Json::Value &user) const {
+        user["id"] = (Json::UInt64) id;
+        user["username"] = std::string(username, username_len);
+        user["score"] = (Json::Int64) score;
+        user["total_count"] = total_count;
+        user["win_count"] = win_count;
+    }
+};
+
+//一个用户在一批对局结果中的分数变化
+struct score_delta {
+    uint64_t uid;
+    int64_t score;
+    int32_t total_count;
+    int32_t win_count;
+
+    score_delta() : uid(0), score(0), total_count(0), win_count(0) {}
+};
+
+//用户数据的存储接口，服务器只通过它读写用户
+//user_table存在MySQL中；user_file是单机部署用的嵌入式存储，不需要数据库服务器
+class user_store {
+protected:
+    //每种查询的耗时，包括等待连接池或者等待落盘的时间
+    static metrics_histogram &query_latency(const char *query) {
+        return metrics_registry::instance().histogram("gobang_db_query_seconds", "数据库查询耗时(包括等待连接)", std::string("query=\"") + query + "\"");
+    }
+
+public:
+    virtual ~user_store() {}
+
+    //注册时新增用户，用户名已经存在时返回false
+    virtual bool insert(Json::Value &user) = 0;
+    //验证用户名和密码，成功时把id、天梯分和场次写入user
+    virtual bool login(Json::Value &user) = 0;
+    //通过用户名获取用户信息
+    virtual bool select_by_name(const std::string &name, Json::Value &user) = 0;
+    //通过id获取用户信息，结果直接写入user_info
+    virtual bool select_by_id(uint64_t id, user_info &info) = 0;
+    //胜利时天梯分增加30，战斗场次增加1，胜利场次增加1
+    virtual bool win(uint64_t id) = 0;
+    //失败时天梯分数减少30，战斗场次增加1，其他不变
+    virtual bool lose(uint64_t id) = 0;
+    //读取已经落库的对局结果的最大序号，还没有记录时为0
+    virtual bool get_score_seq(uint64_t &seq) = 0;
+    //原子地写入一批合并后的分数变化，并记录这一批结果的最大序号；返回true时已经持久化
+    virtual bool apply_scores(const std::vector<score_delta> &deltas, uint64_t seq) = 0;
+    //对局结果日志的路径，日志中的序号只对产生它的存储有意义，每个存储使用自己的日志
+    virtual std::string journal_path() const = 0;
+
+    //通过id获取用户信息
+    bool select_by_id(uint64_t id, Json::Value &user) {
+        user_info info;
+        if (select_by_id(id, info) == false) {
+            return false;
+        }
+        info.to_json(user);
+        return true;
+    }
+};
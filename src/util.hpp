@@ -1,12 +1,14 @@
 #pragma once
 #include "logger.hpp"
 #include <cassert>
+#include <cstring>
 #include <fstream>
 #include <jsoncpp/json/json.h>
 #include <memory>
 #include <mysql/mysql.h>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <websocketpp/server.hpp>
@@ -66,26 +68,69 @@ public:
     }
 };
 
+//jsoncpp的编解码器：每个线程缓存一个StreamWriter和一个CharReader，不再每次调用都创建builder、writer和stringstream
+//输出是紧凑格式(不缩进、不换行)，直接写入调用者传入的string，string的容量在多次调用之间复用
 class json_util {
+private:
+    //把ostream的输出直接追加到目标string中
+    class string_buf : public std::streambuf {
+    public:
+        std::string *out;
+
+        string_buf() : out(nullptr) {}
+
+    protected:
+        int_type overflow(int_type c) override {
+            if (c != traits_type::eof()) {
+                out->push_back((char) c);
+            }
+            return c;
+        }
+
+        std::streamsize xsputn(const char *s, std::streamsize n) override {
+            out->append(s, (size_t) n);
+            return n;
+        }
+    };
+
+    struct codec {
+        string_buf buf;
+        std::ostream os;
+        std::unique_ptr<Json::StreamWriter> writer;
+        std::unique_ptr<Json::CharReader> reader;
+
+        codec() : os(&buf) {
+            Json::StreamWriterBuilder swb;
+            swb["indentation"] = "";
+            writer.reset(swb.newStreamWriter());
+            Json::CharReaderBuilder crb;
+            reader.reset(crb.newCharReader());
+        }
+    };
+
+    static codec &local() {
+        static thread_local codec c;
+        return c;
+    }
+
 public:
     static bool serialize(const Json::Value &root, std::string &str) {
-        Json::StreamWriterBuilder swb;
-        std::unique_ptr<Json::StreamWriter> sw(swb.newStreamWriter());
-        std::stringstream ss;
-        int ret = sw->write(root, &ss);
-        if (ret != 0) {
+        codec &c = local();
+        str.clear();
+        c.buf.out = &str;
+        c.os.clear();
+        int ret = c.writer->write(root, &c.os);
+        c.buf.out = nullptr;
+        if (ret != 0 || c.os.good() == false) {
             ERR_LOG("json serialize failed!!");
             return false;
         }
-        str = ss.str();
         return true;
     }
 
     static bool unserialize(const std::string &str, Json::Value &root) {
-        Json::CharReaderBuilder crb;
-        std::unique_ptr<Json::CharReader> cr(crb.newCharReader());
         std::string err;
-        bool ret = cr->parse(str.c_str(), str.c_str() + str.size(), &root, &err);
+        bool ret = local().reader->parse(str.c_str(), str.c_str() + str.size(), &root, &err);
         if (ret == false) {
             ERR_LOG("json unserialize failed: %s", err.c_str());
             return false;
@@ -94,6 +139,116 @@ public:
     }
 };
 
+//固定格式响应的流式写入：按顺序把键值追加到string中，不经过Json::Value
+//    json_writer(body).add("result", true).add("reason", "ok").end();
+//键由调用者保证不需要转义，字符串值按JSON规则转义，非ASCII字符按UTF-8原样输出
+class json_writer {
+private:
+    std::string &_out;
+    bool _first;
+
+    void key(const char *k) {
+        _out.push_back(_first ? '{' : ',');
+        _first = false;
+        _out.push_back('"');
+        _out.append(k);
+        _out.append("\":", 2);
+    }
+
+    void quote(const char *s, size_t n) {
+        static const char hex[] = "0123456789abcdef";
+        _out.push_back('"');
+        for (size_t i = 0; i < n; i++) {
+            unsigned char c = (unsigned char) s[i];
+            switch (c) {
+                case '"':
+                    _out.append("\\\"", 2);
+                    break;
+                case '\\':
+                    _out.append("\\\\", 2);
+                    break;
+                case '\n':
+                    _out.append("\\n", 2);
+                    break;
+                case '\r':
+                    _out.append("\\r", 2);
+                    break;
+                case '\t':
+                    _out.append("\\t", 2);
+                    break;
+                default:
+                    if (c < 0x20) {
+                        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                        _out.append(esc, 6);
+                    } else {
+                        _out.push_back((char) c);
+                    }
+            }
+        }
+        _out.push_back('"');
+    }
+
+    json_writer &number(uint64_t v) {
+        char buf[20];
+        int n = 0;
+        do {
+            buf[sizeof(buf) - 1 - n++] = (char) ('0' + v % 10);
+            v /= 10;
+        } while (v != 0);
+        _out.append(buf + sizeof(buf) - n, n);
+        return *this;
+    }
+
+public:
+    //清空out后开始写一个对象
+    explicit json_writer(std::string &out) : _out(out), _first(true) {
+        _out.clear();
+    }
+
+    json_writer &add(const char *k, const char *v) {
+        key(k);
+        quote(v, strlen(v));
+        return *this;
+    }
+
+    json_writer &add(const char *k, const std::string &v) {
+        key(k);
+        quote(v.data(), v.size());
+        return *this;
+    }
+
+    json_writer &add(const char *k, bool v) {
+        key(k);
+        _out.append(v ? "true" : "false");
+        return *this;
+    }
+
+    json_writer &add(const char *k, int v) {
+        return add(k, (int64_t) v);
+    }
+
+    json_writer &add(const char *k, int64_t v) {
+        key(k);
+        if (v < 0) {
+            _out.push_back('-');
+            return number(0 - (uint64_t) v);
+        }
+        return number((uint64_t) v);
+    }
+
+    json_writer &add(const char *k, uint64_t v) {
+        key(k);
+        return number(v);
+    }
+
+    void end() {
+        if (_first) {
+            _out.push_back('{');
+        }
+        _out.push_back('}');
+    }
+};
+
 class string_util {
 public:
     static int split(const std::string &str, const std::string &sep, std::vector<std::string> &vec) {
@@ -148,4 +303,50 @@ public:
         ifs.close();
         return true;
     }
+};
+
+class ws_util {
+public:
+    //把body编码成一个已经加好帧头的websocket消息，可以原样发给任意多个连接
+    //服务端发出的帧不加掩码，同样的内容对每个连接编码结果都相同；send()遇到已编码的消息不再复制和编码，
+    //所有连接的发送队列共享同一块缓冲区，最后一个连接写完后释放
+    static server_t::message_ptr make_message(const std::string &body, websocketpp::frame::opcode::value op = websocketpp::frame::opcode::text) {
+        server_t::message_ptr msg = std::make_shared<server_t::message_type>(server_t::message_type::con_msg_man_ptr(), op, 0);
+        websocketpp::frame::basic_header header(op, body.size(), true, false);
+        websocketpp::frame::extended_header ext(body.size());
+        msg->set_header(websocketpp::frame::prepare_header(header, ext));
+        msg->set_payload(body);
+        msg->set_prepared(true);
+        return msg;
+    }
+
+    static server_t::message_ptr make_message(const Json::Value &root) {
+        std::string body;
+        json_util::serialize(root, body);
+        return make_message(body);
+    }
+};
+
+class io_util {
+public:
+    //在thread_num个线程上同时运行server的io_service，返回时所有工作线程都已退出
+    //websocketpp::config::asio开启了enable_multithreading，asio传输层会为每个连接创建strand，
+    //同一个连接上的读写回调始终串行执行，不同连接的回调可以在不同线程上并行执行
+    static void run(server_t &srv, size_t thread_num) {
+        if (thread_num == 0) {
+            thread_num = std::thread::hardware_concurrency();
+            if (thread_num == 0) {
+                thread_num = 1;
+            }
+        }
+        //当前线程也参与事件循环，所以只需额外创建thread_num-1个线程
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < thread_num; i++) {
+            workers.emplace_back([&srv]() { srv.run(); });
+        }
+        srv.run();
+        for (auto &th: workers) {
+            th.join();
+        }
+    }
 };
\ No newline at end of file